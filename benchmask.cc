@@ -0,0 +1,595 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+#include "realsense-align.hh"
+#include "realsense-mask.hh"
+#include "worker-pool.hh"
+
+
+// Count all allocations so that the allocations per frame can be reported.
+namespace {
+  std::atomic<uint64_t> nallocs = 0;
+}
+
+void* operator new(size_t size)
+{
+  nallocs.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size ?: 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+  nallocs.fetch_add(1, std::memory_order_relaxed);
+  auto a = size_t(align);
+  if (auto p = std::aligned_alloc(a, (std::max(size, 1zu) + a - 1) & ~(a - 1)))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+  std::free(p);
+}
+
+
+namespace {
+
+  // Synthetic input: a foreground blob in front of a noisy background.
+  struct scene {
+    scene(size_t width, size_t height, size_t nframes)
+    {
+      std::mt19937 rng(42);
+      std::uniform_int_distribution<unsigned> pixel(0, 255);
+      std::uniform_int_distribution<unsigned> noise(0, 200);
+
+      for (size_t f = 0; f < nframes; ++f) {
+        color.emplace_back(width * height * 3);
+        for (auto& c : color.back())
+          c = pixel(rng);
+
+        depth.emplace_back(width * height);
+        for (size_t y = 0; y < height; ++y)
+          for (size_t x = 0; x < width; ++x) {
+            auto dx = double(x) - double(width) / 2 - double(f) * 4;
+            auto dy = double(y) - double(height) * 0.6;
+            bool fg = dx * dx + dy * dy < double(height * height) / 9;
+            auto n = noise(rng);
+            depth.back()[y * width + x] = n < 10 ? 0 : (fg ? 3000 : 9000) + n;
+          }
+      }
+    }
+
+    std::vector<std::vector<uint8_t>> color;
+    std::vector<std::vector<uint16_t>> depth;
+  };
+
+
+  struct result {
+    size_t width;
+    size_t height;
+    realsense::video_format format;
+    size_t ndepth_history;
+    size_t nworkers;
+    bool in_place;
+    // RGBA output converted to NV12 in a separate pass, as OBS would do it.
+    bool converted;
+    // RGBA output with an alpha matte instead of the background color.
+    bool matte;
+    // Radius of the opening of the mask, zero without cleanup.
+    size_t cleanup_radius;
+    // Filling of the invalid depth values, with radius two.
+    realsense::hole_fill fill;
+    realsense::depth_filter filter;
+    // Compared with a learned background.
+    bool background;
+    // With the region of interest and the fraction of the pixels evaluated.
+    bool roi;
+    double evaluated_fraction;
+    // Composited over a backdrop, blurred with radius 16.
+    realsense::backdrop_mode backdrop;
+    // Memory of the history and the filter's values.
+    double state_bytes_per_pixel;
+    double ns_per_frame;
+    double allocs_per_frame;
+
+    double ns_per_pixel() const { return ns_per_frame / double(width * height); }
+    double frames_per_second() const { return 1e9 / ns_per_frame; }
+  };
+
+
+  const char* backdrop_name(realsense::backdrop_mode mode)
+  {
+    switch (mode) {
+    case realsense::backdrop_mode::color:
+      return "color";
+    case realsense::backdrop_mode::image:
+      return "image";
+    case realsense::backdrop_mode::blur:
+      return "blur";
+    }
+    return "?";
+  }
+
+
+  const char* fill_name(realsense::hole_fill fill)
+  {
+    switch (fill) {
+    case realsense::hole_fill::none:
+      return "none";
+    case realsense::hole_fill::nearest:
+      return "nearest";
+    case realsense::hole_fill::min:
+      return "min";
+    case realsense::hole_fill::median:
+      return "median";
+    }
+    return "?";
+  }
+
+
+  const char* filter_name(realsense::depth_filter filter)
+  {
+    switch (filter) {
+    case realsense::depth_filter::average:
+      return "average";
+    case realsense::depth_filter::ema:
+      return "ema";
+    case realsense::depth_filter::median:
+      return "median";
+    }
+    return "?";
+  }
+
+
+  const char* format_name(realsense::video_format format)
+  {
+    switch (format) {
+    case realsense::video_format::rgb:
+      return "rgb";
+    case realsense::video_format::rgba:
+      return "rgba";
+    case realsense::video_format::nv12:
+      return "nv12";
+    case realsense::video_format::i420:
+      return "i420";
+    }
+    return "?";
+  }
+
+
+  // Conversion of an RGBA frame to NV12 after the masking, a separate pass
+  // over the frame with the same coefficients as the fused kernels.
+  void rgba_to_nv12(uint8_t* dest, const uint8_t* src, size_t width, size_t height)
+  {
+    auto chroma = dest + width * height;
+    for (size_t y = 0; y < height; y += 2)
+      for (size_t x = 0; x < width; x += 2) {
+        int sum[3] = { 0, 0, 0 };
+        for (auto yy : { y, std::min(y + 1, height - 1) })
+          for (auto xx : { x, std::min(x + 1, width - 1) }) {
+            auto p = &src[4 * (yy * width + xx)];
+            dest[yy * width + xx] = uint8_t(((47 * p[0] + 157 * p[1] + 16 * p[2] + 128) >> 8) + 16);
+            for (size_t c = 0; c < 3; ++c)
+              sum[c] += p[c];
+          }
+        *chroma++ = uint8_t(((-26 * sum[0] - 86 * sum[1] + 112 * sum[2] + 512) >> 10) + 128);
+        *chroma++ = uint8_t(((112 * sum[0] - 102 * sum[1] - 10 * sum[2] + 512) >> 10) + 128);
+      }
+  }
+
+
+  const realsense::kernels* kern = nullptr;
+  size_t nframes = 120;
+
+
+  // With IN_PLACE the camera's frames have the output format and are
+  // masked without a separate output buffer.  With CONVERTED the RGBA
+  // output is converted to NV12 afterwards.  With MATTE an alpha matte
+  // with a feather band is written.  With a CLEANUP_RADIUS the mask is
+  // opened before it is applied.  FILL selects the hole filling and FILTER
+  // how the history is combined.  With BACKGROUND the first depth frame is
+  // learned as the background.  With ROI only the region around the
+  // foreground is evaluated.  BACKDROP selects what the foreground is
+  // composited over, the image is one of the color frames.
+  result measure(const scene& s, size_t width, size_t height, realsense::video_format format, size_t ndepth_history, worker_pool& pool, bool in_place = false, bool converted = false, bool matte = false, size_t cleanup_radius = 0, realsense::hole_fill fill = realsense::hole_fill::none, realsense::depth_filter filter = realsense::depth_filter::average, bool background = false, bool roi = false, realsense::backdrop_mode backdrop = realsense::backdrop_mode::color)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+
+    realsense::depth_mask mask(format, ndepth_history, color);
+    mask.resize(width, height);
+    mask.set_nworkers(pool.size());
+    mask.set_upper_limit(4000);
+    if (kern != nullptr)
+      mask.set_kernels(*kern);
+    if (matte) {
+      mask.set_alpha_matte(true);
+      mask.set_feather(500);
+    }
+    if (cleanup_radius > 0)
+      mask.set_cleanup(realsense::cleanup_op::open, cleanup_radius);
+    mask.set_hole_fill(fill, 2);
+    mask.set_depth_filter(filter);
+    if (background) {
+      mask.set_background(true, 100);
+      mask.capture_background(1);
+    }
+    mask.set_roi(roi);
+    mask.set_backdrop(backdrop, 16);
+    if (backdrop == realsense::backdrop_mode::image)
+      mask.set_backdrop_image(s.color.back().data(), width, height);
+    const size_t framesize = mask.get_framesize();
+    std::vector<uint8_t> dest(framesize);
+    std::vector<uint8_t> nv12(converted ? width * height * 3 / 2 : 0);
+
+    // The content of the pixels does not matter for the time.
+    std::vector<std::vector<uint8_t>> frames;
+    if (in_place) {
+      mask.set_source_bpp(mask.get_bpp());
+      frames.assign(s.color.size(), std::vector<uint8_t>(framesize));
+    }
+
+    auto frame = [&](size_t f) {
+      if (in_place) {
+        auto buf = frames[f % frames.size()].data();
+        mask.process(buf, framesize, buf, s.depth[f % s.depth.size()].data(), &pool);
+      } else
+        mask.process(dest.data(), framesize, s.color[f % s.color.size()].data(), s.depth[f % s.depth.size()].data(), &pool);
+      if (converted)
+        rgba_to_nv12(nv12.data(), dest.data(), width, height);
+    };
+
+    // Warm up, this also fills the history.
+    for (size_t f = 0; f < ndepth_history + 4; ++f)
+      frame(f);
+
+    auto allocs = nallocs.load(std::memory_order_relaxed);
+    size_t evaluated = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t f = 0; f < nframes; ++f) {
+      frame(f);
+      evaluated += mask.get_evaluated_pixels();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    allocs = nallocs.load(std::memory_order_relaxed) - allocs;
+
+    auto state_bytes = mask.history_length() * mask.history_stride * sizeof(uint16_t) + mask.depth_sum.size() * sizeof(uint32_t);
+
+    return { width, height, format, ndepth_history, pool.size(), in_place, converted, matte, cleanup_radius, fill, filter, background, roi, double(evaluated) / double(nframes * width * height), backdrop, double(state_bytes) / double(width * height), elapsed.count() / double(nframes), double(allocs) / double(nframes) };
+  }
+
+
+  void print(const result& r)
+  {
+    std::cout << std::setw(4) << r.width << "x" << std::left << std::setw(4) << r.height << std::right
+              << std::setw(5) << format_name(r.format) << "  history " << std::setw(2) << r.ndepth_history
+              << "  workers " << std::setw(2) << r.nworkers << std::fixed
+              << std::setw(9) << std::setprecision(3) << r.ns_per_pixel() << " ns/pixel"
+              << std::setw(9) << std::setprecision(1) << r.frames_per_second() << " frames/s"
+              << std::setw(7) << std::setprecision(2) << r.allocs_per_frame << " allocs/frame" << (r.in_place ? "  in place" : "") << (r.converted ? "  converted to nv12" : "") << (r.matte ? "  alpha matte" : "");
+    if (r.cleanup_radius > 0)
+      std::cout << "  opened radius " << r.cleanup_radius;
+    if (r.fill != realsense::hole_fill::none)
+      std::cout << "  " << fill_name(r.fill) << " hole filling";
+    if (r.filter != realsense::depth_filter::average)
+      std::cout << "  " << filter_name(r.filter) << " filter";
+    if (r.background)
+      std::cout << "  learned background";
+    if (r.roi)
+      std::cout << "  region of interest " << std::setprecision(1) << 100 * r.evaluated_fraction << "%";
+    if (r.backdrop != realsense::backdrop_mode::color)
+      std::cout << "  " << backdrop_name(r.backdrop) << " backdrop";
+    std::cout << std::endl;
+  }
+
+
+  void json(std::ostream& os, const result& r)
+  {
+    os << "    { \"width\": " << r.width << ", \"height\": " << r.height << ", \"format\": \"" << format_name(r.format)
+       << "\", \"history\": " << r.ndepth_history << ", \"workers\": " << r.nworkers << ", \"in_place\": " << (r.in_place ? "true" : "false")
+       << ", \"converted\": " << (r.converted ? "true" : "false") << ", \"matte\": " << (r.matte ? "true" : "false")
+       << ", \"cleanup_radius\": " << r.cleanup_radius << ", \"hole_fill\": \"" << fill_name(r.fill) << "\""
+       << ", \"filter\": \"" << filter_name(r.filter) << "\", \"state_bytes_per_pixel\": " << r.state_bytes_per_pixel
+       << ", \"background\": " << (r.background ? "true" : "false")
+       << ", \"roi\": " << (r.roi ? "true" : "false") << ", \"evaluated_fraction\": " << r.evaluated_fraction
+       << ", \"backdrop\": \"" << backdrop_name(r.backdrop) << "\""
+       << ", \"ns_per_pixel\": " << r.ns_per_pixel() << ", \"frames_per_second\": " << r.frames_per_second()
+       << ", \"allocations_per_frame\": " << r.allocs_per_frame << " }";
+  }
+
+
+  // Cost of aligning a depth frame with a color frame.
+  struct align_result {
+    size_t depth_width;
+    size_t depth_height;
+    size_t width;
+    size_t height;
+    const char* engine;
+    double ns_per_frame;
+  };
+
+
+  // Camera parameters similar to those of the D400 series.
+  realsense::intrinsics camera(size_t width, size_t height, realsense::distortion model)
+  {
+    auto f = float(width) * 0.75f;
+    return { width, height, float(width) / 2, float(height) / 2, f, f, model, { 0.05f, -0.1f, 0.001f, 0.001f, 0.02f } };
+  }
+
+
+  // What rs2::align computes for every frame: each depth pixel is
+  // deprojected, transformed into the color camera's coordinates, and
+  // projected.
+  void full_reprojection(uint16_t* dest, const uint16_t* src, const realsense::intrinsics& depth, const realsense::intrinsics& color, const realsense::extrinsics& extr, float depth_scale)
+  {
+    std::fill_n(dest, color.width * color.height, uint16_t(0));
+    const float* r = extr.rotation;
+    const float* t = extr.translation;
+    for (size_t y = 0; y < depth.height; ++y)
+      for (size_t x = 0; x < depth.width; ++x) {
+        auto z = src[y * depth.width + x];
+        if (z == 0)
+          continue;
+        float pt[2];
+        realsense::deproject(pt, depth, float(x), float(y));
+        auto zm = float(z) * depth_scale;
+        float p[3] = { pt[0] * zm, pt[1] * zm, zm };
+        float q[3] = {
+          r[0] * p[0] + r[3] * p[1] + r[6] * p[2] + t[0],
+          r[1] * p[0] + r[4] * p[1] + r[7] * p[2] + t[1],
+          r[2] * p[0] + r[5] * p[1] + r[8] * p[2] + t[2]
+        };
+        float px[2];
+        realsense::project(px, color, q);
+        auto cx = std::lround(px[0]);
+        auto cy = std::lround(px[1]);
+        if (cx >= 0 && size_t(cx) < color.width && cy >= 0 && size_t(cy) < color.height)
+          dest[size_t(cy) * color.width + size_t(cx)] = z;
+      }
+  }
+
+
+  std::vector<align_result> measure_align(size_t depth_width, size_t depth_height, size_t width, size_t height, worker_pool& pool)
+  {
+    auto depth = camera(depth_width, depth_height, realsense::distortion::brown_conrady);
+    auto color = camera(width, height, realsense::distortion::inverse_brown_conrady);
+    realsense::extrinsics extr = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0.015f, 0, 0 } };
+    const float depth_scale = 0.001f;
+
+    scene s(depth_width, depth_height, 8);
+    std::vector<uint16_t> dest(width * height);
+
+    auto time = [&](auto&& fn) {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t f = 0; f < nframes; ++f)
+        fn(s.depth[f % s.depth.size()].data());
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      return elapsed.count() / double(nframes);
+    };
+
+    std::vector<align_result> res;
+    res.push_back({ depth_width, depth_height, width, height, "full", time([&](const uint16_t* src) { full_reprojection(dest.data(), src, depth, color, extr, depth_scale); }) });
+    for (auto [engine, name] : { std::pair(realsense::align_engine::rays, "rays"), std::pair(realsense::align_engine::lookup, "lookup") }) {
+      realsense::depth_aligner aligner;
+      aligner.configure(engine, depth, color, extr, depth_scale, 1.0f);
+      res.push_back({ depth_width, depth_height, width, height, name, time([&](const uint16_t* src) { aligner.process(dest.data(), src, &pool); }) });
+    }
+    return res;
+  }
+
+
+  void print(const align_result& r)
+  {
+    std::cout << "align " << std::setw(4) << r.depth_width << "x" << std::left << std::setw(4) << r.depth_height << std::right
+              << " to " << std::setw(4) << r.width << "x" << std::left << std::setw(4) << r.height << std::right
+              << std::setw(7) << r.engine << std::fixed << std::setw(10) << std::setprecision(3) << r.ns_per_frame / 1e6 << " ms/frame" << std::endl;
+  }
+
+
+  void json(std::ostream& os, const align_result& r)
+  {
+    os << "    { \"depth_width\": " << r.depth_width << ", \"depth_height\": " << r.depth_height << ", \"width\": " << r.width
+       << ", \"height\": " << r.height << ", \"engine\": \"" << r.engine << "\", \"ns_per_frame\": " << r.ns_per_frame << " }";
+  }
+
+
+  void usage(const char* prog)
+  {
+    std::cerr << "usage: " << prog << " [-o FILE.json] [-k KERNEL] [-t WORKERS] [-n FRAMES] [-q]" << std::endl;
+    std::exit(1);
+  }
+
+} // anonymous namespace
+
+
+int main(int argc, char* argv[])
+{
+  std::string outname = "benchmask.json";
+  size_t nworkers = 1;
+  bool quick = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "o:k:t:n:q")) != -1)
+    switch (opt) {
+    case 'o':
+      outname = optarg;
+      break;
+    case 'k':
+      for (auto k : realsense::available_kernels())
+        if (strcmp(k->name, optarg) == 0)
+          kern = k;
+      if (kern == nullptr) {
+        std::cerr << "kernel " << optarg << " not available" << std::endl;
+        return 1;
+      }
+      break;
+    case 't':
+      nworkers = std::max(size_t(std::atoi(optarg)), 1zu);
+      break;
+    case 'n':
+      nframes = std::max(size_t(std::atoi(optarg)), 1zu);
+      break;
+    case 'q':
+      // Only a few frames and configurations, to check the program works.
+      quick = true;
+      nframes = 4;
+      break;
+    default:
+      usage(argv[0]);
+    }
+
+  std::vector<std::pair<size_t,size_t>> resolutions = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+  std::vector<size_t> histories = { 1, 2, 4, 8, 16 };
+  if (quick) {
+    resolutions.resize(1);
+    histories = { 1, 16 };
+  }
+  auto kernname = (kern ?: &realsense::select_kernels())->name;
+  std::cout << "kernel " << kernname << std::endl;
+
+  std::vector<result> matrix;
+  {
+    worker_pool pool(nworkers);
+    for (auto [width, height] : resolutions) {
+      scene s(width, height, 8);
+      for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba })
+        for (auto in_place : { false, true })
+          for (auto ndepth_history : histories) {
+            matrix.push_back(measure(s, width, height, format, ndepth_history, pool, in_place));
+            print(matrix.back());
+          }
+      for (auto ndepth_history : histories) {
+        matrix.push_back(measure(s, width, height, realsense::video_format::rgba, ndepth_history, pool, false, false, true));
+        print(matrix.back());
+      }
+      // The cost of the cleanup does not depend on the radius.
+      for (auto radius : quick ? std::vector<size_t>{ 1, 16 } : std::vector<size_t>{ 1, 2, 4, 8, 16, 32 }) {
+        matrix.push_back(measure(s, width, height, realsense::video_format::rgba, 4, pool, false, false, false, radius));
+        print(matrix.back());
+      }
+      for (auto fill : { realsense::hole_fill::nearest, realsense::hole_fill::min, realsense::hole_fill::median }) {
+        matrix.push_back(measure(s, width, height, realsense::video_format::rgba, 4, pool, false, false, false, 0, fill));
+        print(matrix.back());
+      }
+      // The memory traffic of the moving average does not grow with the
+      // length of the history, the median uses at most five frames.
+      for (auto filter : { realsense::depth_filter::ema, realsense::depth_filter::median })
+        for (auto ndepth_history : histories) {
+          matrix.push_back(measure(s, width, height, realsense::video_format::rgba, ndepth_history, pool, false, false, false, 0, realsense::hole_fill::none, filter));
+          print(matrix.back());
+        }
+      // The per-pixel limits of the learned background are computed in the
+      // same loop.
+      for (auto filter : { realsense::depth_filter::average, realsense::depth_filter::ema, realsense::depth_filter::median }) {
+        matrix.push_back(measure(s, width, height, realsense::video_format::rgba, 4, pool, false, false, false, 0, realsense::hole_fill::none, filter, true));
+        print(matrix.back());
+      }
+      // Only the region around the foreground is evaluated, the rest is
+      // filled with the background color.
+      for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12 }) {
+        matrix.push_back(measure(s, width, height, format, 4, pool, false, false, false, 0, realsense::hole_fill::none, realsense::depth_filter::average, false, true));
+        print(matrix.back());
+      }
+      // Compositing over a backdrop replaces the selection of the
+      // background color, the blur is an additional pass.
+      for (auto backdrop : { realsense::backdrop_mode::image, realsense::backdrop_mode::blur })
+        for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12 }) {
+          matrix.push_back(measure(s, width, height, format, 4, pool, false, false, false, 0, realsense::hole_fill::none, realsense::depth_filter::average, false, false, backdrop));
+          print(matrix.back());
+        }
+      // The YUV formats are produced directly, compared with RGBA output
+      // followed by the conversion.
+      for (auto ndepth_history : histories) {
+        matrix.push_back(measure(s, width, height, realsense::video_format::rgba, ndepth_history, pool, false, true));
+        print(matrix.back());
+        for (auto format : { realsense::video_format::nv12, realsense::video_format::i420 }) {
+          matrix.push_back(measure(s, width, height, format, ndepth_history, pool));
+          print(matrix.back());
+        }
+      }
+    }
+  }
+
+  // Scaling with the number of threads for the largest configuration.
+  std::vector<result> scaling;
+  {
+    auto [width, height] = resolutions.back();
+    scene s(width, height, 8);
+    auto maxworkers = std::max(size_t(std::thread::hardware_concurrency()), 1zu);
+    for (size_t n = 1; n <= maxworkers; n = n < 4 ? n + 1 : n * 2) {
+      worker_pool pool(n);
+      scaling.push_back(measure(s, width, height, realsense::video_format::rgba, histories.back(), pool));
+      print(scaling.back());
+    }
+  }
+
+  // Alignment of the depth frames with the color frames.
+  std::vector<align_result> alignment;
+  {
+    std::vector<std::tuple<size_t,size_t,size_t,size_t>> pairs = { { 640, 480, 1280, 720 }, { 640, 480, 1920, 1080 }, { 1024, 768, 1920, 1080 } };
+    if (quick)
+      pairs.resize(1);
+    worker_pool pool(nworkers);
+    for (auto [depth_width, depth_height, width, height] : pairs)
+      for (const auto& r : measure_align(depth_width, depth_height, width, height, pool)) {
+        alignment.push_back(r);
+        print(r);
+      }
+  }
+
+  std::ofstream out(outname);
+  out << "{\n  \"kernel\": \"" << kernname << "\",\n  \"frames\": " << nframes << ",\n  \"matrix\": [\n";
+  for (size_t i = 0; i < matrix.size(); ++i) {
+    json(out, matrix[i]);
+    out << (i + 1 < matrix.size() ? ",\n" : "\n");
+  }
+  out << "  ],\n  \"scaling\": [\n";
+  for (size_t i = 0; i < scaling.size(); ++i) {
+    json(out, scaling[i]);
+    out << (i + 1 < scaling.size() ? ",\n" : "\n");
+  }
+  out << "  ],\n  \"alignment\": [\n";
+  for (size_t i = 0; i < alignment.size(); ++i) {
+    json(out, alignment[i]);
+    out << (i + 1 < alignment.size() ? ",\n" : "\n");
+  }
+  out << "  ]\n}\n";
+
+  if (! out) {
+    std::cerr << "cannot write " << outname << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
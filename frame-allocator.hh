@@ -0,0 +1,65 @@
+#ifndef _FRAME_ALLOCATOR_HH
+#define _FRAME_ALLOCATOR_HH 1
+
+#include <algorithm>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include <sys/mman.h>
+
+
+// Memory for buffers with one or more values per pixel.  They are allocated
+// when the resolution or a setting changes, never for a frame.  All buffers
+// start at a cache line boundary.  Buffers of at least a huge page are
+// aligned to the huge page size and the kernel is asked to back them with
+// huge pages: each frame traverses all of them, with 4kB pages a 1920×1080
+// frame with a depth filter of 16 needs more than 16,000 TLB entries.
+constexpr size_t frame_memory_alignment(size_t bytes)
+{
+  constexpr size_t huge_page = 2 * 1024 * 1024;
+  return bytes >= huge_page ? huge_page : 64;
+}
+
+
+inline void* allocate_frame_memory(size_t bytes)
+{
+  auto align = frame_memory_alignment(bytes);
+  auto size = (std::max(bytes, size_t(1)) + align - 1) & ~(align - 1);
+  auto p = ::operator new(size, std::align_val_t(align));
+#ifdef MADV_HUGEPAGE
+  if (align > 64)
+    // Only a hint, it fails without transparent huge pages.
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+
+inline void free_frame_memory(void* p, size_t bytes)
+{
+  ::operator delete(p, std::align_val_t(frame_memory_alignment(bytes)));
+}
+
+
+// Allocator for the standard containers.
+template<typename T>
+struct frame_allocator {
+  using value_type = T;
+
+  frame_allocator() = default;
+  template<typename U>
+  frame_allocator(const frame_allocator<U>&) {}
+
+  T* allocate(size_t n) { return static_cast<T*>(allocate_frame_memory(n * sizeof(T))); }
+  void deallocate(T* p, size_t n) { free_frame_memory(p, n * sizeof(T)); }
+
+  template<typename U>
+  bool operator==(const frame_allocator<U>&) const { return true; }
+};
+
+
+template<typename T>
+using frame_vector = std::vector<T, frame_allocator<T>>;
+
+#endif // frame-allocator.hh
@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+
+#include "frame-stats.hh"
+
+
+void latency_histogram::record(uint64_t ns)
+{
+  auto idx = std::min<size_t>(std::bit_width(ns / first_limit_ns), nbuckets - 1);
+  buckets[idx].fetch_add(1, std::memory_order_relaxed);
+  sum_ns.fetch_add(ns, std::memory_order_relaxed);
+  // There is only one writer.
+  if (ns > max_ns.load(std::memory_order_relaxed))
+    max_ns.store(ns, std::memory_order_relaxed);
+}
+
+
+uint64_t latency_histogram::count() const
+{
+  uint64_t res = 0;
+  for (const auto& b : buckets)
+    res += b.load(std::memory_order_relaxed);
+  return res;
+}
+
+
+double latency_histogram::mean_ms() const
+{
+  auto n = count();
+  return n == 0 ? 0.0 : double(sum_ns.load(std::memory_order_relaxed)) / double(n) / 1e6;
+}
+
+
+double latency_histogram::max_ms() const
+{
+  return double(max_ns.load(std::memory_order_relaxed)) / 1e6;
+}
+
+
+double latency_histogram::quantile_ms(double q) const
+{
+  auto n = count();
+  if (n == 0)
+    return 0.0;
+
+  auto target = uint64_t(q * double(n));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < nbuckets - 1; ++i) {
+    seen += buckets[i].load(std::memory_order_relaxed);
+    if (seen > target)
+      return double(first_limit_ns << i) / 1e6;
+  }
+  return max_ms();
+}
+
+
+std::string latency_histogram::summary() const
+{
+  if (count() == 0)
+    return "no data";
+
+  char buf[100];
+  snprintf(buf, sizeof(buf), "mean %.2f ms, p50 ≤ %g ms, p99 ≤ %g ms, max %.2f ms", mean_ms(), quantile_ms(0.5), quantile_ms(0.99), max_ms());
+  return buf;
+}
@@ -0,0 +1,82 @@
+#ifndef _FRAME_STATS_HH
+#define _FRAME_STATS_HH 1
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+// Monotonic time in nanoseconds.  All stage timestamps use this clock.
+inline uint64_t monotonic_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Wall-clock time in nanoseconds since the epoch.  librealsense reports
+// frame timestamps in the system time domain using this clock.
+inline uint64_t system_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+// Distribution of durations in fixed buckets.  Recording a value costs a
+// few atomic additions, no locks and no allocation.  One thread records
+// values, any thread can read them.
+struct latency_histogram {
+  // The upper limits of the buckets are 125µs times powers of two.  The
+  // last bucket collects everything longer than 128ms.
+  static constexpr size_t nbuckets = 12;
+  static constexpr uint64_t first_limit_ns = 125'000;
+
+  void record(uint64_t ns);
+
+  uint64_t count() const;
+  double mean_ms() const;
+  double max_ms() const;
+  // Upper limit of the bucket which contains the quantile Q.  For the last
+  // bucket this is the maximum.
+  double quantile_ms(double q) const;
+
+  // One line, e.g. "mean 1.20 ms, p50 ≤ 2 ms, p99 ≤ 4 ms, max 3.10 ms".
+  std::string summary() const;
+
+private:
+  std::atomic<uint64_t> buckets[nbuckets] = {};
+  std::atomic<uint64_t> sum_ns = 0;
+  std::atomic<uint64_t> max_ns = 0;
+};
+
+
+// Timing of the stages of the pipeline.  The processing thread records
+// the time waiting for a frameset, the alignment and the masking.  The
+// consumer of the processed frames records the output and the latencies
+// of the complete pipeline.
+struct frame_stats {
+  latency_histogram wait;
+  latency_histogram align;
+  latency_histogram mask;
+  latency_histogram output;
+  // From the arrival of the frameset in the capture callback.
+  latency_histogram capture_to_output;
+  // From the timestamp of the sensor.  Only available if the camera's
+  // clock is mapped to the system time.
+  latency_histogram sensor_to_output;
+
+  // Framesets without depth or color frame.
+  std::atomic<uint64_t> empty = 0;
+  // Frames handed to the output more than a frame interval after they
+  // arrived.
+  std::atomic<uint64_t> late = 0;
+  // Frames with a timestamp not after the previous frame's, not output.
+  std::atomic<uint64_t> out_of_order = 0;
+
+  // Pixels of the masked frames and how many of them were inside the
+  // region of interest.
+  std::atomic<uint64_t> pixels = 0;
+  std::atomic<uint64_t> evaluated_pixels = 0;
+};
+
+#endif // frame-stats.hh
@@ -1,6 +1,12 @@
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
+#include <set>
+#include <sstream>
+#include <string>
 #include <thread>
+#include <tuple>
+#include <vector>
 
 #include <obs/obs.h>
 #include <obs/obs-frontend-api.h>
@@ -33,42 +39,167 @@ namespace {
 
     void set_serial(const char* new_serial) { serial = new_serial; }
     void set_resolution(const char* new_resolution) { resolution = new_resolution; }
+    void set_framerate(int new_framerate) { framerate = new_framerate; }
+    void set_depthresolution(const char* new_depthresolution) { depthresolution = new_depthresolution; }
     void set_backgroundcolor(int new_backgroundcolor) { backgroundcolor = new_backgroundcolor; }
     void set_maxdistance(double new_maxdistance) { maxdistance = new_maxdistance; }
     void set_depthfilter(int new_depthfilter) { depthfilter = new_depthfilter; }
+    void set_depthfiltermode(int new_depthfiltermode) { depthfiltermode = new_depthfiltermode; }
+    void set_workers(int new_workers) { workers = new_workers; }
+    void set_alignengine(int new_alignengine) { alignengine = new_alignengine; }
+    void set_maskinplace(bool new_maskinplace) { maskinplace = new_maskinplace; }
+    void set_videoformat(int new_videoformat) { videoformat = new_videoformat; }
+    void set_directalpha(bool new_directalpha) { directalpha = new_directalpha; }
+    void set_feather(double new_feather) { feather = new_feather; }
+    void set_cleanup(int new_cleanup) { cleanup = new_cleanup; }
+    void set_cleanupradius(int new_cleanupradius) { cleanupradius = new_cleanupradius; }
+    void set_holefill(int new_holefill) { holefill = new_holefill; }
+    void set_holefillradius(int new_holefillradius) { holefillradius = new_holefillradius; }
+    void set_usebackground(bool new_usebackground) { usebackground = new_usebackground; }
+    void set_backgroundmargin(double new_backgroundmargin) { backgroundmargin = new_backgroundmargin; }
+    void set_savebackground(bool new_savebackground) { savebackground = new_savebackground; }
+    void set_roi(bool new_roi) { roi = new_roi; }
+    void set_backdrop(int new_backdrop) { backdrop = new_backdrop; }
+    void set_backdropimage(const char* new_backdropimage) { backdropimage = new_backdropimage; }
+    void set_blurradius(int new_blurradius) { blurradius = new_blurradius; }
+    void set_replayfile(const char* new_replayfile) { replayfile = new_replayfile; }
+    void set_replayrealtime(bool new_replayrealtime) { replayrealtime = new_replayrealtime; }
+    void set_recordfile(const char* new_recordfile) { recordfile = new_recordfile; }
+    void set_statsinterval(int new_statsinterval) { statsinterval = new_statsinterval; }
+    void set_capabilities(const std::string& new_capabilities) { capabilities = new_capabilities; }
     const std::string& get_serial() const { return serial; }
     const std::string& get_resolution() const { return resolution; }
+    int get_framerate() const { return framerate; }
+    const std::string& get_depthresolution() const { return depthresolution; }
     int get_backgroundcolor() const { return backgroundcolor; }
     double get_maxdistance() const { return maxdistance; }
     int get_depthfilter() const { return depthfilter; }
+    int get_depthfiltermode() const { return depthfiltermode; }
+    int get_workers() const { return workers; }
+    int get_alignengine() const { return alignengine; }
+    bool get_maskinplace() const { return maskinplace; }
+    int get_videoformat() const { return videoformat; }
+    bool get_directalpha() const { return directalpha; }
+    double get_feather() const { return feather; }
+    int get_cleanup() const { return cleanup; }
+    int get_cleanupradius() const { return cleanupradius; }
+    int get_holefill() const { return holefill; }
+    int get_holefillradius() const { return holefillradius; }
+    bool get_usebackground() const { return usebackground; }
+    double get_backgroundmargin() const { return backgroundmargin; }
+    bool get_savebackground() const { return savebackground; }
+    bool get_roi() const { return roi; }
+    int get_backdrop() const { return backdrop; }
+    const std::string& get_backdropimage() const { return backdropimage; }
+    int get_blurradius() const { return blurradius; }
+    const std::string& get_replayfile() const { return replayfile; }
+    bool get_replayrealtime() const { return replayrealtime; }
+    const std::string& get_recordfile() const { return recordfile; }
+    int get_statsinterval() const { return statsinterval; }
+    const std::string& get_capabilities() const { return capabilities; }
 
   private:
     std::string serial;
     std::string resolution;
+    int framerate;
+    std::string depthresolution;
     int backgroundcolor;
     double maxdistance;
     int depthfilter;
+    int depthfiltermode;
+    int workers;
+    int alignengine;
+    bool maskinplace;
+    int videoformat;
+    bool directalpha;
+    double feather;
+    int cleanup;
+    int cleanupradius;
+    int holefill;
+    int holefillradius;
+    bool usebackground;
+    double backgroundmargin;
+    bool savebackground;
+    bool roi;
+    int backdrop;
+    std::string backdropimage;
+    int blurradius;
+    std::string replayfile;
+    bool replayrealtime;
+    std::string recordfile;
+    int statsinterval;
+    std::string capabilities;
 
     static constexpr char section_name[] = "realsense-greenscreen";
     static constexpr char param_serial[] = "serial";
     static constexpr char param_resolution[] = "resolution";
+    static constexpr char param_framerate[] = "framerate";
+    static constexpr char param_depthresolution[] = "depthresolution";
     static constexpr char param_backgroundcolor[] = "backgroundcolor";
     static constexpr char param_maxdistance[] = "maxdistance";
     static constexpr char param_depthfilter[] = "depthfilter";
+    static constexpr char param_depthfiltermode[] = "depthfiltermode";
+    static constexpr char param_workers[] = "workers";
+    static constexpr char param_alignengine[] = "alignengine";
+    static constexpr char param_maskinplace[] = "maskinplace";
+    static constexpr char param_videoformat[] = "videoformat";
+    static constexpr char param_directalpha[] = "directalpha";
+    static constexpr char param_feather[] = "feather";
+    static constexpr char param_cleanup[] = "cleanup";
+    static constexpr char param_cleanupradius[] = "cleanupradius";
+    static constexpr char param_holefill[] = "holefill";
+    static constexpr char param_holefillradius[] = "holefillradius";
+    static constexpr char param_usebackground[] = "usebackground";
+    static constexpr char param_backgroundmargin[] = "backgroundmargin";
+    static constexpr char param_savebackground[] = "savebackground";
+    static constexpr char param_roi[] = "roi";
+    static constexpr char param_backdrop[] = "backdrop";
+    static constexpr char param_backdropimage[] = "backdropimage";
+    static constexpr char param_blurradius[] = "blurradius";
+    static constexpr char param_replayfile[] = "replayfile";
+    static constexpr char param_replayrealtime[] = "replayrealtime";
+    static constexpr char param_recordfile[] = "recordfile";
+    static constexpr char param_statsinterval[] = "statsinterval";
+    static constexpr char param_capabilities[] = "capabilities";
 
     static void on_frontend_event(enum obs_frontend_event event, void* param);
   };
 
   config_type::config_type()
-  : serial(""), resolution("")
+  : serial(""), resolution(""), depthresolution(""), backdropimage(""), replayfile(""), recordfile(""), capabilities("")
   {
     config_t* obs_config = obs_frontend_get_profile_config();
     if (obs_config != nullptr) {
       config_set_default_string(obs_config, section_name, param_serial, serial.c_str());
       config_set_default_string(obs_config, section_name, param_resolution, resolution.c_str());
+      config_set_default_int(obs_config, section_name, param_framerate, 0);
+      config_set_default_string(obs_config, section_name, param_depthresolution, depthresolution.c_str());
       config_set_default_int(obs_config, section_name, param_backgroundcolor, 0xdd44ff);
       config_set_default_double(obs_config, section_name, param_maxdistance, 1.0);
       config_set_default_int(obs_config, section_name, param_depthfilter, 4);
+      config_set_default_int(obs_config, section_name, param_depthfiltermode, int(realsense::depth_filter::average));
+      config_set_default_int(obs_config, section_name, param_workers, 1);
+      config_set_default_int(obs_config, section_name, param_alignengine, int(realsense::align_engine::librealsense));
+      config_set_default_bool(obs_config, section_name, param_maskinplace, false);
+      config_set_default_int(obs_config, section_name, param_videoformat, int(realsense::video_format::rgba));
+      config_set_default_bool(obs_config, section_name, param_directalpha, false);
+      config_set_default_double(obs_config, section_name, param_feather, 0.05);
+      config_set_default_int(obs_config, section_name, param_cleanup, int(realsense::cleanup_op::none));
+      config_set_default_int(obs_config, section_name, param_cleanupradius, 1);
+      config_set_default_int(obs_config, section_name, param_holefill, int(realsense::hole_fill::none));
+      config_set_default_int(obs_config, section_name, param_holefillradius, 1);
+      config_set_default_bool(obs_config, section_name, param_usebackground, false);
+      config_set_default_double(obs_config, section_name, param_backgroundmargin, 0.05);
+      config_set_default_bool(obs_config, section_name, param_savebackground, true);
+      config_set_default_bool(obs_config, section_name, param_roi, false);
+      config_set_default_int(obs_config, section_name, param_backdrop, int(realsense::backdrop_mode::color));
+      config_set_default_string(obs_config, section_name, param_backdropimage, backdropimage.c_str());
+      config_set_default_int(obs_config, section_name, param_blurradius, 16);
+      config_set_default_string(obs_config, section_name, param_replayfile, replayfile.c_str());
+      config_set_default_bool(obs_config, section_name, param_replayrealtime, true);
+      config_set_default_string(obs_config, section_name, param_recordfile, recordfile.c_str());
+      config_set_default_int(obs_config, section_name, param_statsinterval, 60);
+      config_set_default_string(obs_config, section_name, param_capabilities, capabilities.c_str());
     }
   }
 
@@ -83,9 +214,34 @@ namespace {
 
     serial = config_get_string(obs_config, section_name, param_serial);
     resolution = config_get_string(obs_config, section_name, param_resolution);
+    framerate = config_get_int(obs_config, section_name, param_framerate);
+    depthresolution = config_get_string(obs_config, section_name, param_depthresolution);
     backgroundcolor = config_get_int(obs_config, section_name, param_backgroundcolor);
     maxdistance = config_get_double(obs_config, section_name, param_maxdistance);
     depthfilter = config_get_int(obs_config, section_name, param_depthfilter);
+    depthfiltermode = config_get_int(obs_config, section_name, param_depthfiltermode);
+    workers = config_get_int(obs_config, section_name, param_workers);
+    alignengine = config_get_int(obs_config, section_name, param_alignengine);
+    maskinplace = config_get_bool(obs_config, section_name, param_maskinplace);
+    videoformat = config_get_int(obs_config, section_name, param_videoformat);
+    directalpha = config_get_bool(obs_config, section_name, param_directalpha);
+    feather = config_get_double(obs_config, section_name, param_feather);
+    cleanup = config_get_int(obs_config, section_name, param_cleanup);
+    cleanupradius = config_get_int(obs_config, section_name, param_cleanupradius);
+    holefill = config_get_int(obs_config, section_name, param_holefill);
+    holefillradius = config_get_int(obs_config, section_name, param_holefillradius);
+    usebackground = config_get_bool(obs_config, section_name, param_usebackground);
+    backgroundmargin = config_get_double(obs_config, section_name, param_backgroundmargin);
+    savebackground = config_get_bool(obs_config, section_name, param_savebackground);
+    roi = config_get_bool(obs_config, section_name, param_roi);
+    backdrop = config_get_int(obs_config, section_name, param_backdrop);
+    backdropimage = config_get_string(obs_config, section_name, param_backdropimage);
+    blurradius = config_get_int(obs_config, section_name, param_blurradius);
+    replayfile = config_get_string(obs_config, section_name, param_replayfile);
+    replayrealtime = config_get_bool(obs_config, section_name, param_replayrealtime);
+    recordfile = config_get_string(obs_config, section_name, param_recordfile);
+    statsinterval = config_get_int(obs_config, section_name, param_statsinterval);
+    capabilities = config_get_string(obs_config, section_name, param_capabilities);
   }
 
   void config_type::save()
@@ -94,9 +250,34 @@ namespace {
 
     config_set_string(obs_config, section_name, param_serial, serial.c_str());
     config_set_string(obs_config, section_name, param_resolution, resolution.c_str());
+    config_set_int(obs_config, section_name, param_framerate, framerate);
+    config_set_string(obs_config, section_name, param_depthresolution, depthresolution.c_str());
     config_set_int(obs_config, section_name, param_backgroundcolor, backgroundcolor);
     config_set_double(obs_config, section_name, param_maxdistance, maxdistance);
     config_set_int(obs_config, section_name, param_depthfilter, depthfilter);
+    config_set_int(obs_config, section_name, param_depthfiltermode, depthfiltermode);
+    config_set_int(obs_config, section_name, param_workers, workers);
+    config_set_int(obs_config, section_name, param_alignengine, alignengine);
+    config_set_bool(obs_config, section_name, param_maskinplace, maskinplace);
+    config_set_int(obs_config, section_name, param_videoformat, videoformat);
+    config_set_bool(obs_config, section_name, param_directalpha, directalpha);
+    config_set_double(obs_config, section_name, param_feather, feather);
+    config_set_int(obs_config, section_name, param_cleanup, cleanup);
+    config_set_int(obs_config, section_name, param_cleanupradius, cleanupradius);
+    config_set_int(obs_config, section_name, param_holefill, holefill);
+    config_set_int(obs_config, section_name, param_holefillradius, holefillradius);
+    config_set_bool(obs_config, section_name, param_usebackground, usebackground);
+    config_set_double(obs_config, section_name, param_backgroundmargin, backgroundmargin);
+    config_set_bool(obs_config, section_name, param_savebackground, savebackground);
+    config_set_bool(obs_config, section_name, param_roi, roi);
+    config_set_int(obs_config, section_name, param_backdrop, backdrop);
+    config_set_string(obs_config, section_name, param_backdropimage, backdropimage.c_str());
+    config_set_int(obs_config, section_name, param_blurradius, blurradius);
+    config_set_string(obs_config, section_name, param_replayfile, replayfile.c_str());
+    config_set_bool(obs_config, section_name, param_replayrealtime, replayrealtime);
+    config_set_string(obs_config, section_name, param_recordfile, recordfile.c_str());
+    config_set_int(obs_config, section_name, param_statsinterval, statsinterval);
+    config_set_string(obs_config, section_name, param_capabilities, capabilities.c_str());
 
     config_save(obs_config);
   }
@@ -105,70 +286,272 @@ namespace {
   std::unique_ptr<config_type> config;
 
 
+  // Unknown values select the exact alignment.
+  realsense::align_engine to_align_engine(long long val)
+  {
+    switch (val) {
+    case int(realsense::align_engine::rays):
+      return realsense::align_engine::rays;
+    case int(realsense::align_engine::lookup):
+      return realsense::align_engine::lookup;
+    default:
+      return realsense::align_engine::librealsense;
+    }
+  }
+
+
+  // OBS has no format for three-byte RGB pixels.  Unknown values select RGBA.
+  realsense::video_format to_video_format(long long val)
+  {
+    switch (val) {
+    case int(realsense::video_format::nv12):
+      return realsense::video_format::nv12;
+    case int(realsense::video_format::i420):
+      return realsense::video_format::i420;
+    default:
+      return realsense::video_format::rgba;
+    }
+  }
+
+
+  // Unknown values select the average.
+  realsense::depth_filter to_depth_filter(long long val)
+  {
+    switch (val) {
+    case int(realsense::depth_filter::ema):
+      return realsense::depth_filter::ema;
+    case int(realsense::depth_filter::median):
+      return realsense::depth_filter::median;
+    default:
+      return realsense::depth_filter::average;
+    }
+  }
+
+
+  // Unknown values disable the cleanup.
+  realsense::cleanup_op to_cleanup_op(long long val)
+  {
+    switch (val) {
+    case int(realsense::cleanup_op::erode):
+      return realsense::cleanup_op::erode;
+    case int(realsense::cleanup_op::dilate):
+      return realsense::cleanup_op::dilate;
+    case int(realsense::cleanup_op::open):
+      return realsense::cleanup_op::open;
+    case int(realsense::cleanup_op::close):
+      return realsense::cleanup_op::close;
+    default:
+      return realsense::cleanup_op::none;
+    }
+  }
+
+
+  // Unknown values disable the filling.
+  realsense::hole_fill to_hole_fill(long long val)
+  {
+    switch (val) {
+    case int(realsense::hole_fill::nearest):
+      return realsense::hole_fill::nearest;
+    case int(realsense::hole_fill::min):
+      return realsense::hole_fill::min;
+    case int(realsense::hole_fill::median):
+      return realsense::hole_fill::median;
+    default:
+      return realsense::hole_fill::none;
+    }
+  }
+
+
+  // Unknown values use the background color.
+  realsense::backdrop_mode to_backdrop_mode(long long val)
+  {
+    switch (val) {
+    case int(realsense::backdrop_mode::image):
+      return realsense::backdrop_mode::image;
+    case int(realsense::backdrop_mode::blur):
+      return realsense::backdrop_mode::blur;
+    default:
+      return realsense::backdrop_mode::color;
+    }
+  }
+
+
+  // The image is decoded by OBS and converted to RGB.  Without a file, or
+  // if it cannot be read, the result is empty.
+  std::tuple<std::vector<uint8_t>, size_t, size_t> load_backdrop_image(const std::string& file)
+  {
+    if (file.empty())
+      return { };
+
+    gs_color_format format = GS_UNKNOWN;
+    uint32_t cx = 0;
+    uint32_t cy = 0;
+    auto data = gs_create_texture_file_data(file.c_str(), &format, &cx, &cy);
+    if (data == nullptr || (format != GS_RGBA && format != GS_BGRA && format != GS_BGRX)) {
+      blog(LOG_WARNING, "obs-realsense: cannot use background image %s", file.c_str());
+      bfree(data);
+      return { };
+    }
+
+    const bool bgr = format != GS_RGBA;
+    std::vector<uint8_t> pixels(size_t(cx) * cy * 3);
+    for (size_t i = 0; i < size_t(cx) * cy; ++i) {
+      pixels[3 * i] = data[4 * i + (bgr ? 2 : 0)];
+      pixels[3 * i + 1] = data[4 * i + 1];
+      pixels[3 * i + 2] = data[4 * i + (bgr ? 0 : 2)];
+    }
+    bfree(data);
+    return { std::move(pixels), cx, cy };
+  }
+
+
+  // The learned background is stored in the directory of the profile.
+  std::string profile_dir()
+  {
+    std::string res;
+    if (auto path = obs_frontend_get_current_profile_path(); path != nullptr) {
+      res = path;
+      bfree(path);
+    }
+    return res;
+  }
+
+
+  // Duration of the capture of the background.
+  constexpr float background_capture_seconds = 3.0f;
+
+
   struct plugin_context {
     plugin_context(obs_source_t* source_);
     ~plugin_context();
 
     static void call_video_thread(plugin_context* p) { p->video_thread(); }
     void video_thread();
+    void log_stats();
+    void set_backdrop_image(const std::string& file);
 
     obs_source_t* source;
     realsense::greenscreen cam;
     std::thread thread;
-    std::atomic<bool> terminate = false;
 
-    // Camera frequency (picture per second)
-    static constexpr uint64_t freq = 30;
-    // Derived delay between picture transfers.
-    static constexpr uint64_t delay = 1'000'000'000 / freq;
+    // The image file currently used as backdrop, it is only read again
+    // when the name changes.
+    std::string backdrop_file;
+
+    // Interval of the statistics in the log, zero to disable.
+    std::atomic<uint64_t> stats_interval = 0;
   };
 
 
   plugin_context::plugin_context(obs_source_t* source_)
   : source(source_),
-    cam(realsense::video_format::rgba),
+    // A recording can be used without a camera.
+    cam(to_video_format(config->get_videoformat()), config->get_serial() == realsense::greenscreen::replay_serial ? config->get_replayfile() : "", config->get_replayrealtime()),
     thread(call_video_thread, this)
   {
+    cam.set_replay(config->get_replayfile(), config->get_replayrealtime());
     if (! config->get_serial().empty() || ! config->get_resolution().empty())
-      cam.new_config(config->get_serial(), config->get_resolution());
+      cam.new_config(config->get_serial(), config->get_resolution(), config->get_framerate(), config->get_depthresolution());
     cam.set_color(config->get_backgroundcolor());
     cam.set_max_distance(config->get_maxdistance());
     cam.set_ndepth_history(config->get_depthfilter());
+    cam.set_depth_filter(to_depth_filter(config->get_depthfiltermode()));
+    cam.set_nworkers(config->get_workers());
+    cam.set_align_engine(to_align_engine(config->get_alignengine()));
+    cam.set_in_place(config->get_maskinplace());
+    cam.set_alpha_matte(config->get_directalpha());
+    cam.set_feather(config->get_feather());
+    cam.set_cleanup(to_cleanup_op(config->get_cleanup()), size_t(std::max(config->get_cleanupradius(), 1)));
+    cam.set_hole_fill(to_hole_fill(config->get_holefill()), size_t(std::max(config->get_holefillradius(), 1)));
+    cam.set_background(config->get_usebackground(), config->get_backgroundmargin());
+    if (config->get_savebackground())
+      cam.set_background_dir(profile_dir());
+    cam.set_roi(config->get_roi());
+    cam.set_backdrop(to_backdrop_mode(config->get_backdrop()), size_t(std::max(config->get_blurradius(), 1)));
+    set_backdrop_image(config->get_backdropimage());
+    // The camera is started in the background, loading the scene does not
+    // wait for it.
+    cam.open();
+    stats_interval = uint64_t(std::max(config->get_statsinterval(), 0)) * 1'000'000'000;
   }
 
 
   plugin_context::~plugin_context()
   {
-    terminate = true;
+    cam.close_output();
     thread.join();
+
+    log_stats();
   }
 
 
-  void plugin_context::video_thread()
+  void plugin_context::set_backdrop_image(const std::string& file)
   {
-    auto framesize = cam.get_framesize();
-    std::unique_ptr<uint8_t[]> mem(new uint8_t[framesize]);
+    if (file != backdrop_file) {
+      auto [pixels, width, height] = load_backdrop_image(file);
+      cam.set_backdrop_image(std::move(pixels), width, height);
+      backdrop_file = file;
+    }
+  }
 
-    obs_source_frame obs_frame;
-    memset(&obs_frame, '\0', sizeof(obs_frame));
-    obs_frame.data[0] = mem.get();
-    // obs_frame.linesize[0] = cam.get_width() * cam.get_bpp();
-    // obs_frame.width = cam.get_width();
-    // obs_frame.height = cam.get_height();
-    obs_frame.format = VIDEO_FORMAT_RGBA;
 
-    auto cur_time = os_gettime_ns();
+  void plugin_context::log_stats()
+  {
+    std::istringstream summary(cam.stats_summary());
+    for (std::string line; std::getline(summary, line); )
+      blog(log_level, "obs-realsense: %s", line.c_str());
+  }
 
-    while (! terminate) {
-      cam.get_frame(mem.get(), framesize);
-      obs_frame.linesize[0] = cam.get_width() * cam.get_bpp();
-      obs_frame.width = cam.get_width();
-      obs_frame.height = cam.get_height();
 
-      obs_frame.timestamp = cur_time;
+  // The output stage of the pipeline.  It forwards each frame the
+  // processing thread of the camera produces as soon as it is available.
+  // The camera determines the frame rate.
+  void plugin_context::video_thread()
+  {
+    obs_source_frame obs_frame;
+    memset(&obs_frame, '\0', sizeof(obs_frame));
+    // Only used for the YUV formats.
+    video_format_get_parameters(VIDEO_CS_709, VIDEO_RANGE_PARTIAL, obs_frame.color_matrix, obs_frame.color_range_min, obs_frame.color_range_max);
+
+    auto last_log = monotonic_ns();
+
+    while (auto frame = cam.next_frame()) {
+      // OBS copies the frame, the camera's buffer can be passed directly.
+      obs_frame.data[0] = const_cast<uint8_t*>(frame->pixels);
+      obs_frame.linesize[0] = frame->width * frame->bpp;
+      auto chroma_width = (frame->width + 1) / 2;
+      auto chroma_plane = chroma_width * ((frame->height + 1) / 2);
+      switch (frame->format) {
+      case realsense::video_format::nv12:
+        obs_frame.format = VIDEO_FORMAT_NV12;
+        obs_frame.data[1] = obs_frame.data[0] + frame->width * frame->height;
+        obs_frame.linesize[1] = 2 * chroma_width;
+        break;
+      case realsense::video_format::i420:
+        obs_frame.format = VIDEO_FORMAT_I420;
+        obs_frame.data[1] = obs_frame.data[0] + frame->width * frame->height;
+        obs_frame.linesize[1] = chroma_width;
+        obs_frame.data[2] = obs_frame.data[1] + chroma_plane;
+        obs_frame.linesize[2] = chroma_width;
+        break;
+      default:
+        obs_frame.format = VIDEO_FORMAT_RGBA;
+        break;
+      }
+      obs_frame.width = frame->width;
+      obs_frame.height = frame->height;
+
+      // Both use the monotonic clock.
+      obs_frame.timestamp = frame->timestamp_ns;
+      auto start = monotonic_ns();
       obs_source_output_video(source, &obs_frame);
-      //
-      os_sleepto_ns(cur_time += delay);
+      auto end = monotonic_ns();
+      cam.record_output(*frame, start, end);
+
+      if (auto interval = stats_interval.load(std::memory_order_relaxed); interval != 0 && end - last_log >= interval) {
+        log_stats();
+        last_log = end;
+      }
     }
   }
 
@@ -179,6 +562,28 @@ namespace {
   }
 
 
+  bool refresh_stats(obs_properties_t* props, obs_property_t* /*p*/, void* data)
+  {
+    auto ctx = static_cast<plugin_context*>(data);
+
+    obs_property_set_description(obs_properties_get(props, "stats"), ctx->cam.stats_summary().c_str());
+
+    // Redraw the properties.
+    return true;
+  }
+
+
+  bool capture_background(obs_properties_t* /*props*/, obs_property_t* /*p*/, void* data)
+  {
+    auto ctx = static_cast<plugin_context*>(data);
+
+    ctx->cam.capture_background(background_capture_seconds);
+    blog(log_level, "obs-realsense: capturing background");
+
+    return false;
+  }
+
+
   bool device_selected(void* /*data*/, obs_properties_t* /*props*/, obs_property_t* /*p*/, obs_data_t* /*settings*/)
   {
     // std::cout << "device selected " << obs_data_get_string(settings, "devicename") << "  resolution " << obs_data_get_string(settings, "resolutions") << std::endl;
@@ -196,6 +601,23 @@ namespace {
       obs_data_set_default_int(settings, "backgroundcolor", res->cam.get_color());
       obs_data_set_default_double(settings, "maxdistance", res->cam.get_max_distance());
       obs_data_set_default_int(settings, "depthfilter", res->cam.get_ndepth_history());
+      obs_data_set_default_int(settings, "depthfiltermode", int(res->cam.get_depth_filter()));
+      obs_data_set_default_int(settings, "workers", res->cam.get_nworkers());
+      obs_data_set_default_int(settings, "alignengine", int(res->cam.get_align_engine()));
+      obs_data_set_default_bool(settings, "maskinplace", res->cam.get_in_place());
+      obs_data_set_default_int(settings, "videoformat", int(res->cam.get_format()));
+      obs_data_set_default_bool(settings, "directalpha", res->cam.get_alpha_matte());
+      obs_data_set_default_double(settings, "feather", res->cam.get_feather());
+      obs_data_set_default_int(settings, "cleanup", int(res->cam.get_cleanup_op()));
+      obs_data_set_default_int(settings, "cleanupradius", res->cam.get_cleanup_radius());
+      obs_data_set_default_int(settings, "holefill", int(res->cam.get_hole_fill()));
+      obs_data_set_default_int(settings, "holefillradius", res->cam.get_hole_fill_radius());
+      obs_data_set_default_bool(settings, "usebackground", res->cam.get_use_background());
+      obs_data_set_default_double(settings, "backgroundmargin", res->cam.get_background_margin());
+      obs_data_set_default_bool(settings, "savebackground", config->get_savebackground());
+      obs_data_set_default_bool(settings, "roi", res->cam.get_roi());
+      obs_data_set_default_int(settings, "backdrop", int(res->cam.get_backdrop()));
+      obs_data_set_default_int(settings, "blurradius", res->cam.get_blur_radius());
 
       return res;
     }
@@ -224,9 +646,33 @@ namespace {
 
     obs_data_set_string(settings, "devicename", config->get_serial().c_str());
     obs_data_set_string(settings, "resolution", config->get_resolution().c_str());
+    obs_data_set_int(settings, "framerate", config->get_framerate());
+    obs_data_set_string(settings, "depthresolution", config->get_depthresolution().c_str());
     obs_data_set_int(settings, "backgroundcolor", config->get_backgroundcolor());
     obs_data_set_double(settings, "maxdistance", config->get_maxdistance());
     obs_data_set_int(settings, "depthfilter", config->get_depthfilter());
+    obs_data_set_int(settings, "depthfiltermode", config->get_depthfiltermode());
+    obs_data_set_int(settings, "workers", config->get_workers());
+    obs_data_set_int(settings, "alignengine", config->get_alignengine());
+    obs_data_set_bool(settings, "maskinplace", config->get_maskinplace());
+    obs_data_set_int(settings, "videoformat", config->get_videoformat());
+    obs_data_set_bool(settings, "directalpha", config->get_directalpha());
+    obs_data_set_double(settings, "feather", config->get_feather());
+    obs_data_set_int(settings, "cleanup", config->get_cleanup());
+    obs_data_set_int(settings, "cleanupradius", config->get_cleanupradius());
+    obs_data_set_int(settings, "holefill", config->get_holefill());
+    obs_data_set_int(settings, "holefillradius", config->get_holefillradius());
+    obs_data_set_bool(settings, "usebackground", config->get_usebackground());
+    obs_data_set_double(settings, "backgroundmargin", config->get_backgroundmargin());
+    obs_data_set_bool(settings, "savebackground", config->get_savebackground());
+    obs_data_set_bool(settings, "roi", config->get_roi());
+    obs_data_set_int(settings, "backdrop", config->get_backdrop());
+    obs_data_set_string(settings, "backdropimage", config->get_backdropimage().c_str());
+    obs_data_set_int(settings, "blurradius", config->get_blurradius());
+    obs_data_set_string(settings, "replayfile", config->get_replayfile().c_str());
+    obs_data_set_bool(settings, "replayrealtime", config->get_replayrealtime());
+    obs_data_set_string(settings, "recordfile", config->get_recordfile().c_str());
+    obs_data_set_int(settings, "statsinterval", config->get_statsinterval());
   }
 
 
@@ -238,9 +684,16 @@ namespace {
 
     auto props = obs_properties_create();
 
+    // The list is enumerated in the background and updated when cameras
+    // are connected or disconnected.
+    auto available = ctx->cam.get_available();
+    auto current = ctx->cam.current_serial();
+    if (current.empty() && ! available.empty())
+      current = std::get<4>(available.front());
+
     auto devicename = obs_properties_add_list(props, "devicename", obs_module_text("Device"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
     std::string last;
-    for (const auto& e : ctx->cam.available)
+    for (const auto& e : available)
       if (auto cur = std::get<0>(e); cur != last) {
         obs_property_list_add_string(devicename, cur.c_str(), std::get<4>(e).c_str());
         last = cur;
@@ -248,16 +701,106 @@ namespace {
     obs_property_set_modified_callback2(devicename, device_selected, data);
 
     auto resolutions = obs_properties_add_list(props, "resolution", obs_module_text("Resolution"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
-    for (const auto& e : ctx->cam.available)
-      if (std::get<0>(e) == std::get<0>(ctx->cam.available.front()))
+    for (const auto& e : available)
+      if (std::get<4>(e) == current)
         obs_property_list_add_string(resolutions, std::get<3>(e).c_str(), std::get<3>(e).c_str());
 
+    // The frame rates supported by any of the resolutions.  If the selected
+    // resolution does not support it the camera's default is used.
+    auto framerates = obs_properties_add_list(props, "framerate", obs_module_text("Frame Rate"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(framerates, obs_module_text("Default"), 0);
+    std::set<int> fpss;
+    for (const auto& e : available)
+      if (std::get<4>(e) == current)
+        fpss.insert(std::get<5>(e).begin(), std::get<5>(e).end());
+    for (auto fps : fpss)
+      obs_property_list_add_int(framerates, (std::to_string(fps) + " fps").c_str(), fps);
+
+    auto depthresolutions = obs_properties_add_list(props, "depthresolution", obs_module_text("Depth Resolution"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
+    obs_property_list_add_string(depthresolutions, obs_module_text("Default"), "");
+    for (const auto& e : ctx->cam.get_available_depth())
+      if (std::get<0>(e) == current)
+        obs_property_list_add_string(depthresolutions, std::get<3>(e).c_str(), std::get<3>(e).c_str());
+
     obs_properties_add_float_slider(props, "maxdistance", obs_module_text("Cutoff distance"), 0.25, 3.0, 0.0625);
 
-    obs_properties_add_int_slider(props, "depthfilter", obs_module_text("Depth Filter"), 1, 16, 1);
+    obs_properties_add_int_slider(props, "depthfilter", obs_module_text("Depth Filter"), 1, int(realsense::depth_mask::max_ndepth_history), 1);
+    // How the frames selected by the depth filter are combined.
+    auto depthfiltermode = obs_properties_add_list(props, "depthfiltermode", obs_module_text("Depth Filter Mode"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(depthfiltermode, obs_module_text("Average"), int(realsense::depth_filter::average));
+    obs_property_list_add_int(depthfiltermode, obs_module_text("Exponential Moving Average (least memory)"), int(realsense::depth_filter::ema));
+    obs_property_list_add_int(depthfiltermode, obs_module_text("Median (ignores outliers)"), int(realsense::depth_filter::median));
+
+    obs_properties_add_int_slider(props, "workers", obs_module_text("Worker Threads"), 1, std::max(int(std::thread::hardware_concurrency()), 1), 1);
+
+    auto alignengine = obs_properties_add_list(props, "alignengine", obs_module_text("Alignment"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(alignengine, obs_module_text("librealsense (exact)"), int(realsense::align_engine::librealsense));
+    obs_property_list_add_int(alignengine, obs_module_text("Precomputed Rays"), int(realsense::align_engine::rays));
+    obs_property_list_add_int(alignengine, obs_module_text("Lookup Table at Cutoff Distance (fastest)"), int(realsense::align_engine::lookup));
+
+    // The YUV formats save OBS the conversion but have no transparency.
+    auto videoformat = obs_properties_add_list(props, "videoformat", obs_module_text("Output Format"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(videoformat, obs_module_text("RGBA"), int(realsense::video_format::rgba));
+    obs_property_list_add_int(videoformat, obs_module_text("NV12"), int(realsense::video_format::nv12));
+    obs_property_list_add_int(videoformat, obs_module_text("I420"), int(realsense::video_format::i420));
+
+    // Only for RGBA output.  No chroma key filter is needed then.
+    obs_properties_add_bool(props, "directalpha", obs_module_text("Direct Alpha (no Background Color)"));
+    obs_properties_add_float_slider(props, "feather", obs_module_text("Alpha Feather Width"), 0.0, 0.5, 0.01);
+
+    // Invalid depth values otherwise count as background.
+    auto holefill = obs_properties_add_list(props, "holefill", obs_module_text("Depth Hole Filling"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(holefill, obs_module_text("None"), int(realsense::hole_fill::none));
+    obs_property_list_add_int(holefill, obs_module_text("Nearest Valid Neighbor"), int(realsense::hole_fill::nearest));
+    obs_property_list_add_int(holefill, obs_module_text("Closest in Window"), int(realsense::hole_fill::min));
+    obs_property_list_add_int(holefill, obs_module_text("Median of Neighbors"), int(realsense::hole_fill::median));
+    obs_properties_add_int_slider(props, "holefillradius", obs_module_text("Hole Filling Radius"), 1, int(realsense::hole_filler::max_radius), 1);
+
+    // Opening removes isolated foreground pixels, closing fills holes.
+    auto cleanup = obs_properties_add_list(props, "cleanup", obs_module_text("Mask Cleanup"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(cleanup, obs_module_text("None"), int(realsense::cleanup_op::none));
+    obs_property_list_add_int(cleanup, obs_module_text("Erode"), int(realsense::cleanup_op::erode));
+    obs_property_list_add_int(cleanup, obs_module_text("Dilate"), int(realsense::cleanup_op::dilate));
+    obs_property_list_add_int(cleanup, obs_module_text("Open (remove speckles)"), int(realsense::cleanup_op::open));
+    obs_property_list_add_int(cleanup, obs_module_text("Close (fill holes)"), int(realsense::cleanup_op::close));
+    obs_properties_add_int_slider(props, "cleanupradius", obs_module_text("Cleanup Radius"), 1, 32, 1);
+
+    // Objects in front of the learned background, e.g., a chair, remain
+    // background.  Nobody should be in view while it is captured.
+    obs_properties_add_bool(props, "usebackground", obs_module_text("Use Learned Background"));
+    obs_properties_add_float_slider(props, "backgroundmargin", obs_module_text("Learned Background Margin"), 0.01, 0.5, 0.01);
+    obs_properties_add_button2(props, "capturebackground", obs_module_text("Capture Background"), capture_background, data);
+    obs_properties_add_bool(props, "savebackground", obs_module_text("Keep Learned Background in Profile"));
+
+    // Saves work if the foreground covers only part of the frame.  New
+    // objects appear with a delay of up to a second.
+    obs_properties_add_bool(props, "roi", obs_module_text("Track Foreground Region"));
+
+    // Ignored while recording.
+    obs_properties_add_bool(props, "maskinplace", obs_module_text("Mask Camera Frames in Place"));
 
     obs_properties_add_color(props, "backgroundcolor", obs_module_text("Background Color"));
 
+    // Instead of the color the background shows an image or the blurred
+    // camera frame.  The output is opaque then.
+    auto backdrop = obs_properties_add_list(props, "backdrop", obs_module_text("Background"), OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(backdrop, obs_module_text("Color"), int(realsense::backdrop_mode::color));
+    obs_property_list_add_int(backdrop, obs_module_text("Image"), int(realsense::backdrop_mode::image));
+    obs_property_list_add_int(backdrop, obs_module_text("Blurred Camera Image"), int(realsense::backdrop_mode::blur));
+    obs_properties_add_path(props, "backdropimage", obs_module_text("Background Image"), OBS_PATH_FILE, "Images (*.png *.jpg *.jpeg *.bmp)", nullptr);
+    obs_properties_add_int_slider(props, "blurradius", obs_module_text("Blur Radius"), 1, int(realsense::backdrop_source::max_radius), 1);
+
+    // The recording is available in the device list.
+    obs_properties_add_path(props, "replayfile", obs_module_text("Recording"), OBS_PATH_FILE, "RealSense recordings (*.bag)", nullptr);
+    obs_properties_add_bool(props, "replayrealtime", obs_module_text("Play Recording in Real-Time"));
+    // Recording is active as long as a file name is set.
+    obs_properties_add_path(props, "recordfile", obs_module_text("Record to"), OBS_PATH_FILE_SAVE, "RealSense recordings (*.bag)", nullptr);
+
+    // The statistics are a snapshot, the button updates them.
+    obs_properties_add_text(props, "stats", ctx->cam.stats_summary().c_str(), OBS_TEXT_INFO);
+    obs_properties_add_button2(props, "refreshstats", obs_module_text("Refresh Statistics"), refresh_stats, data);
+    obs_properties_add_int_slider(props, "statsinterval", obs_module_text("Log Statistics Every (s)"), 0, 3600, 10);
+
     return props;
   }
 
@@ -268,10 +811,24 @@ namespace {
 
     auto ctx = static_cast<plugin_context*>(data);
 
+    auto replayfile = obs_data_get_string(settings, "replayfile");
+    auto replayrealtime = obs_data_get_bool(settings, "replayrealtime");
+    ctx->cam.set_replay(replayfile, replayrealtime);
+    config->set_replayfile(replayfile);
+    config->set_replayrealtime(replayrealtime);
+    blog(log_level, "obs-realsense: replayfile=%s  realtime=%d", replayfile, int(replayrealtime));
+
+    auto recordfile = obs_data_get_string(settings, "recordfile");
+    ctx->cam.set_record(recordfile);
+    config->set_recordfile(recordfile);
+    blog(log_level, "obs-realsense: recordfile=%s", recordfile);
+
     auto serial = obs_data_get_string(settings, "devicename");
     auto resolution = obs_data_get_string(settings, "resolution");
-    blog(LOG_INFO, "serial=%s  resolution=%s", serial, resolution);
-    ctx->cam.new_config(serial, resolution);
+    auto framerate = obs_data_get_int(settings, "framerate");
+    auto depthresolution = obs_data_get_string(settings, "depthresolution");
+    blog(LOG_INFO, "serial=%s  resolution=%s  framerate=%lld  depthresolution=%s", serial, resolution, framerate, depthresolution);
+    ctx->cam.new_config(serial, resolution, framerate, depthresolution);
     if (serial[0] != '\0') {
       blog(log_level, "obs-realsense: serial=%s", serial);
       config->set_serial(serial);
@@ -280,6 +837,8 @@ namespace {
       blog(log_level, "obs-realsense: resolution=%s", resolution);
       config->set_resolution(resolution);
     }
+    config->set_framerate(framerate);
+    config->set_depthresolution(depthresolution);
 
     auto color = (uint32_t) obs_data_get_int(settings, "backgroundcolor");
     ctx->cam.set_color(color);
@@ -296,6 +855,90 @@ namespace {
     config->set_depthfilter(depthfilter);
     blog(log_level, "obs-realsense: depthfilter=%lld", depthfilter);
 
+    auto depthfiltermode = obs_data_get_int(settings, "depthfiltermode");
+    ctx->cam.set_depth_filter(to_depth_filter(depthfiltermode));
+    config->set_depthfiltermode(int(ctx->cam.get_depth_filter()));
+    blog(log_level, "obs-realsense: depthfiltermode=%lld", depthfiltermode);
+
+    auto workers = obs_data_get_int(settings, "workers");
+    ctx->cam.set_nworkers(workers);
+    config->set_workers(workers);
+    blog(log_level, "obs-realsense: workers=%lld", workers);
+
+    auto alignengine = obs_data_get_int(settings, "alignengine");
+    ctx->cam.set_align_engine(to_align_engine(alignengine));
+    config->set_alignengine(int(ctx->cam.get_align_engine()));
+    blog(log_level, "obs-realsense: alignengine=%lld", alignengine);
+
+    auto videoformat = obs_data_get_int(settings, "videoformat");
+    ctx->cam.set_format(to_video_format(videoformat));
+    config->set_videoformat(int(ctx->cam.get_format()));
+    blog(log_level, "obs-realsense: videoformat=%lld", videoformat);
+
+    auto directalpha = obs_data_get_bool(settings, "directalpha");
+    ctx->cam.set_alpha_matte(directalpha);
+    config->set_directalpha(directalpha);
+    blog(log_level, "obs-realsense: directalpha=%d", int(directalpha));
+
+    auto feather = obs_data_get_double(settings, "feather");
+    ctx->cam.set_feather(feather);
+    config->set_feather(feather);
+    blog(log_level, "obs-realsense: feather=%f", feather);
+
+    auto holefill = obs_data_get_int(settings, "holefill");
+    auto holefillradius = std::max(obs_data_get_int(settings, "holefillradius"), 1ll);
+    ctx->cam.set_hole_fill(to_hole_fill(holefill), size_t(holefillradius));
+    config->set_holefill(int(ctx->cam.get_hole_fill()));
+    config->set_holefillradius(int(holefillradius));
+    blog(log_level, "obs-realsense: holefill=%lld radius=%lld", holefill, holefillradius);
+
+    auto cleanup = obs_data_get_int(settings, "cleanup");
+    auto cleanupradius = std::max(obs_data_get_int(settings, "cleanupradius"), 1ll);
+    ctx->cam.set_cleanup(to_cleanup_op(cleanup), size_t(cleanupradius));
+    config->set_cleanup(int(ctx->cam.get_cleanup_op()));
+    config->set_cleanupradius(int(cleanupradius));
+    blog(log_level, "obs-realsense: cleanup=%lld radius=%lld", cleanup, cleanupradius);
+
+    auto usebackground = obs_data_get_bool(settings, "usebackground");
+    auto backgroundmargin = obs_data_get_double(settings, "backgroundmargin");
+    ctx->cam.set_background(usebackground, backgroundmargin);
+    config->set_usebackground(usebackground);
+    config->set_backgroundmargin(backgroundmargin);
+    blog(log_level, "obs-realsense: usebackground=%d margin=%f", int(usebackground), backgroundmargin);
+
+    auto savebackground = obs_data_get_bool(settings, "savebackground");
+    ctx->cam.set_background_dir(savebackground ? profile_dir() : "");
+    config->set_savebackground(savebackground);
+    blog(log_level, "obs-realsense: savebackground=%d", int(savebackground));
+
+    auto roi = obs_data_get_bool(settings, "roi");
+    ctx->cam.set_roi(roi);
+    config->set_roi(roi);
+    blog(log_level, "obs-realsense: roi=%d", int(roi));
+
+    auto backdrop = obs_data_get_int(settings, "backdrop");
+    auto blurradius = std::max(obs_data_get_int(settings, "blurradius"), 1ll);
+    auto backdropimage = obs_data_get_string(settings, "backdropimage");
+    ctx->cam.set_backdrop(to_backdrop_mode(backdrop), size_t(blurradius));
+    ctx->set_backdrop_image(backdropimage);
+    config->set_backdrop(int(ctx->cam.get_backdrop()));
+    config->set_blurradius(int(blurradius));
+    config->set_backdropimage(backdropimage);
+    blog(log_level, "obs-realsense: backdrop=%lld radius=%lld image=%s", backdrop, blurradius, backdropimage);
+
+    auto maskinplace = obs_data_get_bool(settings, "maskinplace");
+    ctx->cam.set_in_place(maskinplace);
+    config->set_maskinplace(maskinplace);
+    blog(log_level, "obs-realsense: maskinplace=%d", int(maskinplace));
+
+    auto statsinterval = obs_data_get_int(settings, "statsinterval");
+    ctx->stats_interval = uint64_t(std::max(statsinterval, 0ll)) * 1'000'000'000;
+    config->set_statsinterval(statsinterval);
+    blog(log_level, "obs-realsense: statsinterval=%lld", statsinterval);
+
+    // The next start uses the list of cameras without waiting.
+    config->set_capabilities(realsense::device_catalog::get().save());
+
     config->save();
   }
 
@@ -329,6 +972,10 @@ extern "C" bool obs_module_load(void)
   config = std::make_unique<config_type>();
   config->load();
 
+  // Enumerating the cameras takes seconds, the list of the last run is
+  // used until it is done.
+  realsense::device_catalog::get().load(config->get_capabilities());
+
   obs_register_source(&realsense_info);
   return true;
 }
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cmath>
+
+#include "realsense-align.hh"
+#include "worker-pool.hh"
+
+
+namespace realsense {
+
+  void deproject(float point[2], const intrinsics& intrin, float x, float y)
+  {
+    const float* c = intrin.coeffs;
+    x = (x - intrin.ppx) / intrin.fx;
+    y = (y - intrin.ppy) / intrin.fy;
+
+    if (intrin.model == distortion::inverse_brown_conrady) {
+      float r2 = x * x + y * y;
+      float f = 1 + c[0] * r2 + c[1] * r2 * r2 + c[4] * r2 * r2 * r2;
+      float ux = x * f + 2 * c[2] * x * y + c[3] * (r2 + 2 * x * x);
+      float uy = y * f + 2 * c[3] * x * y + c[2] * (r2 + 2 * y * y);
+      x = ux;
+      y = uy;
+    } else if (intrin.model == distortion::brown_conrady) {
+      // No closed form, iterate as librealsense does.
+      float xo = x;
+      float yo = y;
+      for (int i = 0; i < 10; ++i) {
+        float r2 = x * x + y * y;
+        float icdist = 1 / (1 + ((c[4] * r2 + c[1]) * r2 + c[0]) * r2);
+        float xq = x / icdist;
+        float yq = y / icdist;
+        float delta_x = 2 * c[2] * xq * yq + c[3] * (r2 + 2 * xq * xq);
+        float delta_y = 2 * c[3] * xq * yq + c[2] * (r2 + 2 * yq * yq);
+        x = (xo - delta_x) * icdist;
+        y = (yo - delta_y) * icdist;
+      }
+    }
+
+    point[0] = x;
+    point[1] = y;
+  }
+
+
+  void project(float pixel[2], const intrinsics& intrin, const float point[3])
+  {
+    const float* c = intrin.coeffs;
+    float x = point[0] / point[2];
+    float y = point[1] / point[2];
+
+    if (intrin.model == distortion::modified_brown_conrady || intrin.model == distortion::inverse_brown_conrady) {
+      float r2 = x * x + y * y;
+      float f = 1 + c[0] * r2 + c[1] * r2 * r2 + c[4] * r2 * r2 * r2;
+      x *= f;
+      y *= f;
+      float dx = x + 2 * c[2] * x * y + c[3] * (r2 + 2 * x * x);
+      float dy = y + 2 * c[3] * x * y + c[2] * (r2 + 2 * y * y);
+      x = dx;
+      y = dy;
+    } else if (intrin.model == distortion::brown_conrady) {
+      float r2 = x * x + y * y;
+      float f = 1 + c[0] * r2 + c[1] * r2 * r2 + c[4] * r2 * r2 * r2;
+      float dx = x * f + 2 * c[2] * x * y + c[3] * (r2 + 2 * x * x);
+      float dy = y * f + 2 * c[3] * x * y + c[2] * (r2 + 2 * y * y);
+      x = dx;
+      y = dy;
+    }
+
+    pixel[0] = x * intrin.fx + intrin.ppx;
+    pixel[1] = y * intrin.fy + intrin.ppy;
+  }
+
+
+  void depth_aligner::configure(align_engine engine_, const intrinsics& depth_, const intrinsics& color_, const extrinsics& depth_to_color_, float depth_scale_, float distance_)
+  {
+    engine = engine_;
+    depth = depth_;
+    color = color_;
+    depth_to_color = depth_to_color_;
+    depth_scale = depth_scale_;
+    distance = distance_;
+
+    rays.clear();
+    lookup.clear();
+
+    if (engine == align_engine::rays) {
+      const float* r = depth_to_color.rotation;
+      rays.resize(depth.width * depth.height * 3);
+      auto p = rays.data();
+      for (size_t y = 0; y < depth.height; ++y)
+        for (size_t x = 0; x < depth.width; ++x, p += 3) {
+          float pt[2];
+          deproject(pt, depth, float(x), float(y));
+          p[0] = r[0] * pt[0] + r[3] * pt[1] + r[6];
+          p[1] = r[1] * pt[0] + r[4] * pt[1] + r[7];
+          p[2] = r[2] * pt[0] + r[5] * pt[1] + r[8];
+        }
+
+      // Depth pixels are usually larger than color pixels.  Fill the
+      // area of the depth pixel, otherwise the aligned frame has holes.
+      splat_width = std::max(size_t(std::ceil(color.fx / depth.fx)), 1zu);
+      splat_height = std::max(size_t(std::ceil(color.fy / depth.fy)), 1zu);
+    } else if (engine == align_engine::lookup)
+      build_lookup();
+  }
+
+
+  void depth_aligner::set_distance(float distance_)
+  {
+    if (distance_ != distance) {
+      distance = distance_;
+      if (engine == align_engine::lookup)
+        build_lookup();
+    }
+  }
+
+
+  void depth_aligner::build_lookup()
+  {
+    const float* r = depth_to_color.rotation;
+    const float* t = depth_to_color.translation;
+
+    lookup.resize(color.width * color.height);
+    auto p = lookup.data();
+    for (size_t y = 0; y < color.height; ++y)
+      for (size_t x = 0; x < color.width; ++x) {
+        // Point at the cutoff distance, transformed back into the depth
+        // camera's coordinates.  The inverse of the rotation is its transpose.
+        float pt[2];
+        deproject(pt, color, float(x), float(y));
+        float c[3] = { pt[0] * distance - t[0], pt[1] * distance - t[1], distance - t[2] };
+        float d[3] = {
+          r[0] * c[0] + r[1] * c[1] + r[2] * c[2],
+          r[3] * c[0] + r[4] * c[1] + r[5] * c[2],
+          r[6] * c[0] + r[7] * c[1] + r[8] * c[2]
+        };
+        float px[2];
+        project(px, depth, d);
+        auto dx = std::lround(px[0]);
+        auto dy = std::lround(px[1]);
+        *p++ = dx >= 0 && size_t(dx) < depth.width && dy >= 0 && size_t(dy) < depth.height ? uint32_t(size_t(dy) * depth.width + size_t(dx)) : invalid_index;
+      }
+  }
+
+
+  void depth_aligner::process(uint16_t* dest, const uint16_t* src, worker_pool* pool)
+  {
+    if (engine == align_engine::lookup) {
+      auto do_rows = [&](size_t from, size_t to) {
+        for (size_t i = from * color.width; i < to * color.width; ++i)
+          dest[i] = lookup[i] == invalid_index ? 0 : src[lookup[i]];
+      };
+
+      if (pool == nullptr || pool->size() == 1)
+        do_rows(0, color.height);
+      else {
+        auto band_height = std::max(color.height / (4 * pool->size()), 1zu);
+        auto nbands = (color.height + band_height - 1) / band_height;
+        pool->run(nbands, [&](size_t band, size_t) {
+          do_rows(band * band_height, std::min((band + 1) * band_height, color.height));
+        });
+      }
+    } else if (engine == align_engine::rays) {
+      // Scattering the values in parallel would need synchronization, this
+      // is done in the calling thread.
+      std::fill_n(dest, color.width * color.height, uint16_t(0));
+
+      const float* t = depth_to_color.translation;
+      auto ray = rays.data();
+      for (size_t i = 0; i < depth.width * depth.height; ++i, ray += 3) {
+        auto z = src[i];
+        if (z == 0)
+          continue;
+
+        auto zm = float(z) * depth_scale;
+        float pt[3] = { zm * ray[0] + t[0], zm * ray[1] + t[1], zm * ray[2] + t[2] };
+        if (pt[2] <= 0)
+          continue;
+        float px[2];
+        project(px, color, pt);
+
+        // The area around the projected center.  The closest object wins.
+        auto x0 = long(std::ceil(px[0] - float(splat_width) / 2));
+        auto y0 = long(std::ceil(px[1] - float(splat_height) / 2));
+        auto xb = size_t(std::clamp(x0, 0l, long(color.width)));
+        auto xe = size_t(std::clamp(x0 + long(splat_width), 0l, long(color.width)));
+        auto yb = size_t(std::clamp(y0, 0l, long(color.height)));
+        auto ye = size_t(std::clamp(y0 + long(splat_height), 0l, long(color.height)));
+        for (auto y = yb; y < ye; ++y)
+          for (auto x = xb; x < xe; ++x) {
+            auto& d = dest[y * color.width + x];
+            if (d == 0 || z < d)
+              d = z;
+          }
+      }
+    }
+  }
+
+} // namespace realsense
@@ -0,0 +1,108 @@
+#ifndef _REALSENSE_ALIGN_HH
+#define _REALSENSE_ALIGN_HH 1
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "frame-allocator.hh"
+
+struct worker_pool;
+
+
+namespace realsense {
+
+  // Lens distortion models with the meaning librealsense gives them.
+  // Other models are treated as without distortion.
+  enum struct distortion {
+    none,
+    modified_brown_conrady,
+    inverse_brown_conrady,
+    brown_conrady,
+  };
+
+  // Same content as rs2_intrinsics and rs2_extrinsics, but independent of
+  // librealsense so that the code can be used without a camera.
+  struct intrinsics {
+    size_t width;
+    size_t height;
+    float ppx;
+    float ppy;
+    float fx;
+    float fy;
+    distortion model;
+    float coeffs[5];
+  };
+
+  struct extrinsics {
+    // Column-major 3×3 matrix.
+    float rotation[9];
+    // In meters.
+    float translation[3];
+  };
+
+  // Pixel to point on the ray with z = 1 and back, as librealsense's
+  // rs2_deproject_pixel_to_point and rs2_project_point_to_pixel do it.
+  void deproject(float point[2], const intrinsics& intrin, float x, float y);
+  void project(float pixel[2], const intrinsics& intrin, const float point[3]);
+
+
+  // Ways to align the depth frame with the color frame.
+  enum struct align_engine {
+    // rs2::align, the depth image is reprojected completely for each frame.
+    librealsense,
+    // The rays of the depth pixels in the color camera's coordinates are
+    // computed once, for each frame only the translation and the projection
+    // remain.  The color camera's distortion is applied.
+    rays,
+    // For each color pixel the depth pixel at the cutoff distance is
+    // computed once, each frame just gathers the values.  This is exact for
+    // objects at the cutoff distance which is where the decision between
+    // foreground and background is made.  Closer objects are shifted by the
+    // parallax of the two cameras.  Equivalent to masking at the depth
+    // resolution and scaling the mask up.
+    lookup,
+  };
+
+
+  // Alignment of depth frames with color frames based on tables which are
+  // computed once per configuration.  Not used for align_engine::librealsense.
+  struct depth_aligner
+  {
+    // DEPTH_SCALE converts depth values to meters.  DISTANCE is the cutoff
+    // distance in meters.
+    void configure(align_engine engine_, const intrinsics& depth_, const intrinsics& color_, const extrinsics& depth_to_color_, float depth_scale_, float distance_);
+    // The lookup table depends on the distance, the other engines do not.
+    void set_distance(float distance_);
+
+    // DEST has the size of the color frame, SRC of the depth frame.
+    // Pixels without a depth value are zero.
+    void process(uint16_t* dest, const uint16_t* src, worker_pool* pool = nullptr);
+
+    align_engine get_engine() const { return engine; }
+
+  private:
+    void build_lookup();
+
+    align_engine engine = align_engine::librealsense;
+    intrinsics depth;
+    intrinsics color;
+    extrinsics depth_to_color;
+    float depth_scale = 0.001f;
+    float distance = 1.0f;
+
+    // For align_engine::rays: three coordinates per depth pixel.
+    frame_vector<float> rays;
+    // Size of the area in the color frame one depth pixel covers.
+    size_t splat_width = 1;
+    size_t splat_height = 1;
+
+    // For align_engine::lookup: index of the depth pixel for each color
+    // pixel, invalid_index if outside the depth frame.
+    frame_vector<uint32_t> lookup;
+    static constexpr uint32_t invalid_index = ~0u;
+  };
+
+} // namespace realsense
+
+#endif // realsense-align.hh
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <tuple>
+
+#include "realsense-backdrop.hh"
+#include "realsense-mask.hh"
+#include "worker-pool.hh"
+
+
+namespace realsense {
+
+  void backdrop_source::configure(backdrop_mode mode_, size_t radius_)
+  {
+    mode = mode_;
+    radius = std::min(radius_, max_radius);
+  }
+
+
+  void backdrop_source::set_image(const uint8_t* pixels_, size_t width_, size_t height_)
+  {
+    image.assign(pixels_, pixels_ + width_ * height_ * 3);
+    image_width = image.empty() ? 0 : width_;
+    image_height = image.empty() ? 0 : height_;
+    // Scaled again for the next frame.
+    scaled_width = 0;
+    scaled_height = 0;
+  }
+
+
+  const uint8_t* backdrop_source::apply(const uint8_t* src, size_t src_bpp, size_t width, size_t height, const kernels& kern, worker_pool* pool)
+  {
+    if (mode == backdrop_mode::image) {
+      if (scaled_width != width || scaled_height != height)
+        scale_image(width, height);
+    } else
+      blur(src, src_bpp, width, height, kern, pool);
+    return pixels.data();
+  }
+
+
+  void backdrop_source::scale_image(size_t width, size_t height)
+  {
+    pixels.resize(width * height * 3);
+
+    // The image covers the frame, the excess is cut off evenly on both
+    // sides.  Bilinear interpolation, this happens once.
+    const auto scale = std::min(float(image_width) / float(width), float(image_height) / float(height));
+    const auto x0 = (float(image_width) - scale * float(width)) / 2;
+    const auto y0 = (float(image_height) - scale * float(height)) / 2;
+    auto source = [&](float pos, size_t n) {
+      auto f = std::clamp(pos, 0.0f, float(n - 1));
+      auto i = size_t(f);
+      return std::tuple(i, std::min(i + 1, n - 1), f - float(i));
+    };
+    for (size_t y = 0; y < height; ++y) {
+      auto [top, bottom, wy] = source(y0 + (float(y) + 0.5f) * scale - 0.5f, image_height);
+      for (size_t x = 0; x < width; ++x) {
+        auto [left, right, wx] = source(x0 + (float(x) + 0.5f) * scale - 0.5f, image_width);
+        for (size_t c = 0; c < 3; ++c) {
+          auto p = [&](size_t px, size_t py) { return float(image[(py * image_width + px) * 3 + c]); };
+          auto upper = p(left, top) + (p(right, top) - p(left, top)) * wx;
+          auto lower = p(left, bottom) + (p(right, bottom) - p(left, bottom)) * wx;
+          pixels[(y * width + x) * 3 + c] = uint8_t(upper + (lower - upper) * wy + 0.5f);
+        }
+      }
+    }
+
+    scaled_width = width;
+    scaled_height = height;
+  }
+
+
+  void backdrop_source::reserve(size_t width, size_t nworkers)
+  {
+    if (mode == backdrop_mode::blur && column_sums.size() < nworkers * width * 3)
+      column_sums.resize(nworkers * width * 3);
+  }
+
+
+  void backdrop_source::blur(const uint8_t* src, size_t src_bpp, size_t width, size_t height, const kernels& kern, worker_pool* pool)
+  {
+    const size_t n = width * 3;
+    const size_t nworkers = pool == nullptr ? 1 : pool->size();
+    if (pixels.size() < n * height)
+      pixels.resize(n * height);
+    if (row_averages.size() < n * height)
+      row_averages.resize(n * height);
+    if (column_sums.size() < nworkers * n)
+      column_sums.resize(nworkers * n);
+    scaled_width = 0;
+    scaled_height = 0;
+
+    // The pixels beyond the border repeat the last pixel.  The rounded
+    // division by the window size is a multiplication with its inverse.
+    // In single precision this is exact, the sums have at most 16 bits and
+    // a quotient is never closer than 1 / (2 × size) to the next half.
+    const size_t r = radius;
+    const float inverse = 1.0f / float(2 * r + 1);
+
+    // Averages of the 2 × R + 1 pixels around each pixel of a row.  The
+    // sums are serial, the same rounded division is done with integers:
+    // with 32 fractional bits the error stays below 1 / (2 × size) as well.
+    const uint64_t row_inverse = ((uint64_t(1) << 32) + 2 * r) / (2 * r + 1);
+    auto do_rows = [&](size_t from, size_t to) {
+      for (size_t y = from; y < to; ++y) {
+        auto row = src + y * width * src_bpp;
+        auto out = &row_averages[y * n];
+        // Separate variables, the stores of bytes could alias an array.
+        uint32_t s0 = uint32_t(r + 1) * row[0];
+        uint32_t s1 = uint32_t(r + 1) * row[1];
+        uint32_t s2 = uint32_t(r + 1) * row[2];
+        for (size_t i = 1; i <= r; ++i) {
+          auto p = &row[std::min(i, width - 1) * src_bpp];
+          s0 += p[0];
+          s1 += p[1];
+          s2 += p[2];
+        }
+        auto step = [&](size_t x, const uint8_t* add, const uint8_t* sub) {
+          out[3 * x] = uint8_t(((s0 + r) * row_inverse) >> 32);
+          out[3 * x + 1] = uint8_t(((s1 + r) * row_inverse) >> 32);
+          out[3 * x + 2] = uint8_t(((s2 + r) * row_inverse) >> 32);
+          s0 += add[0] - sub[0];
+          s1 += add[1] - sub[1];
+          s2 += add[2] - sub[2];
+        };
+        // The window reaches beyond the left border, then neither border,
+        // then beyond the right border.
+        const size_t left = std::min(r, width);
+        const size_t right = std::max(width > r + 1 ? width - r - 1 : 0, left);
+        size_t x = 0;
+        for (; x < left; ++x)
+          step(x, &row[std::min(x + r + 1, width - 1) * src_bpp], row);
+        for (; x < right; ++x)
+          step(x, &row[(x + r + 1) * src_bpp], &row[(x - r) * src_bpp]);
+        for (; x < width; ++x)
+          step(x, &row[(width - 1) * src_bpp], &row[(x - r) * src_bpp]);
+      }
+    };
+    // Averages of these averages in the 2 × R + 1 rows around each row.
+    // Each band starts with the sums of the rows around its first row.
+    auto do_columns = [&](size_t from, size_t to, size_t worker) {
+      auto sums = &column_sums[worker * n];
+      auto row = [&](size_t y) { return &row_averages[std::min(y, height - 1) * n]; };
+      std::fill_n(sums, n, 0);
+      for (size_t i = 0; i <= 2 * r; ++i) {
+        auto h = row(from + i >= r ? from + i - r : 0);
+        for (size_t x = 0; x < n; ++x)
+          sums[x] = uint16_t(sums[x] + h[x]);
+      }
+      for (size_t y = from; y < to; ++y)
+        kern.box_columns(&pixels[y * n], sums, row(y + r + 1), row(y >= r ? y - r : 0), n, inverse);
+    };
+
+    if (nworkers == 1) {
+      do_rows(0, height);
+      do_columns(0, height, 0);
+    } else {
+      auto band_height = std::max(height / (4 * nworkers), 1zu);
+      pool->run((height + band_height - 1) / band_height, [&](size_t band, size_t) {
+        do_rows(band * band_height, std::min((band + 1) * band_height, height));
+      });
+      // One band per worker, each band has to sum up the rows around its
+      // first row.
+      band_height = (height + nworkers - 1) / nworkers;
+      pool->run((height + band_height - 1) / band_height, [&](size_t band, size_t worker) {
+        do_columns(band * band_height, std::min((band + 1) * band_height, height), worker);
+      });
+    }
+  }
+
+} // namespace realsense
@@ -0,0 +1,82 @@
+#ifndef _REALSENSE_BACKDROP_HH
+#define _REALSENSE_BACKDROP_HH 1
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "frame-allocator.hh"
+
+struct worker_pool;
+
+
+namespace realsense {
+
+  struct kernels;
+
+
+  // What replaces the background pixels.
+  enum struct backdrop_mode {
+    // The background color, keyed out or made transparent in OBS.
+    color,
+    // A still image, scaled to cover the frame and centered.
+    image,
+    // The camera frame itself, blurred with a box filter.
+    blur,
+  };
+
+
+  // The pixels the foreground is composited over, three bytes (RGB) per
+  // pixel and the size of the frame.  The image is scaled once for each
+  // resolution.  The blur is computed for each frame with running sums,
+  // first the rounded averages of 2 × radius + 1 pixels of each row and
+  // then of these values in 2 × radius + 1 rows.  The rows are processed
+  // in parallel.
+  struct backdrop_source
+  {
+    void configure(backdrop_mode mode_, size_t radius_);
+    bool active() const { return mode == backdrop_mode::image ? ! image.empty() : mode == backdrop_mode::blur && radius > 0; }
+
+    // WIDTH × HEIGHT pixels with three bytes each.
+    void set_image(const uint8_t* pixels_, size_t width_, size_t height_);
+
+    // Returns the backdrop for the frame SRC with SRC_BPP bytes per pixel
+    // which is valid until the next call.
+    const uint8_t* apply(const uint8_t* src, size_t src_bpp, size_t width, size_t height, const kernels& kern, worker_pool* pool = nullptr);
+
+    auto get_mode() const { return mode; }
+    auto get_radius() const { return radius; }
+
+    // Allocate the column sums of the blur for rows of WIDTH pixels and
+    // pools of up to NWORKERS workers.
+    void reserve(size_t width, size_t nworkers);
+
+    // The largest supported blur radius.  The sums then still fit into 16
+    // bits.
+    static constexpr size_t max_radius = 64;
+
+  private:
+    void scale_image(size_t width, size_t height);
+    void blur(const uint8_t* src, size_t src_bpp, size_t width, size_t height, const kernels& kern, worker_pool* pool);
+
+    backdrop_mode mode = backdrop_mode::color;
+    size_t radius = 0;
+
+    std::vector<uint8_t> image;
+    size_t image_width = 0;
+    size_t image_height = 0;
+
+    // The result and the size the image is scaled to, zero for the blur.
+    frame_vector<uint8_t> pixels;
+    size_t scaled_width = 0;
+    size_t scaled_height = 0;
+
+    // For the blur the averages in the rows and, for each worker, the sums
+    // of the columns.
+    frame_vector<uint8_t> row_averages;
+    frame_vector<uint16_t> column_sums;
+  };
+
+} // namespace realsense
+
+#endif // realsense-backdrop.hh
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include "realsense-background.hh"
+
+
+namespace realsense {
+
+  namespace {
+
+    // File header, followed by the reference values in native byte order.
+    struct file_header {
+      char magic[8];
+      uint32_t width;
+      uint32_t height;
+      float depth_scale;
+      uint32_t reserved;
+    };
+
+    constexpr char file_magic[8] = { 'R', 'S', 'G', 'S', 'B', 'G', '0', '1' };
+
+  } // anonymous namespace
+
+
+  void background_model::start_capture(size_t width_, size_t height_, size_t nframes_)
+  {
+    capture_width = width_;
+    capture_height = height_;
+    nframes = std::min(std::max(nframes_, 1zu), size_t(std::numeric_limits<uint16_t>::max()));
+    remaining = nframes;
+    sum.assign(width_ * height_, 0);
+    count.assign(width_ * height_, 0);
+  }
+
+
+  bool background_model::add(const uint16_t* depth)
+  {
+    if (remaining == 0)
+      return false;
+
+    for (size_t i = 0; i < sum.size(); ++i) {
+      sum[i] += depth[i];
+      count[i] += depth[i] != 0;
+    }
+    if (--remaining > 0)
+      return false;
+
+    width = capture_width;
+    height = capture_height;
+    reference.resize(sum.size());
+    for (size_t i = 0; i < sum.size(); ++i)
+      reference[i] = 2 * size_t(count[i]) >= nframes ? uint16_t((sum[i] + count[i] / 2) / count[i]) : 0;
+
+    // Only needed during the capture.
+    sum = decltype(sum)();
+    count = decltype(count)();
+    return true;
+  }
+
+
+  void background_model::clear()
+  {
+    width = 0;
+    height = 0;
+    reference = decltype(reference)();
+    remaining = 0;
+    sum = decltype(sum)();
+    count = decltype(count)();
+  }
+
+
+  bool background_model::save(const std::string& fname, float depth_scale) const
+  {
+    if (reference.empty())
+      return false;
+
+    file_header header = {};
+    std::memcpy(header.magic, file_magic, sizeof(file_magic));
+    header.width = uint32_t(width);
+    header.height = uint32_t(height);
+    header.depth_scale = depth_scale;
+
+    // Replace the file only once it is complete.  An incomplete file is
+    // not left behind.
+    auto tmpname = fname + ".tmp";
+    bool written;
+    {
+      std::ofstream out(tmpname, std::ios::binary | std::ios::trunc);
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+      out.write(reinterpret_cast<const char*>(reference.data()), std::streamsize(reference.size() * sizeof(uint16_t)));
+      written = bool(out.flush());
+    }
+    if (written && std::rename(tmpname.c_str(), fname.c_str()) == 0)
+      return true;
+    std::remove(tmpname.c_str());
+    return false;
+  }
+
+
+  bool background_model::load(const std::string& fname, float depth_scale)
+  {
+    std::ifstream in(fname, std::ios::binary);
+    file_header header;
+    if (! in.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, file_magic, sizeof(file_magic)) != 0
+        || header.depth_scale != depth_scale)
+      return false;
+
+    decltype(reference) values(size_t(header.width) * header.height);
+    if (values.empty() || ! in.read(reinterpret_cast<char*>(values.data()), std::streamsize(values.size() * sizeof(uint16_t))))
+      return false;
+
+    width = header.width;
+    height = header.height;
+    reference = std::move(values);
+    return true;
+  }
+
+} // namespace realsense
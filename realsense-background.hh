@@ -0,0 +1,55 @@
+#ifndef _REALSENSE_BACKGROUND_HH
+#define _REALSENSE_BACKGROUND_HH 1
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame-allocator.hh"
+
+
+namespace realsense {
+
+  // Reference depth of the static scene behind the person.  It is learned
+  // from a number of frames without anybody in front of the camera: the
+  // reference of a pixel is the average of its valid values, zero if fewer
+  // than half of the frames have a valid value.  Two bytes per pixel, the
+  // same in the file.
+  struct background_model
+  {
+    // Start learning from the next NFRAMES frames of WIDTH × HEIGHT pixels.
+    // The current reference stays in use until the capture completes.
+    void start_capture(size_t width_, size_t height_, size_t nframes);
+    bool capturing() const { return remaining > 0; }
+    // Add a depth frame to the capture.  Returns true if this completes it.
+    bool add(const uint16_t* depth);
+
+    // Whether there is a reference for frames of the given size.
+    bool ready(size_t width_, size_t height_) const { return ! reference.empty() && width == width_ && height == height_; }
+    const uint16_t* data() const { return reference.data(); }
+    void clear();
+
+    // The depth scale is stored with the reference, a file with another
+    // depth scale or a broken file is not loaded.  Both return false on
+    // failure.
+    bool save(const std::string& fname, float depth_scale) const;
+    bool load(const std::string& fname, float depth_scale);
+
+  private:
+    size_t width = 0;
+    size_t height = 0;
+    frame_vector<uint16_t> reference;
+
+    // While capturing: the sums and numbers of the valid values.
+    size_t nframes = 0;
+    size_t remaining = 0;
+    frame_vector<uint32_t> sum;
+    frame_vector<uint16_t> count;
+    size_t capture_width = 0;
+    size_t capture_height = 0;
+  };
+
+} // namespace realsense
+
+#endif // realsense-background.hh
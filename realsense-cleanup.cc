@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <cstring>
+
+#include "realsense-cleanup.hh"
+#include "realsense-mask.hh"
+#include "worker-pool.hh"
+
+
+namespace realsense {
+
+  void mask_cleanup::configure(cleanup_op op_, size_t radius_)
+  {
+    op = op_;
+    radius = radius_;
+  }
+
+
+  void mask_cleanup::reserve(size_t nworkers)
+  {
+    if (! active())
+      return;
+
+    const size_t w = 2 * radius + 1;
+    if (forward.size() < nworkers * w * max_strip_width) {
+      forward.resize(nworkers * w * max_strip_width);
+      backward.resize(nworkers * 2 * w * max_strip_width);
+    }
+  }
+
+
+  void mask_cleanup::apply(uint8_t* mask, size_t width, size_t height, const kernels& kern, worker_pool* pool)
+  {
+    if (! active() || width == 0 || height == 0)
+      return;
+
+    // The filters in the two directions commute.  Ordering them so that
+    // both passes over the rows happen in the transposed copy needs only
+    // two transpositions, also for opening and closing.
+    const bool first_erode = op == cleanup_op::erode || op == cleanup_op::open;
+    const bool second = op == cleanup_op::open || op == cleanup_op::close;
+
+    if (transposed.size() < width * height)
+      transposed.resize(width * height);
+
+    filter_columns(mask, width, height, first_erode, kern, pool);
+    transpose(transposed.data(), mask, width, height, kern, pool);
+    filter_columns(transposed.data(), height, width, first_erode, kern, pool);
+    if (second)
+      filter_columns(transposed.data(), height, width, ! first_erode, kern, pool);
+    transpose(mask, transposed.data(), height, width, kern, pool);
+    if (second)
+      filter_columns(mask, width, height, ! first_erode, kern, pool);
+  }
+
+
+  void mask_cleanup::filter_columns(uint8_t* data, size_t ncols, size_t nrows, bool erode, const kernels& kern, worker_pool* pool)
+  {
+    // The input is extended by RADIUS neutral rows at both ends and split
+    // into blocks of W rows.  The window of each output row covers the end
+    // of one block and the start of the next (or exactly one block), the
+    // result combines the running values of both.  The blocks are processed
+    // one after the other so that only the running values of the current
+    // block and the backward values of the previous block are needed.  The
+    // rows written are not read again.
+    const size_t w = 2 * radius + 1;
+    const size_t npadded = nrows + 2 * radius;
+    if (border.size() < ncols)
+      border.resize(ncols);
+    std::fill_n(border.begin(), ncols, erode ? 0xff : 0x00);
+    auto combine = erode ? kern.min_u8 : kern.max_u8;
+
+    // Strips of columns keep the working set small and are distributed to
+    // the workers.  They start at cache line boundaries.
+    auto nworkers = pool == nullptr ? 1 : pool->size();
+    auto strip_width = std::clamp(((ncols / (4 * nworkers)) + 63) & ~63zu, 64zu, max_strip_width);
+    auto nstrips = (ncols + strip_width - 1) / strip_width;
+    if (forward.size() < nworkers * w * strip_width) {
+      forward.resize(nworkers * w * strip_width);
+      backward.resize(nworkers * 2 * w * strip_width);
+    }
+
+    auto do_strip = [&](size_t strip, size_t worker) {
+      auto c0 = strip * strip_width;
+      auto n = std::min(strip_width, ncols - c0);
+      auto row = [&](size_t p) { return (p < radius || p >= nrows + radius ? border.data() : data + (p - radius) * ncols) + c0; };
+      auto g = [&](size_t p) { return &forward[(worker * w + p % w) * strip_width]; };
+      auto h = [&](size_t p) { return &backward[(worker * 2 * w + p % (2 * w)) * strip_width]; };
+
+      for (size_t b0 = 0; b0 < npadded; b0 += w) {
+        auto b1 = std::min(b0 + w, npadded);
+        std::memcpy(g(b0), row(b0), n);
+        for (size_t p = b0 + 1; p < b1; ++p)
+          combine(g(p), g(p - 1), row(p), n);
+        std::memcpy(h(b1 - 1), row(b1 - 1), n);
+        for (size_t p = b1 - 1; p-- > b0; )
+          combine(h(p), h(p + 1), row(p), n);
+
+        // The rows whose window ends in this block.
+        for (size_t y = b0 >= 2 * radius ? b0 - 2 * radius : 0; y + 2 * radius < b1 && y < nrows; ++y)
+          combine(data + y * ncols + c0, h(y), g(y + 2 * radius), n);
+      }
+    };
+
+    if (nworkers == 1)
+      for (size_t s = 0; s < nstrips; ++s)
+        do_strip(s, 0);
+    else
+      pool->run(nstrips, do_strip);
+  }
+
+
+  void mask_cleanup::transpose(uint8_t* dest, const uint8_t* src, size_t width, size_t height, const kernels& kern, worker_pool* pool)
+  {
+    // SRC has HEIGHT rows of WIDTH bytes, DEST has WIDTH rows of HEIGHT bytes.
+    if (pool == nullptr || pool->size() == 1)
+      kern.transpose(dest, height, src, width, height, width);
+    else {
+      // Bands of full 16-row blocks for the vector implementations.
+      auto band_height = std::max((height / (4 * pool->size())) / 16, 1zu) * 16;
+      auto nbands = (height + band_height - 1) / band_height;
+      pool->run(nbands, [&](size_t band, size_t) {
+        auto from = band * band_height;
+        auto to = std::min((band + 1) * band_height, height);
+        kern.transpose(dest + from, height, src + from * width, width, to - from, width);
+      });
+    }
+  }
+
+} // namespace realsense
@@ -0,0 +1,75 @@
+#ifndef _REALSENSE_CLEANUP_HH
+#define _REALSENSE_CLEANUP_HH 1
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "frame-allocator.hh"
+
+struct worker_pool;
+
+
+namespace realsense {
+
+  struct kernels;
+
+
+  // Morphological operations on the mask.  Erosion removes foreground
+  // speckles and shrinks the foreground, dilation fills holes and grows it.
+  // Opening (erosion followed by dilation) removes speckles without
+  // changing the outline, closing (the reverse) fills holes.
+  enum struct cleanup_op {
+    none,
+    erode,
+    dilate,
+    open,
+    close,
+  };
+
+
+  // Filtering of a mask with a square window of 2 × radius + 1 pixels.
+  // Both directions are filtered separately with the algorithm of van Herk
+  // and Gil & Werman which needs three minimum or maximum operations per
+  // pixel and direction, independent of the radius.  The rows are filtered
+  // in a transposed copy so that all operations combine whole rows which
+  // vectorizes.  The values need not be binary, the alpha matte works
+  // as well.
+  struct mask_cleanup
+  {
+    void configure(cleanup_op op_, size_t radius_);
+    bool active() const { return op != cleanup_op::none && radius > 0; }
+
+    // MASK has WIDTH × HEIGHT bytes without padding.  Pixels beyond the
+    // border are neutral, they neither erode nor dilate the mask.
+    void apply(uint8_t* mask, size_t width, size_t height, const kernels& kern, worker_pool* pool = nullptr);
+
+    auto get_op() const { return op; }
+    auto get_radius() const { return radius; }
+
+    // Allocate the buffers for pools of up to NWORKERS workers so that
+    // apply only allocates when the size of the mask changes.
+    void reserve(size_t nworkers);
+
+  private:
+    // Filter DATA, NROWS rows of NCOLS bytes, in the vertical direction.
+    void filter_columns(uint8_t* data, size_t ncols, size_t nrows, bool erode, const kernels& kern, worker_pool* pool);
+    void transpose(uint8_t* dest, const uint8_t* src, size_t width, size_t height, const kernels& kern, worker_pool* pool);
+
+    cleanup_op op = cleanup_op::none;
+    size_t radius = 0;
+
+    frame_vector<uint8_t> transposed;
+    // Running minima or maxima within the blocks of 2 × radius + 1 rows,
+    // from the start and from the end of the block, for one strip of
+    // columns per worker.  The values from the end are kept for two blocks.
+    static constexpr size_t max_strip_width = 256;
+    frame_vector<uint8_t> forward;
+    frame_vector<uint8_t> backward;
+    // The neutral value for the rows beyond the border.
+    std::vector<uint8_t> border;
+  };
+
+} // namespace realsense
+
+#endif // realsense-cleanup.hh
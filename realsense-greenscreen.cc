@@ -1,6 +1,12 @@
+#include <algorithm>
 #include <cassert>
-#include <cstring>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <list>
+#include <map>
 #include <set>
+#include <sstream>
 #include <stdexcept>
 
 #include "realsense-greenscreen.hh"
@@ -71,17 +77,145 @@ namespace realsense {
       return false;
     }
 
+
+    intrinsics convert(const rs2_intrinsics& intrin)
+    {
+      intrinsics res{ size_t(intrin.width), size_t(intrin.height), intrin.ppx, intrin.ppy, intrin.fx, intrin.fy, distortion::none, {} };
+      switch (intrin.model) {
+      case RS2_DISTORTION_MODIFIED_BROWN_CONRADY:
+        res.model = distortion::modified_brown_conrady;
+        break;
+      case RS2_DISTORTION_INVERSE_BROWN_CONRADY:
+        res.model = distortion::inverse_brown_conrady;
+        break;
+      case RS2_DISTORTION_BROWN_CONRADY:
+        res.model = distortion::brown_conrady;
+        break;
+      default:
+        // The fish-eye models are not used by the color cameras.
+        break;
+      }
+      std::copy_n(intrin.coeffs, 5, res.coeffs);
+      return res;
+    }
+
+
+    uint64_t stream_period(const rs2::stream_profile& sp)
+    {
+      return 1'000'000'000 / uint64_t(std::max(sp.fps(), 1));
+    }
+
+
+
+
+    rs2::config make_config(const camera_request& req)
+    {
+      rs2::config config;
+      if (req.serial == greenscreen::replay_serial)
+        // Loop over the recording.
+        config.enable_device_from_file(req.replay_file, true);
+      else if (! req.serial.empty()) {
+        config.enable_device(req.serial);
+        if (req.depth_width == 0)
+          config.enable_stream(RS2_STREAM_DEPTH);
+        else
+          config.enable_stream(RS2_STREAM_DEPTH, int(req.depth_width), int(req.depth_height), RS2_FORMAT_Z16, 0);
+        // For masking in place the camera has to provide the output format.
+        // RGB is the default format anyway.
+        config.enable_stream(RS2_STREAM_COLOR, int(req.width), int(req.height), req.rgba ? RS2_FORMAT_RGBA8 : RS2_FORMAT_ANY, req.fps);
+        if (! req.record_file.empty())
+          config.enable_record_to_file(req.record_file);
+      }
+      return config;
+    }
+
+
+    // By name, the largest resolution first.
+    void sort_available(std::vector<device_catalog::available_type>& available)
+    {
+      std::sort(available.begin(), available.end(), [](const auto& l, const auto& r){
+        auto cr = std::get<0>(l).compare(std::get<0>(r));
+        if (cr != 0)
+          return cr < 0;
+        if (std::get<1>(l) != std::get<1>(r))
+          return std::get<1>(l) > std::get<1>(r);
+        return std::get<2>(l) > std::get<2>(r);
+      });
+    }
+
+
+    // The labels of the resolutions are "WIDTH × HEIGHT".
+    bool parse_resolution(const std::string& label, size_t& w, size_t& h)
+    {
+      return std::sscanf(label.c_str(), "%zu × %zu", &w, &h) == 2 && w != 0 && h != 0;
+    }
+
+
+    // Check a request made before the cameras were enumerated against the
+    // list.  Like new_config, a frame rate or depth resolution the camera
+    // does not support selects the default.  Returns the error.
+    std::string verify_request(camera_request& req)
+    {
+      auto& catalog = device_catalog::get();
+      catalog.wait_ready();
+
+      auto avail = catalog.get_available();
+      auto it = std::find_if(avail.begin(), avail.end(), [&req](const auto& e){
+        return std::get<4>(e) == req.serial && std::get<1>(e) == req.width && std::get<2>(e) == req.height;
+      });
+      if (it == avail.end())
+        return "camera " + req.serial + " with resolution " + std::to_string(req.width) + " × " + std::to_string(req.height) + " not found";
+
+      if (std::find(std::get<5>(*it).begin(), std::get<5>(*it).end(), req.fps) == std::get<5>(*it).end())
+        req.fps = 0;
+      auto avail_depth = catalog.get_available_depth();
+      if (std::none_of(avail_depth.begin(), avail_depth.end(), [&req](const auto& e){
+            return std::get<0>(e) == req.serial && std::get<1>(e) == req.depth_width && std::get<2>(e) == req.depth_height;
+          }))
+        req.depth_width = req.depth_height = 0;
+      req.unverified = false;
+      return { };
+    }
+
+
+    // All cameras which are starting, running, or still stopping.  While
+    // a camera starts its entry has no pointer and the requested serial
+    // number, empty for any camera.  An entry is only removed at the end
+    // of the destructor, until then the device cannot be opened again.
+    struct registry_entry {
+      std::weak_ptr<camera> cam;
+      const camera* ptr;
+      std::string serial;
+    };
+    std::mutex registry_lock;
+    std::condition_variable registry_cond;
+    std::list<registry_entry> registry;
+
   }// anonymous namespace
 
 
-  device::device(video_format format_, float max_distance, size_t ndepth_history, unsigned char* color, rs2::config& config)
-  : format(format_),
+  camera::camera(const camera_request& req_)
+  : req(req_),
     // Create the pipeline object.
     pipe(std::make_unique<rs2::pipeline>()),
     // Calling pipeline's start() without any additional parameters will start the first device
     // with its default streams.
-    // The start function returns the pipeline profile which the pipeline used to start the device
-    profile(pipe->start(config)),
+    // The start function returns the pipeline profile which the pipeline used to start the device.
+    // The frames are delivered in the callback which just passes them on to the processing thread.
+    // If that thread is too slow older frames are dropped.
+    profile(pipe->start(make_config(req), [this](const rs2::frame& f){
+      if (auto fs = f.as<rs2::frameset>()) {
+        captured.back().frames = fs;
+        captured.back().arrival_ns = monotonic_ns();
+        captured.publish();
+
+        if (! running.load(std::memory_order_relaxed)) {
+          const std::lock_guard<std::mutex> guard(runlock);
+          running.store(true, std::memory_order_relaxed);
+          runcond.notify_all();
+        }
+      }
+    })),
     // Pipeline could choose a device that does not have a color stream
     // If there is no color stream, choose to align depth to another stream
     align_to(find_stream_to_align(profile.get_streams())),
@@ -92,103 +226,232 @@ namespace realsense {
     // Each depth camera might have different units for depth pixels, so we get it here
     // Using the pipeline's profile, we can retrieve the device that the pipeline uses
     depth_scale(get_depth_scale(profile.get_device())),
-    // From the caller.
-    depth_clipping_max_distance(max_distance),
-    // Compute the foreground limit
-    upper_limit(depth_clipping_max_distance / depth_scale)
+    period_ns(stream_period(profile.get_stream(align_to)))
   {
-    // Get one frame to determine the size.
-    auto frameset = wait();
-    auto processed = align.process(frameset);
-    rs2::video_frame other_frame = processed.first(align_to);
+    // The depth frames are aligned to the other stream, its profile determines the size.
+    auto other_profile = profile.get_stream(align_to).as<rs2::video_stream_profile>();
+    width = other_profile.width();
+    height = other_profile.height();
+
+    if (req.serial == greenscreen::replay_serial) {
+      // Without real-time pacing the recording is played back as fast as possible.
+      profile.get_device().as<rs2::playback>().set_real_time(req.replay_realtime);
+      name = "Recording [" + std::filesystem::path(req.replay_file).filename().string() + "]";
+      serial = greenscreen::replay_serial;
+    } else {
+      name = std::string(profile.get_device().get_info(RS2_CAMERA_INFO_NAME));
+      serial = std::string(profile.get_device().get_info(RS2_CAMERA_INFO_SERIAL_NUMBER));
+    }
+
+    processing = std::thread([this]{ process_frames(); });
+  }
 
-    name = std::string(profile.get_device().get_info(RS2_CAMERA_INFO_NAME));
-    serial = std::string(profile.get_device().get_info(RS2_CAMERA_INFO_SERIAL_NUMBER));
 
-    width = other_frame.get_width();
-    height = other_frame.get_height();
-    bpp = format == video_format::rgb ? 3 : 4;
+  camera::~camera()
+  {
+    pipe->stop();
+    captured.close();
+    processing.join();
 
-    for (size_t i = 0; i < ndepth_history; ++i)
-      depth_history.emplace_back(width * height);
+    {
+      const std::lock_guard<std::mutex> guard(registry_lock);
 
-    std::copy_n(color, sizeof(green_bytes), green_bytes);
+      std::erase_if(registry, [this](const auto& e){ return e.ptr == this; });
+    }
+    registry_cond.notify_all();
   }
 
 
-  device::~device()
+  std::shared_ptr<camera> camera::acquire(const camera_request& req)
   {
-    pipe->stop();
+    // The references taken here can be the last ones.  They are released
+    // after the lock since the destructor needs it.
+    std::vector<std::shared_ptr<camera>> cameras;
+    std::unique_lock<std::mutex> guard(registry_lock);
+
+    // A camera whose last reference went away may still be stopping, the
+    // device is busy until its destructor is done.  A camera which is
+    // starting might be usable once it runs.
+    registry_cond.wait(guard, [&req]{
+      return std::ranges::none_of(registry, [&req](const auto& e){
+        return e.cam.expired() && (req.serial.empty() || e.serial.empty() || e.serial == req.serial);
+      });
+    });
+    for (const auto& e : registry)
+      if (auto c = e.cam.lock())
+        cameras.push_back(std::move(c));
+    for (const auto& c : cameras)
+      if (c->matches(req))
+        return c;
+
+    // Starting the pipeline takes seconds, the other sources must not wait
+    // for the lock meanwhile.  The reservation keeps them from starting
+    // the same device.
+    auto reservation = registry.insert(registry.end(), { std::weak_ptr<camera>(), nullptr, req.serial });
+    guard.unlock();
+    cameras.clear();
+    std::shared_ptr<camera> res;
+    try {
+      res = std::make_shared<camera>(req);
+    }
+    catch (...) {
+      guard.lock();
+      registry.erase(reservation);
+      guard.unlock();
+      registry_cond.notify_all();
+      throw;
+    }
+    guard.lock();
+    *reservation = { res, res.get(), res->serial };
+    guard.unlock();
+    registry_cond.notify_all();
+    return res;
   }
 
 
-  inline bool device::valid_distance(size_t pixels_distance) const
+  bool camera::matches(const camera_request& other)
   {
-    return pixels_distance <= upper_limit;
+    // The profile can change in the processing thread.
+    const std::lock_guard<std::mutex> guard(lock);
+
+    if (serial == greenscreen::replay_serial || other.serial == greenscreen::replay_serial)
+      return serial == other.serial && req.replay_file == other.replay_file && req.replay_realtime == other.replay_realtime;
+
+    // Without serial number any running camera with the profile will do.
+    auto color_profile = profile.get_stream(align_to).as<rs2::video_stream_profile>();
+    auto depth_profile = profile.get_stream(RS2_STREAM_DEPTH).as<rs2::video_stream_profile>();
+    return (other.serial.empty() || serial == other.serial) && req.record_file == other.record_file
+      && (other.width == 0 || (width == other.width && height == other.height))
+      && (other.fps == 0 || color_profile.fps() == other.fps)
+      && (other.depth_width == 0 || (size_t(depth_profile.width()) == other.depth_width && size_t(depth_profile.height()) == other.depth_height))
+      && other.rgba == (color_profile.format() == RS2_FORMAT_RGBA8);
   }
 
 
-  void device::remove_background(uint8_t* dest, size_t framesize, rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame_)
+  void camera::add(device* consumer)
   {
-    assert(depth_frame_.get_bytes_per_pixel() == 2);
-    const uint16_t* depth_frame = reinterpret_cast<const uint16_t*>(depth_frame_.get_data());
-    auto ndepth_history = depth_history.size();
-    assert(size_t(depth_frame_.get_width()) * size_t(depth_frame_.get_height()) == depth_history[last_depth_frame].size());
-    std::copy_n(depth_frame, depth_history[last_depth_frame].size(), depth_history[last_depth_frame].data());
-    if (++last_depth_frame == ndepth_history)
-      last_depth_frame = 0;
+    const std::lock_guard<std::mutex> guard(lock);
 
-    uint8_t* p_other_frame = reinterpret_cast<uint8_t*>(const_cast<void*>(other_frame.get_data()));
+    consumers.push_back(consumer);
+  }
 
-    assert(width == size_t(other_frame.get_width()));
-    assert(height == size_t(other_frame.get_height()));
-    size_t other_bpp = other_frame.get_bytes_per_pixel();
-    assert(other_bpp == 3);
 
-    size_t copy_height = width * height * bpp <= framesize ? height : (framesize / (width * bpp));
+  void camera::remove(device* consumer)
+  {
+    const std::lock_guard<std::mutex> guard(lock);
 
-    if (bpp == other_bpp) {
-      for (size_t y = 0; y < copy_height; y++) {
-        auto depth_pixel_index = y * width;
-        auto offset = depth_pixel_index * other_bpp;
-        for (size_t x = 0; x < width; x++, ++depth_pixel_index, offset += other_bpp) {
+    std::erase(consumers, consumer);
+  }
 
-          // Get the depth value of the current pixel
-          auto pixels_distance = 0zu;
-          for (size_t i = 0; i < ndepth_history; ++i)
-            pixels_distance += depth_history[i][depth_pixel_index] ?: std::numeric_limits<uint16_t>::max();
-          pixels_distance = (pixels_distance + ndepth_history / 2) / ndepth_history;
-          std::memcpy(&dest[offset], valid_distance(pixels_distance) ? &p_other_frame[offset] : green_bytes, other_bpp);
-        }
+
+  float camera::current_depth_scale()
+  {
+    const std::lock_guard<std::mutex> guard(lock);
+
+    return depth_scale;
+  }
+
+
+  void camera::process_frames()
+  {
+    while (! captured.closed()) {
+      // Block until the capture callback provides a new frameset.
+      auto start = monotonic_ns();
+      auto frameset = wait();
+      if (frameset == nullptr || ! frameset->frames)
+        continue;
+
+      const std::lock_guard<std::mutex> guard(lock);
+
+      if (consumers.empty())
+        continue;
+      update_profile();
+      ++nframes;
+
+      // Trying to get both other and depth frames
+      rs2::video_frame other_frame = frameset->frames.first(align_to);
+      rs2::depth_frame depth_frame = frameset->frames.get_depth_frame();
+
+      // If one of them is unavailable, continue iteration
+      if (!depth_frame || !other_frame) {
+        for (auto c : consumers)
+          c->timing.empty.fetch_add(1, std::memory_order_relaxed);
+        continue;
       }
-    } else {
-      for (size_t y = 0; y < copy_height; y++) {
-        auto depth_pixel_index = y * width;
-        auto src_offset = depth_pixel_index * other_bpp;
-        auto dst_offset = depth_pixel_index * bpp;
-        for (size_t x = 0; x < width; x++, ++depth_pixel_index, src_offset += other_bpp, dst_offset += bpp) {
-          // Get the depth value of the current pixel
-          auto pixels_distance = 0zu;
-          for (size_t i = 0; i < ndepth_history; ++i)
-            pixels_distance += depth_history[i][depth_pixel_index] ?: std::numeric_limits<uint16_t>::max();
-          pixels_distance = (pixels_distance + ndepth_history / 2) / ndepth_history;
-
-          if (valid_distance(pixels_distance)) {
-            std::memcpy(&dest[dst_offset], &p_other_frame[src_offset], other_bpp);
-            dest[dst_offset + 3] = 0xff;
-          } else
-            std::memcpy(&dest[dst_offset], green_bytes, bpp);
+
+      aligned_frameset frame{ other_frame, nullptr, 0, frameset->arrival_ns, 0, monotonic_ns() - start, 0 };
+      frame.timestamp_ns = frame_time(frame.other_frame, frameset->arrival_ns);
+      // The timestamps in the system time domains are milliseconds of the
+      // system clock, hardware clock timestamps cannot be compared.
+      auto domain = frame.other_frame.get_frame_timestamp_domain();
+      frame.sensor_ns = domain == RS2_TIMESTAMP_DOMAIN_HARDWARE_CLOCK ? 0 : uint64_t(frame.other_frame.get_timestamp() * 1e6);
+
+      // The frame is only masked in place if no other device reads it.
+      for (auto c : consumers) {
+        auto& a = aligned_for(c, frameset->frames, nframes);
+        if (a.result == nullptr) {
+          c->timing.empty.fetch_add(1, std::memory_order_relaxed);
+          continue;
         }
+        frame.depth = a.result;
+        frame.align_ns = a.align_ns;
+        if (c->get_frame(c->output.back(), frame, consumers.size() == 1))
+          c->output.publish();
       }
+
+      // Settings no consumer uses anymore are dropped, the frames of
+      // librealsense go back to its pool.
+      std::erase_if(alignments, [this](const auto& a){ return a->frame != nframes; });
+      for (auto& a : alignments)
+        a->processed = rs2::frameset();
     }
   }
 
 
-  rs2::frameset device::wait()
+  camera::alignment& camera::aligned_for(device* consumer, const rs2::frameset& frames, uint64_t frame)
   {
-    // Using the align object, we block the application until a frameset is available
-    rs2::frameset frameset = pipe->wait_for_frames();
+    const auto engine = consumer->align_with.load(std::memory_order_relaxed);
+    const auto distance = engine == align_engine::lookup ? consumer->align_distance.load(std::memory_order_relaxed) : 0.0f;
+    auto it = std::ranges::find_if(alignments, [engine, distance](const auto& a){ return a->engine == engine && a->distance == distance; });
+    if (it == alignments.end()) {
+      auto a = std::make_unique<alignment>();
+      a->engine = engine;
+      a->distance = distance;
+      configure_aligner(*a);
+      it = alignments.insert(alignments.end(), std::move(a));
+    }
 
+    auto& a = **it;
+    if (a.frame != frame) {
+      auto aligning = monotonic_ns();
+      if (engine == align_engine::librealsense) {
+        a.processed = align.process(frames);
+        rs2::depth_frame depth_frame = a.processed.get_depth_frame();
+        a.result = depth_frame ? static_cast<const uint16_t*>(depth_frame.get_data()) : nullptr;
+      } else {
+        a.depth.resize(width * height);
+        // The pool cannot change while the lock is held.
+        a.aligner.process(a.depth.data(), static_cast<const uint16_t*>(frames.get_depth_frame().get_data()), consumers.front()->pool);
+        a.result = a.depth.data();
+      }
+      a.align_ns = monotonic_ns() - aligning;
+      a.frame = frame;
+    }
+    return a;
+  }
+
+
+  captured_frameset* camera::wait()
+  {
+    if (! captured.wait())
+      return nullptr;
+
+    return &captured.front();
+  }
+
+
+  void camera::update_profile()
+  {
     // rs2::pipeline::wait_for_frames() can replace the device it uses in case of device error or disconnection.
     // Since rs2::align is aligning depth to some other stream, we need to make sure that the stream was not changed
     //  after the call to wait_for_frames();
@@ -205,29 +468,148 @@ namespace realsense {
       // Each depth camera might have different units for depth pixels, so we get it here
       // Using the pipeline's profile, we can retrieve the device that the pipeline uses
       depth_scale = get_depth_scale(profile.get_device());
+      // The foreground limit and the feather width depend on the depth scale.
+      for (auto c : consumers)
+        c->set_depth_scale(depth_scale);
+      period_ns = stream_period(profile.get_stream(align_to));
+      auto other_profile = profile.get_stream(align_to).as<rs2::video_stream_profile>();
+      width = other_profile.width();
+      height = other_profile.height();
+      // The tables of the other alignment engines depend on the profile,
+      // they are computed again for the next frameset.
+      alignments.clear();
     }
+  }
 
-    return frameset;
+
+  uint64_t camera::frame_time(const rs2::frame& frame, uint64_t arrival_ns)
+  {
+    auto ts = int64_t(frame.get_timestamp() * 1e6);
+    if (frame.get_frame_timestamp_domain() != RS2_TIMESTAMP_DOMAIN_HARDWARE_CLOCK)
+      // The timestamp is in system time.
+      clock_offset = int64_t(monotonic_ns()) - int64_t(system_ns());
+
+    // A frame cannot be taken after it arrived.  The hardware clock can be
+    // reset and a recording played back loops or is not paced in real-time,
+    // then the arrival time serves as the new reference.
+    auto res = ts + clock_offset;
+    if (res > int64_t(arrival_ns) || int64_t(arrival_ns) - res > max_clock_skew) {
+      clock_offset = int64_t(arrival_ns) - ts;
+      res = int64_t(arrival_ns);
+    }
+    return uint64_t(res);
   }
 
 
-  bool device::get_frame(uint8_t* dest, size_t framesize)
+  bool camera::wait_running(uint64_t timeout_ns)
   {
-    auto frameset = wait();
+    std::unique_lock<std::mutex> guard(runlock);
 
-    // Get processed aligned frame
-    auto processed = align.process(frameset);
+    return runcond.wait_for(guard, std::chrono::nanoseconds(timeout_ns), [this]{ return running.load(std::memory_order_relaxed); });
+  }
 
-    // Trying to get both other and aligned depth frames
-    rs2::video_frame other_frame = processed.first(align_to);
-    rs2::depth_frame aligned_depth_frame = processed.get_depth_frame();
 
-    // If one of them is unavailable, continue iteration
-    if (!aligned_depth_frame || !other_frame)
-      return false;
+  void camera::configure_aligner(alignment& a)
+  {
+    // The tables are only needed for the other engines.
+    if (a.engine == align_engine::librealsense)
+      return;
+
+    auto depth_profile = profile.get_stream(RS2_STREAM_DEPTH).as<rs2::video_stream_profile>();
+    auto other_profile = profile.get_stream(align_to).as<rs2::video_stream_profile>();
+    auto extr = depth_profile.get_extrinsics_to(other_profile);
+    extrinsics depth_to_color;
+    std::copy_n(extr.rotation, 9, depth_to_color.rotation);
+    std::copy_n(extr.translation, 3, depth_to_color.translation);
+
+    a.aligner.configure(a.engine, convert(depth_profile.get_intrinsics()), convert(other_profile.get_intrinsics()), depth_to_color, depth_scale, a.distance);
+  }
+
+
+  device::device(std::shared_ptr<camera> cam_, video_format format_, float max_distance, size_t ndepth_history, align_engine engine, unsigned char* color, triple_buffer<output_frame>& output_, worker_pool* pool_, frame_stats& timing_)
+  : cam(std::move(cam_)),
+    format(format_),
+    depth_scale(cam->current_depth_scale()),
+    // From the caller.
+    depth_clipping_max_distance(max_distance),
+    align_with(engine),
+    align_distance(max_distance),
+    mask(format, ndepth_history, color),
+    pool(pool_),
+    output(output_),
+    timing(timing_)
+  {
+    mask.set_nworkers(pool == nullptr ? 1 : pool->size());
+    mask.resize(cam->width, cam->height);
+    // Compute the foreground limit
+    mask.set_upper_limit(depth_clipping_max_distance / depth_scale);
+  }
+
+
+  device::~device()
+  {
+    detach();
+  }
+
+
+  void device::remove_background(uint8_t* dest, size_t framesize, rs2::video_frame& other_frame, const uint16_t* depth)
+  {
+    assert(mask.get_width() == size_t(other_frame.get_width()));
+    assert(mask.get_height() == size_t(other_frame.get_height()));
+    assert(other_frame.get_bytes_per_pixel() == 3 || (other_frame.get_bytes_per_pixel() == 4 && mask.get_bpp() == 4));
+
+    mask.set_source_bpp(other_frame.get_bytes_per_pixel());
+    mask.process(dest, framesize, static_cast<const uint8_t*>(other_frame.get_data()), depth, pool);
+  }
+
+
+  bool device::get_frame(output_frame& dest, const aligned_frameset& frame, bool exclusive)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    apply_changes();
+
+    timing.wait.record(frame.wait_ns);
+    timing.align.record(frame.align_ns);
+    auto start = monotonic_ns();
+
+    rs2::video_frame other_frame = frame.other_frame;
+
+    // A profile change might have changed the size.
+    if (mask.get_width() != size_t(other_frame.get_width()) || mask.get_height() != size_t(other_frame.get_height()))
+      mask.resize(other_frame.get_width(), other_frame.get_height());
+
+    dest.width = mask.get_width();
+    dest.height = mask.get_height();
+    dest.format = format;
+    dest.bpp = mask.get_bpp();
+    dest.framesize = mask.get_framesize();
+    // The YUV formats cannot be masked in place, the number of bytes per pixel differs.
+    if (exclusive && in_place.load(std::memory_order_relaxed) && size_t(other_frame.get_bytes_per_pixel()) == dest.bpp && size_t(other_frame.get_stride_in_bytes()) == dest.width * dest.bpp) {
+      // librealsense's frame pool provides the buffer, it is returned when
+      // the output no longer uses the frame.
+      dest.source = other_frame;
+      dest.pixels = static_cast<const uint8_t*>(other_frame.get_data());
+    } else {
+      dest.source = rs2::frame();
+      dest.data.resize(dest.framesize);
+      dest.pixels = dest.data.data();
+    }
+    dest.timestamp_ns = frame.timestamp_ns;
+    dest.period_ns = cam->period_ns;
+    dest.arrival_ns = frame.arrival_ns;
+    dest.sensor_ns = frame.sensor_ns;
+    dest.placeholder = false;
 
     // Passing both frames to remove_background so it will "strip" the background
-    remove_background(dest, framesize, other_frame, aligned_depth_frame);
+    const bool capturing = mask.background.capturing();
+    remove_background(const_cast<uint8_t*>(dest.pixels), dest.framesize, other_frame, frame.depth);
+    timing.mask.record(monotonic_ns() - start);
+    timing.pixels.fetch_add(mask.get_width() * mask.get_height(), std::memory_order_relaxed);
+    timing.evaluated_pixels.fetch_add(mask.get_evaluated_pixels(), std::memory_order_relaxed);
+
+    if (capturing && ! mask.background.capturing() && ! background_dir.empty())
+      save_background();
 
     return true;
   }
@@ -235,154 +617,891 @@ namespace realsense {
 
   void device::set_color(uint32_t newcol)
   {
-    green_bytes[0] = (newcol >> 16) & 0xff;
-    green_bytes[1] = (newcol >> 8) & 0xff;
-    green_bytes[2] = newcol & 0xff;
+    next_color.store(newcol, std::memory_order_relaxed);
+    changes.fetch_or(new_color, std::memory_order_release);
+  }
+
+
+  void device::set_transparency(unsigned char newa)
+  {
+    next_transparency.store(newa, std::memory_order_relaxed);
+    changes.fetch_or(new_transparency, std::memory_order_release);
   }
 
 
   void device::set_max_distance(float newmax)
   {
-    depth_clipping_max_distance = newmax;
-    upper_limit = depth_clipping_max_distance / depth_scale;
+    next_max_distance.store(newmax, std::memory_order_relaxed);
+    changes.fetch_or(new_max_distance, std::memory_order_release);
+
+    align_distance.store(newmax, std::memory_order_relaxed);
   }
 
 
   void device::set_ndepth_history(size_t newsize)
   {
-    if (newsize != depth_history.size()) {
-      if (newsize < depth_history.size()) {
-        depth_history.resize(newsize);
-        if (last_depth_frame >= newsize)
-          last_depth_frame = 0;
-      } else
-        for (auto i = depth_history.size(); i < newsize; ++i)
-          depth_history.emplace_back(width * height);
+    next_ndepth_history.store(newsize, std::memory_order_relaxed);
+    changes.fetch_or(new_ndepth_history, std::memory_order_release);
+  }
+
+
+  void device::apply_changes()
+  {
+    // A value which is stored again after the flags are read is applied
+    // twice, that is harmless.
+    auto c = changes.exchange(0, std::memory_order_acquire);
+    if (c == 0)
+      return;
+
+    if (c & new_color)
+      mask.set_color(next_color.load(std::memory_order_relaxed));
+    if (c & new_transparency)
+      mask.set_transparency(next_transparency.load(std::memory_order_relaxed));
+    if (c & new_max_distance) {
+      depth_clipping_max_distance = next_max_distance.load(std::memory_order_relaxed);
+      mask.set_upper_limit(depth_clipping_max_distance / depth_scale);
+    }
+    if (c & new_ndepth_history)
+      mask.set_ndepth_history(next_ndepth_history.load(std::memory_order_relaxed));
+  }
+
+
+  void device::set_depth_scale(float newscale)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    depth_scale = newscale;
+    mask.set_upper_limit(depth_clipping_max_distance / depth_scale);
+    mask.set_feather(size_t(feather_distance / depth_scale));
+    mask.set_background(use_background, size_t(background_margin / depth_scale));
+  }
+
+
+  void device::set_alpha_matte(bool newval)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    mask.set_alpha_matte(newval);
+  }
+
+
+  void device::set_feather(float newfeather)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    feather_distance = newfeather;
+    mask.set_feather(size_t(feather_distance / depth_scale));
+  }
+
+
+  void device::set_cleanup(cleanup_op newop, size_t newradius)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    mask.set_cleanup(newop, newradius);
+  }
+
+
+  void device::set_hole_fill(hole_fill newmode, size_t newradius)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    mask.set_hole_fill(newmode, newradius);
+  }
+
+
+  void device::set_backdrop(backdrop_mode newmode, size_t newradius)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    mask.set_backdrop(newmode, newradius);
+  }
+
+
+  void device::set_backdrop_image(const std::vector<uint8_t>& pixels, size_t width, size_t height)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    mask.set_backdrop_image(pixels.data(), width, height);
+  }
+
+
+  void device::set_roi(bool newval)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    mask.set_roi(newval);
+  }
+
+
+  void device::set_depth_filter(depth_filter newfilter)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    mask.set_depth_filter(newfilter);
+  }
+
+
+  void device::set_background(bool newuse, float newmargin)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    use_background = newuse;
+    background_margin = newmargin;
+    mask.set_background(use_background, size_t(background_margin / depth_scale));
+  }
+
+
+  void device::capture_background(float seconds)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    mask.capture_background(size_t(std::max(seconds, 0.0f) * 1e9f / float(cam->period_ns)));
+  }
+
+
+  void device::set_background_dir(const std::string& newdir)
+  {
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    // A reference which is already there, e.g., learned since, is kept.
+    background_dir = newdir;
+    if (! background_dir.empty() && ! mask.background.ready(mask.get_width(), mask.get_height())) {
+      background_model stored;
+      if (stored.load(background_file(), depth_scale) && stored.ready(mask.get_width(), mask.get_height()))
+        mask.background = std::move(stored);
     }
   }
 
 
-  greenscreen::greenscreen(video_format format_)
-  : format(format_), max_width(0), max_height(0)
+  std::string device::background_file() const
   {
-    rs2::config config;
+    return background_dir + "/realsense-background-" + cam->serial + ".bin";
+  }
 
-    dev = std::make_unique<device>(format, depth_clipping_max_distance, ndepth_history, green_bytes, config);
 
-    available.emplace_back(dev->name + " [" + dev->serial + "]", dev->width, dev->height, std::to_string(dev->width) + " × " + std::to_string(dev->height), dev->serial);
+  void device::save_background()
+  {
+    // Two writes of the same file must not overlap.  A capture takes
+    // seconds, the previous write is long done.
+    if (saving.valid())
+      saving.wait();
+    saving = std::async(std::launch::async, [model = mask.background, fname = background_file(), scale = depth_scale]{
+      return model.save(fname, scale);
+    });
+  }
+
+
+  void device::set_pool(worker_pool* newpool)
+  {
+    // The camera aligns with the pool of its first consumer.
+    const std::lock_guard<std::mutex> camguard(cam->lock);
+    const std::lock_guard<std::mutex> guard(masklock);
+
+    pool = newpool;
+    mask.set_nworkers(pool == nullptr ? 1 : pool->size());
+  }
 
+
+  device_catalog& device_catalog::get()
+  {
+    static device_catalog res;
+    return res;
+  }
+
+
+  device_catalog::device_catalog()
+  : thread([this]{ run(); })
+  {
+  }
+
+
+  device_catalog::~device_catalog()
+  {
+    {
+      const std::lock_guard<std::mutex> guard(lock);
+
+      done = true;
+    }
+    cond.notify_all();
+    thread.join();
+  }
+
+
+  void device_catalog::run()
+  {
     rs2::context ctx;
-    for (auto&& d : ctx.query_devices()) {
-      auto serial = d.get_info(RS2_CAMERA_INFO_SERIAL_NUMBER);
-      auto devname = std::string(d.get_info(RS2_CAMERA_INFO_NAME)) + " [" + serial + "]";
-
-      std::set<std::tuple<size_t,size_t>> resolutions;
-
-      auto sensors = d.query_sensors();
-      for (const auto& s : sensors) {
-        if (s.as<rs2::color_sensor>()) {
-          auto profiles = s.get_stream_profiles();
-          for (const auto& p : profiles)
-            if (const auto& vp = p.as<rs2::video_stream_profile>())
-              resolutions.insert(std::make_tuple<size_t,size_t>(vp.width(), vp.height()));
+    // Connecting or disconnecting a camera changes the list.
+    ctx.set_devices_changed_callback([this](rs2::event_information&){ refresh(); });
+
+    std::unique_lock<std::mutex> guard(lock);
+    while (true) {
+      cond.wait(guard, [this]{ return pending || done; });
+      if (done)
+        break;
+      pending = false;
+      guard.unlock();
+
+      std::vector<available_type> newavailable;
+      std::vector<available_depth_type> newavailable_depth;
+      try {
+        for (auto&& d : ctx.query_devices()) {
+          auto serial = d.get_info(RS2_CAMERA_INFO_SERIAL_NUMBER);
+          auto devname = std::string(d.get_info(RS2_CAMERA_INFO_NAME)) + " [" + serial + "]";
+
+          std::map<std::tuple<size_t,size_t>,std::set<int>> resolutions;
+          std::set<std::tuple<size_t,size_t>> depth_resolutions;
+
+          auto sensors = d.query_sensors();
+          for (const auto& s : sensors) {
+            if (s.as<rs2::color_sensor>()) {
+              auto profiles = s.get_stream_profiles();
+              for (const auto& p : profiles)
+                if (const auto& vp = p.as<rs2::video_stream_profile>())
+                  resolutions[std::make_tuple<size_t,size_t>(vp.width(), vp.height())].insert(vp.fps());
+            } else if (s.as<rs2::depth_sensor>()) {
+              // The depth sensor also provides the infrared streams.
+              auto profiles = s.get_stream_profiles();
+              for (const auto& p : profiles)
+                if (const auto& vp = p.as<rs2::video_stream_profile>(); vp && vp.stream_type() == RS2_STREAM_DEPTH)
+                  depth_resolutions.insert(std::make_tuple<size_t,size_t>(vp.width(), vp.height()));
+            }
+          }
+
+          for (auto&& [res, rates] : resolutions) {
+            auto resstr = std::to_string(std::get<0>(res)) + " × " + std::to_string(std::get<1>(res));
+            newavailable.emplace_back(devname, std::get<0>(res), std::get<1>(res), resstr, std::string(serial), std::vector<int>(rates.begin(), rates.end()));
+          }
+
+          // Largest resolution first, as for the color stream.
+          for (auto it = depth_resolutions.rbegin(); it != depth_resolutions.rend(); ++it) {
+            auto resstr = std::to_string(std::get<0>(*it)) + " × " + std::to_string(std::get<1>(*it));
+            newavailable_depth.emplace_back(std::string(serial), std::get<0>(*it), std::get<1>(*it), resstr);
+          }
         }
       }
+      catch (const rs2::error&) {
+        // A camera which disappears during the enumeration is missing
+        // until the next one.
+      }
+      sort_available(newavailable);
 
-      for (auto&& res : resolutions) {
-        if (dev->serial != serial || dev->width != std::get<0>(res) || dev->height != std::get<1>(res)) {
-          auto resstr = std::to_string(std::get<0>(res)) + " × " + std::to_string(std::get<1>(res));
-          available.emplace_back(devname, std::get<0>(res), std::get<1>(res), resstr, std::string(serial));
-        }
+      guard.lock();
+      available = std::move(newavailable);
+      available_depth = std::move(newavailable_depth);
+      enumerated = true;
+      cond.notify_all();
+    }
+  }
+
+
+  void device_catalog::refresh()
+  {
+    {
+      const std::lock_guard<std::mutex> guard(lock);
+
+      pending = true;
+    }
+    cond.notify_all();
+  }
+
+
+  bool device_catalog::ready()
+  {
+    const std::lock_guard<std::mutex> guard(lock);
 
-        max_width = std::max(max_width, size_t(std::get<0>(res)));
-        max_height = std::max(max_height, size_t(std::get<1>(res)));
+    return enumerated || ! available.empty();
+  }
+
+
+  void device_catalog::wait_ready()
+  {
+    std::unique_lock<std::mutex> guard(lock);
+
+    cond.wait(guard, [this]{ return enumerated || ! available.empty(); });
+  }
+
+
+  std::vector<device_catalog::available_type> device_catalog::get_available()
+  {
+    const std::lock_guard<std::mutex> guard(lock);
+
+    return available;
+  }
+
+
+  std::vector<device_catalog::available_depth_type> device_catalog::get_available_depth()
+  {
+    const std::lock_guard<std::mutex> guard(lock);
+
+    return available_depth;
+  }
+
+
+  std::string device_catalog::save()
+  {
+    const std::lock_guard<std::mutex> guard(lock);
+
+    // Color profiles:  c TAB name TAB serial TAB width TAB height TAB fps,fps,...
+    // Depth profiles:  d TAB serial TAB width TAB height
+    std::string res;
+    for (const auto& [name, w, h, label, serial, fpss] : available) {
+      res += "c\t" + name + '\t' + serial + '\t' + std::to_string(w) + '\t' + std::to_string(h) + '\t';
+      for (size_t i = 0; i < fpss.size(); ++i)
+        res += (i == 0 ? "" : ",") + std::to_string(fpss[i]);
+      res += '\n';
+    }
+    for (const auto& [serial, w, h, label] : available_depth)
+      res += "d\t" + serial + '\t' + std::to_string(w) + '\t' + std::to_string(h) + '\n';
+    return res;
+  }
+
+
+  void device_catalog::load(const std::string& text)
+  {
+    std::vector<available_type> newavailable;
+    std::vector<available_depth_type> newavailable_depth;
+
+    std::istringstream lines(text);
+    for (std::string line; std::getline(lines, line); ) {
+      std::vector<std::string> fields;
+      std::istringstream is(line);
+      for (std::string f; std::getline(is, f, '\t'); )
+        fields.emplace_back(std::move(f));
+
+      // Malformed lines are ignored.
+      try {
+        if (fields.size() >= 5 && fields[0] == "c") {
+          auto w = std::stoul(fields[3]);
+          auto h = std::stoul(fields[4]);
+          std::vector<int> fpss;
+          if (fields.size() > 5) {
+            std::istringstream fs(fields[5]);
+            for (std::string f; std::getline(fs, f, ','); )
+              fpss.push_back(std::stoi(f));
+          }
+          newavailable.emplace_back(fields[1], w, h, std::to_string(w) + " × " + std::to_string(h), fields[2], std::move(fpss));
+        } else if (fields.size() == 4 && fields[0] == "d") {
+          auto w = std::stoul(fields[2]);
+          auto h = std::stoul(fields[3]);
+          newavailable_depth.emplace_back(fields[1], w, h, std::to_string(w) + " × " + std::to_string(h));
+        }
+      }
+      catch (const std::logic_error&) {
       }
     }
 
-    // Don't sort the first element.
-    std::sort(available.begin() + 1, available.end(), [](const auto& l, const auto& r){
-      auto cr = std::get<0>(l).compare(std::get<0>(r));
-      if (cr != 0)
-        return cr < 0;
-      if (std::get<1>(l) != std::get<1>(r))
-        return std::get<1>(l) > std::get<1>(r);
-      return std::get<2>(l) > std::get<2>(r);
-    });
+    const std::lock_guard<std::mutex> guard(lock);
+
+    if (! enumerated) {
+      available = std::move(newavailable);
+      available_depth = std::move(newavailable_depth);
+    }
+    cond.notify_all();
   }
 
 
-  bool greenscreen::new_config(const std::string& serial, const std::string& resolution)
+  greenscreen::greenscreen(video_format format_, const std::string& replay_file_, bool replay_realtime_)
+  : format(format_), serial(replay_file_.empty() ? "" : replay_serial), replay_file(replay_file_), replay_realtime(replay_realtime_), pool(std::make_unique<worker_pool>(1))
   {
-    auto it = std::find_if(available.begin(), available.end(), [&serial, &resolution](const auto& e){
-      return std::get<4>(e) == serial && std::get<3>(e) == resolution;
-    });
-    if (it == available.end())
-      return false;
+    // The list of cameras is enumerated in the background.
+    device_catalog::get();
 
-    if (dev->serial == serial && dev->width == std::get<1>(*it) && dev->height == std::get<2>(*it))
+    starter = std::thread([this]{ start_devices(); });
+  }
+
+
+  greenscreen::~greenscreen()
+  {
+    {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      closing = true;
+    }
+    startcond.notify_all();
+    starter.join();
+  }
+
+
+  void greenscreen::open()
+  {
+    opened = true;
+    start(serial, width, height);
+  }
+
+
+  bool greenscreen::wait_started()
+  {
+    std::unique_lock<std::mutex> guard(devlock);
+
+    startcond.wait(guard, [this]{ return closing || (! pending && ! starting); });
+    return dev != nullptr;
+  }
+
+
+  std::string greenscreen::get_error()
+  {
+    const std::lock_guard<std::mutex> guard(devlock);
+
+    return start_error;
+  }
+
+
+  std::vector<greenscreen::available_type> greenscreen::get_available()
+  {
+    auto res = device_catalog::get().get_available();
+    if (! replay_file.empty()) {
+      res.emplace_back("Recording [" + std::filesystem::path(replay_file).filename().string() + "]", 0, 0, replay_resolution, replay_serial, std::vector<int>());
+      sort_available(res);
+    }
+    return res;
+  }
+
+
+  std::vector<greenscreen::available_depth_type> greenscreen::get_available_depth()
+  {
+    return device_catalog::get().get_available_depth();
+  }
+
+
+  std::string greenscreen::current_serial()
+  {
+    const std::lock_guard<std::mutex> guard(devlock);
+
+    if (! serial.empty() || dev == nullptr)
+      return serial;
+    return dev->cam->serial;
+  }
+
+
+  bool greenscreen::new_config(const std::string& newserial, const std::string& resolution, int newfps, const std::string& depth_resolution)
+  {
+    size_t newwidth = 0;
+    size_t newheight = 0;
+    size_t newdepth_width = 0;
+    size_t newdepth_height = 0;
+    if (newserial != replay_serial && ! device_catalog::get().ready()) {
+      // The enumeration is not waited for, it can take seconds.  The
+      // starter thread checks the profile once the list is known.
+      if (newserial.empty() || ! parse_resolution(resolution, newwidth, newheight))
+        return false;
+      if (! parse_resolution(depth_resolution, newdepth_width, newdepth_height))
+        newdepth_width = newdepth_height = 0;
+    } else {
+      auto avail = get_available();
+      auto it = std::find_if(avail.begin(), avail.end(), [&newserial, &resolution](const auto& e){
+        return std::get<4>(e) == newserial && std::get<3>(e) == resolution;
+      });
+      if (it == avail.end())
+        return false;
+      newwidth = std::get<1>(*it);
+      newheight = std::get<2>(*it);
+
+      // The frame rates depend on the resolution.
+      if (std::find(std::get<5>(*it).begin(), std::get<5>(*it).end(), newfps) == std::get<5>(*it).end())
+        newfps = 0;
+
+      auto avail_depth = get_available_depth();
+      auto dit = std::find_if(avail_depth.begin(), avail_depth.end(), [&newserial, &depth_resolution](const auto& e){
+        return std::get<0>(e) == newserial && std::get<3>(e) == depth_resolution;
+      });
+      if (dit != avail_depth.end()) {
+        newdepth_width = std::get<1>(*dit);
+        newdepth_height = std::get<2>(*dit);
+      }
+    }
+
+    if (current_serial() == newserial && (newserial == replay_serial || (get_width() == newwidth && get_height() == newheight && fps == newfps && depth_width == newdepth_width && depth_height == newdepth_height)))
       // Nothing changed.
       return false;
 
-    rs2::config config;
-    config.enable_device(serial);
-    config.enable_stream(RS2_STREAM_DEPTH);
-    config.enable_stream(RS2_STREAM_COLOR, int(std::get<1>(*it)), int(std::get<2>(*it)));
+    fps = newfps;
+    depth_width = newdepth_width;
+    depth_height = newdepth_height;
 
-    const std::lock_guard<std::mutex> guard(devlock);
+    if (opened)
+      start(newserial, newwidth, newheight);
+    else {
+      const std::lock_guard<std::mutex> guard(devlock);
 
-    dev.reset(nullptr);
-    dev = std::make_unique<device>(format, depth_clipping_max_distance, ndepth_history, green_bytes, config);
+      serial = newserial;
+      width = newwidth;
+      height = newheight;
+    }
 
     return true;
   }
 
 
+  void greenscreen::start(const std::string& newserial, size_t newwidth, size_t newheight)
+  {
+    auto req = std::make_unique<camera_request>();
+    req->serial = newserial;
+    if (newserial == replay_serial) {
+      req->replay_file = replay_file;
+      req->replay_realtime = replay_realtime;
+    } else if (! newserial.empty()) {
+      req->width = newwidth;
+      req->height = newheight;
+      req->fps = fps;
+      req->depth_width = depth_width;
+      req->depth_height = depth_height;
+      req->rgba = in_place && record_file.empty() && format == video_format::rgba;
+      req->unverified = ! device_catalog::get().ready();
+      req->record_file = record_file;
+    }
+
+    {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      serial = newserial;
+      width = newwidth;
+      height = newheight;
+      // A request which is not yet started is replaced.
+      pending = std::move(req);
+    }
+    startcond.notify_all();
+  }
+
+
+  void greenscreen::start_devices()
+  {
+    std::unique_lock<std::mutex> guard(devlock);
+
+    while (true) {
+      startcond.wait(guard, [this]{ return pending || closing; });
+      if (closing)
+        break;
+
+      auto req = std::move(pending);
+      starting = true;
+
+      if (req->unverified) {
+        guard.unlock();
+        auto error = verify_request(*req);
+        guard.lock();
+        if (! error.empty()) {
+          starting = false;
+          start_error = std::move(error);
+          startcond.notify_all();
+          continue;
+        }
+      }
+
+      // A camera cannot be started twice.  If it runs with another profile
+      // and no other source uses it, it is stopped first.  If another source
+      // uses it the profile cannot change and the current device continues.
+      // Otherwise the current device continues until the new one is ready.
+      std::unique_ptr<device> old;
+      if (dev && dev->cam->serial != replay_serial && dev->cam->serial == req->serial && ! dev->cam->matches(*req)) {
+        if (dev->cam.use_count() > 1) {
+          starting = false;
+          start_error = "cannot change the profile of " + dev->cam->name + " while another source uses it";
+          startcond.notify_all();
+          continue;
+        }
+        dev->detach();
+        old = std::move(dev);
+      }
+      // Without device the output has no other producer.
+      if (! dev && ! placeholder_done && req->width != 0 && req->height != 0) {
+        publish_placeholder(req->width, req->height);
+        placeholder_done = true;
+      }
+
+      // Opening the camera takes a while, the settings can be changed
+      // meanwhile and the current device keeps producing frames.
+      guard.unlock();
+      old.reset(nullptr);
+      std::shared_ptr<camera> cam;
+      std::string error;
+      try {
+        cam = camera::acquire(*req);
+        if (! cam->wait_running(warmup_timeout_ns))
+          error = "no frames from " + cam->name;
+      }
+      catch (const std::exception& e) {
+        error = e.what();
+      }
+      guard.lock();
+
+      // A newer request replaces this one.
+      std::unique_ptr<device> newdev;
+      if (cam && ! pending && ! closing) {
+        // Allocating the buffers of the device and loading the learned
+        // background take a while as well.  The device is created with the
+        // current settings, those changed meanwhile are applied below.
+        unsigned char color[4];
+        std::copy_n(green_bytes, 4, color);
+        const auto newformat = format;
+        const auto max_distance = depth_clipping_max_distance;
+        const auto history = ndepth_history;
+        const auto newengine = engine;
+        const auto dir = background_dir;
+        guard.unlock();
+        try {
+          // The pool can be replaced meanwhile, it is set below.
+          newdev = std::make_unique<device>(cam, newformat, max_distance, history, newengine, color, output, nullptr, timing);
+          newdev->set_background_dir(dir);
+        }
+        catch (const std::exception& e) {
+          error = e.what();
+        }
+        guard.lock();
+      }
+
+      starting = false;
+      start_error = std::move(error);
+      if (newdev && ! pending && ! closing) {
+        newdev->set_pool(pool.get());
+        newdev->set_color(get_color());
+        newdev->set_transparency(green_bytes[3]);
+        newdev->set_max_distance(depth_clipping_max_distance);
+        newdev->set_ndepth_history(ndepth_history);
+        newdev->set_align_engine(engine);
+        configure_device(*newdev);
+
+        // From now on only the new device produces frames.
+        if (dev)
+          dev->detach();
+        old = std::move(dev);
+        dev = std::move(newdev);
+        dev->attach();
+        placeholder_done = true;
+      } else
+        old = std::move(newdev);
+      startcond.notify_all();
+
+      // Stopping a camera takes a while as well.
+      guard.unlock();
+      old.reset(nullptr);
+      cam.reset();
+      guard.lock();
+    }
+  }
+
+
+  void greenscreen::publish_placeholder(size_t placeholder_width, size_t placeholder_height)
+  {
+    // Masking a frame without valid depth values produces the background.
+    depth_mask placeholder_mask(format, 1, green_bytes);
+    placeholder_mask.resize(placeholder_width, placeholder_height);
+    placeholder_mask.set_alpha_matte(alpha_matte);
+    std::vector<uint8_t> src(placeholder_width * placeholder_height * 3);
+    std::vector<uint16_t> depth(placeholder_width * placeholder_height);
+
+    auto& dest = output.back();
+    dest.width = placeholder_width;
+    dest.height = placeholder_height;
+    dest.format = format;
+    dest.bpp = placeholder_mask.get_bpp();
+    dest.framesize = placeholder_mask.get_framesize();
+    dest.source = rs2::frame();
+    dest.data.resize(dest.framesize);
+    dest.pixels = dest.data.data();
+    placeholder_mask.process(dest.data.data(), dest.framesize, src.data(), depth.data());
+    dest.timestamp_ns = monotonic_ns();
+    dest.period_ns = 0;
+    dest.arrival_ns = dest.timestamp_ns;
+    dest.sensor_ns = 0;
+    dest.placeholder = true;
+    output.publish();
+  }
+
+
+  void greenscreen::configure_device(device& newdev)
+  {
+    // The recorder reads the frames as well.
+    newdev.set_in_place(in_place && record_file.empty());
+    newdev.set_alpha_matte(alpha_matte);
+    newdev.set_feather(feather_distance);
+    newdev.set_cleanup(cleanup, cleanup_radius);
+    newdev.set_hole_fill(holes, holes_radius);
+    newdev.set_backdrop(backdrop, blur_radius);
+    newdev.set_backdrop_image(backdrop_image, backdrop_width, backdrop_height);
+    newdev.set_roi(roi);
+    newdev.set_depth_filter(filter);
+    newdev.set_background(use_background, background_margin);
+    newdev.set_background_dir(background_dir);
+  }
+
+
+  void greenscreen::set_replay(const std::string& filename, bool realtime)
+  {
+    if (filename == replay_file && realtime == replay_realtime)
+      return;
+
+    replay_file = filename;
+    replay_realtime = realtime;
+
+    // Without a file the recording which is currently played back just continues.
+    if (opened && serial == replay_serial && ! replay_file.empty())
+      start(replay_serial, 0, 0);
+  }
+
+
+  void greenscreen::set_record(const std::string& filename)
+  {
+    if (filename == record_file)
+      return;
+
+    record_file = filename;
+
+    // Restart the camera to start or stop recording.
+    if (opened && serial != replay_serial)
+      start(current_serial(), get_width(), get_height());
+  }
+
+
+  const output_frame* greenscreen::latest_frame()
+  {
+    output.update();
+
+    // Nothing before the first frame is processed.
+    return output.front().pixels == nullptr ? nullptr : &output.front();
+  }
+
+
+  const output_frame* greenscreen::next_frame()
+  {
+    while (output.wait()) {
+      if (output.front().timestamp_ns > last_timestamp_ns) {
+        last_timestamp_ns = output.front().timestamp_ns;
+        return &output.front();
+      }
+      timing.out_of_order.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return nullptr;
+  }
+
+
+  void greenscreen::close_output()
+  {
+    output.close();
+  }
+
+
   bool greenscreen::get_frame(uint8_t* dest, size_t framesize)
+  {
+    auto frame = latest_frame();
+    if (frame == nullptr)
+      return false;
+
+    std::copy_n(frame->pixels, std::min(framesize, frame->framesize), dest);
+
+    return true;
+  }
+
+
+  pipeline_stats greenscreen::get_stats()
   {
     const std::lock_guard<std::mutex> guard(devlock);
 
-    return dev->get_frame(dest, framesize);
+    return { dev ? dev->cam->captured.stats() : triple_buffer<captured_frameset>::stats_type{}, output.stats(), timing.empty.load(std::memory_order_relaxed) };
   }
 
 
-  size_t greenscreen::get_width() const{
-    return dev->get_width();
+  void greenscreen::record_output(const output_frame& frame, uint64_t start_ns, uint64_t end_ns)
+  {
+    // The placeholder does not come from the camera.
+    if (frame.placeholder)
+      return;
+
+    timing.output.record(end_ns - start_ns);
+
+    // Late frames are handed over after the next frame arrived.
+    if (end_ns - frame.arrival_ns > frame.period_ns)
+      timing.late.fetch_add(1, std::memory_order_relaxed);
+
+    timing.capture_to_output.record(end_ns - frame.arrival_ns);
+    if (frame.sensor_ns != 0)
+      // Clocks can drift, ignore timestamps in the future.
+      if (auto now = system_ns(); now > frame.sensor_ns)
+        timing.sensor_to_output.record(now - frame.sensor_ns);
   }
-  size_t greenscreen::get_height() const
+
+
+  std::string greenscreen::stats_summary()
   {
-    return dev->get_height();
+    auto stats = get_stats();
+
+    std::string res = "frames: captured " + std::to_string(stats.capture.published) + " (" + std::to_string(stats.capture.dropped) + " dropped), processed "
+      + std::to_string(stats.output.published) + " (" + std::to_string(stats.output.dropped) + " dropped), " + std::to_string(stats.empty) + " empty, "
+      + std::to_string(timing.late.load(std::memory_order_relaxed)) + " late, " + std::to_string(timing.out_of_order.load(std::memory_order_relaxed)) + " out of order\n";
+    if (auto error = get_error(); ! error.empty())
+      res = "camera: " + error + "\n" + res;
+    res += "wait: " + timing.wait.summary() + "\n";
+    res += "align: " + timing.align.summary() + "\n";
+    res += "mask: " + timing.mask.summary() + "\n";
+    if (auto pixels = timing.pixels.load(std::memory_order_relaxed); pixels != 0) {
+      char buf[80];
+      snprintf(buf, sizeof(buf), "region of interest: %.1f%% of the pixels evaluated\n", 100.0 * double(timing.evaluated_pixels.load(std::memory_order_relaxed)) / double(pixels));
+      res += buf;
+    }
+    res += "output: " + timing.output.summary() + "\n";
+    res += "capture to output: " + timing.capture_to_output.summary() + "\n";
+    res += "sensor to output: " + timing.sensor_to_output.summary();
+    return res;
   }
-  size_t greenscreen::get_bpp() const
+
+
+  size_t greenscreen::get_width()
   {
-    return dev->get_bpp();
+    const std::lock_guard<std::mutex> guard(devlock);
+
+    return dev ? dev->get_width() : width;
   }
-  size_t greenscreen::get_framesize() const
+  size_t greenscreen::get_height()
   {
-    return max_width * max_height * (format == video_format::rgb ? 3 : 4);
+    const std::lock_guard<std::mutex> guard(devlock);
+
+    return dev ? dev->get_height() : height;
+  }
+  size_t greenscreen::get_bpp()
+  {
+    const std::lock_guard<std::mutex> guard(devlock);
+
+    return dev ? dev->get_bpp() : 0;
+  }
+  size_t greenscreen::get_framesize()
+  {
+    const std::lock_guard<std::mutex> guard(devlock);
+
+    return dev ? dev->get_framesize() : 0;
   }
 
 
   void greenscreen::set_color(uint32_t newcol)
   {
+    const std::lock_guard<std::mutex> guard(devlock);
+
     green_bytes[0] = (newcol >> 16) & 0xff;
     green_bytes[1] = (newcol >> 8) & 0xff;
     green_bytes[2] = newcol & 0xff;
 
-    dev->set_color(newcol);
+    if (dev)
+      dev->set_color(newcol);
   }
 
   void greenscreen::set_transparency(unsigned char newa)
   {
+    const std::lock_guard<std::mutex> guard(devlock);
+
     green_bytes[3] = newa;
 
-    dev->set_transparency(newa);
+    if (dev)
+      dev->set_transparency(newa);
   }
 
   void greenscreen::set_max_distance(float newmax)
   {
+    const std::lock_guard<std::mutex> guard(devlock);
+
     depth_clipping_max_distance = newmax;
 
-    dev->set_max_distance(newmax);
+    if (dev)
+      dev->set_max_distance(newmax);
   }
 
   void greenscreen::set_ndepth_history(size_t newsize)
@@ -392,7 +1511,199 @@ namespace realsense {
 
       ndepth_history = newsize;
 
-      dev->set_ndepth_history(newsize);
+      if (dev)
+        dev->set_ndepth_history(newsize);
+    }
+  }
+
+  void greenscreen::set_background(bool newuse, float newmargin)
+  {
+    if (newuse != use_background || newmargin != background_margin) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      use_background = newuse;
+      background_margin = newmargin;
+
+      if (dev)
+        dev->set_background(newuse, newmargin);
+    }
+  }
+
+  void greenscreen::capture_background(float seconds)
+  {
+    const std::lock_guard<std::mutex> guard(devlock);
+
+    if (dev)
+      dev->capture_background(seconds);
+  }
+
+  void greenscreen::set_background_dir(const std::string& newdir)
+  {
+    if (newdir != background_dir) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      background_dir = newdir;
+
+      if (dev)
+        dev->set_background_dir(newdir);
+    }
+  }
+
+  void greenscreen::set_depth_filter(depth_filter newfilter)
+  {
+    if (newfilter != filter) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      filter = newfilter;
+
+      if (dev)
+        dev->set_depth_filter(newfilter);
+    }
+  }
+
+  void greenscreen::set_align_engine(align_engine newengine)
+  {
+    if (newengine != engine) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      engine = newengine;
+
+      if (dev)
+        dev->set_align_engine(newengine);
+    }
+  }
+
+  void greenscreen::set_format(video_format newformat)
+  {
+    if (newformat != format) {
+      {
+        const std::lock_guard<std::mutex> guard(devlock);
+
+        format = newformat;
+      }
+
+      if (opened)
+        start(current_serial(), get_width(), get_height());
+    }
+  }
+
+  void greenscreen::set_in_place(bool newval)
+  {
+    if (newval != in_place) {
+      in_place = newval;
+
+      if (format == video_format::rgba && serial != replay_serial) {
+        // The camera has to provide a different format.
+        if (opened)
+          start(current_serial(), get_width(), get_height());
+      } else {
+        const std::lock_guard<std::mutex> guard(devlock);
+
+        if (dev)
+          dev->set_in_place(in_place && record_file.empty());
+      }
+    }
+  }
+
+  void greenscreen::set_alpha_matte(bool newval)
+  {
+    if (newval != alpha_matte) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      alpha_matte = newval;
+
+      if (dev)
+        dev->set_alpha_matte(newval);
+    }
+  }
+
+  void greenscreen::set_feather(float newfeather)
+  {
+    if (newfeather != feather_distance) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      feather_distance = newfeather;
+
+      if (dev)
+        dev->set_feather(newfeather);
+    }
+  }
+
+  void greenscreen::set_cleanup(cleanup_op newop, size_t newradius)
+  {
+    if (newop != cleanup || newradius != cleanup_radius) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      cleanup = newop;
+      cleanup_radius = newradius;
+
+      if (dev)
+        dev->set_cleanup(newop, newradius);
+    }
+  }
+
+  void greenscreen::set_hole_fill(hole_fill newmode, size_t newradius)
+  {
+    if (newmode != holes || newradius != holes_radius) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      holes = newmode;
+      holes_radius = newradius;
+
+      if (dev)
+        dev->set_hole_fill(newmode, newradius);
+    }
+  }
+
+  void greenscreen::set_backdrop(backdrop_mode newmode, size_t newradius)
+  {
+    if (newmode != backdrop || newradius != blur_radius) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      backdrop = newmode;
+      blur_radius = newradius;
+
+      if (dev)
+        dev->set_backdrop(newmode, newradius);
+    }
+  }
+
+  void greenscreen::set_backdrop_image(std::vector<uint8_t> pixels, size_t image_width, size_t image_height)
+  {
+    const std::lock_guard<std::mutex> guard(devlock);
+
+    backdrop_image = std::move(pixels);
+    backdrop_width = image_width;
+    backdrop_height = image_height;
+
+    if (dev)
+      dev->set_backdrop_image(backdrop_image, backdrop_width, backdrop_height);
+  }
+
+  void greenscreen::set_roi(bool newval)
+  {
+    if (newval != roi) {
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      roi = newval;
+
+      if (dev)
+        dev->set_roi(newval);
+    }
+  }
+
+  void greenscreen::set_nworkers(size_t newsize)
+  {
+    newsize = std::clamp(newsize, 1zu, std::max(size_t(std::thread::hardware_concurrency()), 1zu));
+    if (newsize != pool->size()) {
+      auto newpool = std::make_unique<worker_pool>(newsize);
+
+      const std::lock_guard<std::mutex> guard(devlock);
+
+      if (dev)
+        dev->set_pool(newpool.get());
+      // The old pool is no longer used by the device.
+      pool.swap(newpool);
     }
   }
 } // namespace realsense
@@ -1,43 +1,147 @@
 #ifndef _REALSENSE_GREENSCREEN_HH
 #define _REALSENSE_GREENSCREEN_HH 1
 
+#include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
 #include <tuple>
 #include <vector>
 #include <librealsense2/rs.hpp>
 
+#include "frame-allocator.hh"
+#include "frame-stats.hh"
+#include "realsense-align.hh"
+#include "realsense-mask.hh"
+#include "triple-buffer.hh"
+#include "worker-pool.hh"
+
 
 namespace realsense {
 
-  enum struct video_format {
-    rgb,
-    rgba,
+  // Result of processing one frame.
+  struct output_frame {
+    // The masked pixels, without padding between the rows.  They are either
+    // in data or, if the frame was masked in place, in the buffer of the
+    // camera's frame which source keeps alive.
+    const uint8_t* pixels = nullptr;
+    frame_vector<uint8_t> data;
+    rs2::frame source;
+    video_format format = video_format::rgb;
+    size_t width = 0;
+    size_t height = 0;
+    // For the YUV formats of the luma plane.
+    size_t bpp = 0;
+    // Size of all planes.
+    size_t framesize = 0;
+    // Time of the frame from the camera's timestamp, mapped to the
+    // monotonic clock.
+    uint64_t timestamp_ns = 0;
+    // Frame interval of the stream.
+    uint64_t period_ns = 0;
+    // Monotonic time the frameset arrived in the capture callback.
+    uint64_t arrival_ns = 0;
+    // System time of the sensor's timestamp, zero if the camera's clock
+    // is not mapped to the system time.
+    uint64_t sensor_ns = 0;
+    // Shown while the camera is started, not from the camera.
+    bool placeholder = false;
   };
 
 
-  struct device
-  {
-    device(video_format format_, float max_distance, size_t ndepth_history, unsigned char* color, rs2::config& config);
-    ~device();
+  // Frameset as handed from the capture callback to the processing thread.
+  struct captured_frameset {
+    rs2::frameset frames;
+    uint64_t arrival_ns = 0;
+  };
 
-    bool get_frame(uint8_t*, size_t framesize);
 
-    auto get_width() const { return width; }
-    auto get_height() const { return height; }
-    auto get_bpp() const { return bpp; }
+  // Counters for the stages of the pipeline: the capture callback of
+  // librealsense hands framesets to the processing thread which hands
+  // masked frames to the output.
+  struct pipeline_stats {
+    triple_buffer<captured_frameset>::stats_type capture;
+    triple_buffer<output_frame>::stats_type output;
+    // Framesets without depth or color frame.
+    uint64_t empty;
+  };
 
-    void set_color(uint32_t newcol);
-    void set_transparency(unsigned char newa) { green_bytes[3] = newa; }
-    void set_max_distance(float newmax);
-    void set_ndepth_history(size_t newsize);
 
-    rs2::frameset wait();
-    bool valid_distance(size_t pixels_distance) const;
-    void remove_background(uint8_t* dest, size_t framesize, rs2::video_frame& other_frame, const rs2::depth_frame& depth_frame);
+  struct device;
 
-    const video_format format;
+
+  // Stream profile a source asks for.  Zero sizes and frame rate select the
+  // camera's default.
+  struct camera_request {
+    // An empty serial number selects the first camera, the serial number
+    // greenscreen::replay_serial the recording in replay_file.
+    std::string serial;
+    size_t width = 0;
+    size_t height = 0;
+    int fps = 0;
+    size_t depth_width = 0;
+    size_t depth_height = 0;
+    // Ask the camera for RGBA frames, used for masking in place.
+    bool rgba = false;
+    // Made before the cameras were enumerated.  The starter thread checks
+    // the profile once the list is known.
+    bool unverified = false;
+    std::string record_file;
+    std::string replay_file;
+    bool replay_realtime = true;
+  };
+
+
+  // The pipeline of one camera.  All sources which use the same camera with
+  // the same stream profile share one camera object: the frames are captured
+  // and aligned once and then masked separately for each of the devices
+  // registered as consumers, with their own settings.  The camera is stopped
+  // when the last reference goes away.
+  struct camera
+  {
+    camera(const camera_request& req_);
+    ~camera();
+
+    // Running camera which satisfies REQ or a newly started one.  A camera
+    // of the same device which is still starting or stopping is waited
+    // for.  Cameras of other devices start and stop in parallel.
+    static std::shared_ptr<camera> acquire(const camera_request& req);
+    bool matches(const camera_request& other);
+
+    void add(device* consumer);
+    void remove(device* consumer);
+
+    float current_depth_scale();
+
+    // Block until the first frameset arrived, at most TIMEOUT_NS.
+    bool wait_running(uint64_t timeout_ns);
+
+    void process_frames();
+    captured_frameset* wait();
+    // Called with the lock held.
+    void update_profile();
+    // Alignment of the current frameset for a consumer.  Consumers with
+    // the same engine and, for the lookup table, the same cutoff distance
+    // share it, it is computed at most once per frameset.
+    struct alignment;
+    alignment& aligned_for(device* consumer, const rs2::frameset& frames, uint64_t frame);
+    void configure_aligner(alignment& a);
+    // Map the timestamp of the frame to the monotonic clock.
+    uint64_t frame_time(const rs2::frame& frame, uint64_t arrival_ns);
+
+    const camera_request req;
+
+    // Framesets delivered by the pipeline's callback.  This must be
+    // constructed before the pipeline is started.
+    triple_buffer<captured_frameset> captured;
+    // Set with the first frameset.
+    std::atomic<bool> running = false;
+    std::mutex runlock;
+    std::condition_variable runcond;
 
     // Create a pipeline to easily configure and start the camera
     std::unique_ptr<rs2::pipeline> pipe;
@@ -47,71 +151,436 @@ namespace realsense {
     rs2_stream align_to;
 
     rs2::align align;
+    struct alignment {
+      align_engine engine;
+      // Only used by the lookup table.
+      float distance;
+      // Used instead of align for the other engines.
+      depth_aligner aligner;
+      frame_vector<uint16_t> depth;
+      // For align_engine::librealsense the result of align.
+      rs2::frameset processed;
+      const uint16_t* result = nullptr;
+      // Number of the frameset the result belongs to.
+      uint64_t frame = 0;
+      uint64_t align_ns = 0;
+    };
+    // The alignments the consumers used for the last frameset.  The list
+    // is small, there are as many as different settings.
+    std::vector<std::unique_ptr<alignment>> alignments;
+    // Number of the current frameset, starting at one.
+    uint64_t nframes = 0;
 
     float depth_scale;
 
+    // Frame interval of the stream the depth frames are aligned to.
+    uint64_t period_ns;
+
+    // Difference between the monotonic clock and the camera's clock.  If
+    // a mapped timestamp is further than max_clock_skew in the past the
+    // clocks are synchronized again.
+    int64_t clock_offset = 0;
+    static constexpr int64_t max_clock_skew = 1'000'000'000;
+
     // Serial number of currently used device.
     std::string name;
     std::string serial;
 
+    // Size of the stream the depth frames are aligned to.
+    size_t width;
+    size_t height;
+
+    // Protects the consumers and the alignment.  Held while a frameset is
+    // processed, before the mask lock of a device.
+    std::mutex lock;
+    std::vector<device*> consumers;
+
+    std::thread processing;
+  };
+
+
+  // Frameset after the alignment, as handed to each consumer.
+  struct aligned_frameset {
+    rs2::video_frame other_frame;
+    const uint16_t* depth;
+    uint64_t timestamp_ns;
+    uint64_t arrival_ns;
+    uint64_t sensor_ns;
+    uint64_t wait_ns;
+    uint64_t align_ns;
+  };
+
+
+  // One source's use of a camera: the masking and its settings.  The
+  // camera's frames are only masked after attach().
+  struct device
+  {
+    device(std::shared_ptr<camera> cam_, video_format format_, float max_distance, size_t ndepth_history, align_engine engine, unsigned char* color, triple_buffer<output_frame>& output_, worker_pool* pool_, frame_stats& timing_);
+    ~device();
+
+    void attach() { cam->add(this); }
+    // Afterwards the camera's processing thread no longer uses the device.
+    void detach() { cam->remove(this); }
+
+    // With EXCLUSIVE set no other device uses the camera's frames.
+    bool get_frame(output_frame& dest, const aligned_frameset& frame, bool exclusive);
+
+    auto get_width() const { return mask.get_width(); }
+    auto get_height() const { return mask.get_height(); }
+    auto get_bpp() const { return mask.get_bpp(); }
+    auto get_framesize() const { return mask.get_framesize(); }
+
+    // These are applied by the processing thread before the next frame.
+    // They neither wait for the frame in progress nor change the mask
+    // while it is used.
+    void set_color(uint32_t newcol);
+    void set_transparency(unsigned char newa);
+    void set_max_distance(float newmax);
+    void set_ndepth_history(size_t newsize);
+    // Called by the processing thread with the mask lock held.
+    void apply_changes();
+
+    void set_depth_scale(float newscale);
+    void set_depth_filter(depth_filter newfilter);
+    void set_background(bool newuse, float newmargin);
+    void capture_background(float seconds);
+    void set_background_dir(const std::string& newdir);
+    // File of the learned background in the directory.
+    std::string background_file() const;
+    // Called with the lock held when a capture completes.
+    void save_background();
+    void set_pool(worker_pool* newpool);
+    // The camera aligns the depth frame for the next frameset with the
+    // engine and, for the lookup table, at the cutoff distance of this
+    // device.
+    void set_align_engine(align_engine newengine) { align_with.store(newengine, std::memory_order_relaxed); }
+    void set_in_place(bool newval) { in_place.store(newval, std::memory_order_relaxed); }
+    void set_alpha_matte(bool newval);
+    void set_feather(float newfeather);
+    void set_cleanup(cleanup_op newop, size_t newradius);
+    void set_hole_fill(hole_fill newmode, size_t newradius);
+    void set_backdrop(backdrop_mode newmode, size_t newradius);
+    void set_backdrop_image(const std::vector<uint8_t>& pixels, size_t width, size_t height);
+    void set_roi(bool newval);
+
+    void remove_background(uint8_t* dest, size_t framesize, rs2::video_frame& other_frame, const uint16_t* depth);
+
+    const std::shared_ptr<camera> cam;
+
+    const video_format format;
+
+    float depth_scale;
+
     // Define a variable for controlling the distance to clip
     float depth_clipping_max_distance;
+    // Alignment this device asks the camera for, read by the camera's
+    // processing thread.
+    std::atomic<align_engine> align_with;
+    std::atomic<float> align_distance;
+    // Width of the band beyond it in which the alpha matte fades out.
+    float feather_distance = 0.0f;
+    // Learned background, in meters.
+    bool use_background = false;
+    float background_margin = 0.0f;
+    // Directory the learned background is stored in, empty if it is not
+    // stored.
+    std::string background_dir;
+    // Writing a copy of the learned background.  This happens in a thread
+    // of its own, the processing thread, shared with the other consumers of
+    // the camera, is not delayed.
+    std::future<bool> saving;
+
+    // Masking state.
+    depth_mask mask;
+    std::mutex masklock;
+
+    // Values for apply_changes and which of them are new.
+    static constexpr unsigned new_color = 1;
+    static constexpr unsigned new_transparency = 2;
+    static constexpr unsigned new_max_distance = 4;
+    static constexpr unsigned new_ndepth_history = 8;
+    std::atomic<unsigned> changes = 0;
+    std::atomic<uint32_t> next_color = 0;
+    std::atomic<unsigned char> next_transparency = 0;
+    std::atomic<float> next_max_distance = 0.0f;
+    std::atomic<size_t> next_ndepth_history = 0;
+
+    // Threads to process the frame in parallel.  The pool of the first
+    // consumer is also used for the alignment.
+    worker_pool* pool;
+
+    // Processed frames.
+    triple_buffer<output_frame>& output;
+
+    // Mask the camera's frames in place instead of copying them.  Only
+    // possible if nothing else reads the frames, e.g., a recorder or
+    // another device.
+    std::atomic<bool> in_place = false;
+
+    frame_stats& timing;
+  };
 
-    // Computed limit for foreground;
-    size_t upper_limit;
 
-    size_t width;
-    size_t height;
-    size_t bpp;
+  // Stream profiles of the connected cameras.  The cameras are enumerated
+  // in a background thread, again whenever one is connected or
+  // disconnected.  Until the first enumeration is done a list cached from a
+  // previous run can be used.
+  struct device_catalog {
+    // Name, width, height, label, serial number, and frame rates of the
+    // color stream.
+    using available_type = std::tuple<std::string,size_t,size_t,std::string,std::string,std::vector<int>>;
+    // Serial number, width, height, and label of the depth stream.
+    using available_depth_type = std::tuple<std::string,size_t,size_t,std::string>;
+
+    static device_catalog& get();
 
-    std::vector<std::vector<uint16_t>> depth_history;
-    size_t last_depth_frame = 0;
+    std::vector<available_type> get_available();
+    std::vector<available_depth_type> get_available_depth();
 
-    // device color.
-    unsigned char green_bytes[4];
+    // Enumerate the cameras again.
+    void refresh();
+    // Whether a list is known, from the cache or the enumeration.
+    bool ready();
+    // Block until a list is known.
+    void wait_ready();
+
+    // The lists in text form, one profile per line.  A cached list is only
+    // used before the first enumeration is done.
+    std::string save();
+    void load(const std::string& text);
+
+  private:
+    device_catalog();
+    ~device_catalog();
+
+    void run();
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool pending = true;
+    bool enumerated = false;
+    bool done = false;
+
+    std::vector<available_type> available;
+    std::vector<available_depth_type> available_depth;
+
+    std::thread thread;
   };
 
 
   struct greenscreen {
-    greenscreen(video_format format_ = video_format::rgb);
-
-    bool new_config(const std::string& serial, const std::string& resolution);
+    // With a file name the recording is played back instead of using a camera.
+    // Nothing is started before open() is called.
+    greenscreen(video_format format_ = video_format::rgb, const std::string& replay_file_ = "", bool replay_realtime_ = true);
+    ~greenscreen();
+
+    // Start the selected camera, or the recording, in the background.  Until
+    // the first frame is processed the output is a frame in the background
+    // color if the resolution is known.
+    void open();
+    // Block until the camera is started.  Returns false if that failed.
+    bool wait_started();
+    // Error of the last start of the camera, empty if it succeeded.
+    std::string get_error();
+
+    // A frame rate of zero and an empty depth resolution select the
+    // camera's default.  So do values the camera does not support.  This
+    // does not wait for the enumeration of the cameras: before it is done
+    // the profile is checked when the camera is started, a profile which
+    // does not exist is reported by get_error.
+    bool new_config(const std::string& serial, const std::string& resolution, int fps = 0, const std::string& depth_resolution = "");
+
+    // Set the recording which is available as a device with the serial
+    // number replay_serial.  Without real-time pacing the recording is
+    // played back as fast as possible.
+    void set_replay(const std::string& filename, bool realtime);
+    // Record the data of the camera in the given file.  An empty file name
+    // stops recording.
+    void set_record(const std::string& filename);
 
     video_format get_format() const { return format; }
-
+    // Restarts the camera.  Frames already processed keep their format.
+    void set_format(video_format newformat);
+
+    // Most recent processed frame.  It stays valid until the next call.
+    const output_frame* latest_frame();
+    // Block until a new frame is processed.  Frames with timestamps older
+    // than the previous frame's are skipped.  The frame stays valid until
+    // the next call.  Returns nullptr after close_output() is called.
+    const output_frame* next_frame();
+    void close_output();
     bool get_frame(uint8_t* dest, size_t framesize);
 
-    size_t get_width() const;
-    size_t get_height() const;
-    size_t get_bpp() const;
-    size_t get_framesize() const;
+    pipeline_stats get_stats();
+    // Record the output of FRAME which started at START_NS and ended at
+    // END_NS, both monotonic times.
+    void record_output(const output_frame& frame, uint64_t start_ns, uint64_t end_ns);
+    // Counters and latencies of all stages, one line per stage.
+    std::string stats_summary();
+
+    // Before the camera is started the requested resolution and zero for
+    // the others.
+    size_t get_width();
+    size_t get_height();
+    size_t get_bpp();
+    size_t get_framesize();
+
+    // The cameras of the catalog and the recording.
+    using available_type = device_catalog::available_type;
+    using available_depth_type = device_catalog::available_depth_type;
+    std::vector<available_type> get_available();
+    std::vector<available_depth_type> get_available_depth();
+    // The selected camera.  Without selection the one which is started.
+    std::string current_serial();
 
     uint32_t get_color() const { return (uint32_t(green_bytes[0]) << 16) | (uint32_t(green_bytes[1]) << 8) | uint32_t(green_bytes[2]);  }
     float get_max_distance() const { return depth_clipping_max_distance; }
     size_t get_ndepth_history() const { return ndepth_history; }
+    depth_filter get_depth_filter() const { return filter; }
+    size_t get_nworkers() const { return pool->size(); }
 
     void set_color(uint32_t newcol);
     void set_transparency(unsigned char newa);
     void set_max_distance(float newmax);
     void set_ndepth_history(size_t newsize);
-
-    const video_format format;
+    void set_depth_filter(depth_filter newfilter);
+    bool get_use_background() const { return use_background; }
+    float get_background_margin() const { return background_margin; }
+    void set_background(bool newuse, float newmargin);
+    // Learn the background from the frames of the next SECONDS seconds.
+    void capture_background(float seconds);
+    // With a directory the learned background is stored there, separately
+    // for each camera, and loaded when the camera is started.
+    void set_background_dir(const std::string& newdir);
+    void set_nworkers(size_t newsize);
+    align_engine get_align_engine() const { return engine; }
+    void set_align_engine(align_engine newengine);
+    bool get_in_place() const { return in_place; }
+    void set_in_place(bool newval);
+    bool get_alpha_matte() const { return alpha_matte; }
+    void set_alpha_matte(bool newval);
+    float get_feather() const { return feather_distance; }
+    void set_feather(float newfeather);
+    cleanup_op get_cleanup_op() const { return cleanup; }
+    size_t get_cleanup_radius() const { return cleanup_radius; }
+    void set_cleanup(cleanup_op newop, size_t newradius);
+    hole_fill get_hole_fill() const { return holes; }
+    size_t get_hole_fill_radius() const { return holes_radius; }
+    void set_hole_fill(hole_fill newmode, size_t newradius);
+    backdrop_mode get_backdrop() const { return backdrop; }
+    size_t get_blur_radius() const { return blur_radius; }
+    void set_backdrop(backdrop_mode newmode, size_t newradius);
+    // PIXELS has three bytes (RGB) per pixel.  An empty image composites
+    // over the background color instead.
+    void set_backdrop_image(std::vector<uint8_t> pixels, size_t image_width, size_t image_height);
+    bool get_roi() const { return roi; }
+    void set_roi(bool newval);
+
+    video_format format;
 
     // Define a variable for controlling the distance to clip
     float depth_clipping_max_distance = 1.00f;
 
     size_t ndepth_history = 4;
+    depth_filter filter = depth_filter::average;
+
+    align_engine engine = align_engine::librealsense;
+
+    // Mask the camera's frame buffers in place and hand them to the output
+    // without a copy.  Not used while recording.  For RGBA output the
+    // camera is asked for RGBA frames.
+    bool in_place = false;
+
+    // For RGBA output write an alpha matte instead of the background color.
+    // The alpha values fall from opaque at the cutoff distance to transparent
+    // at the cutoff distance plus the feather distance, in meters.
+    bool alpha_matte = false;
+    float feather_distance = 0.0f;
+
+    // Morphological cleanup of the mask with a window of 2 × radius + 1
+    // pixels.
+    cleanup_op cleanup = cleanup_op::none;
+    size_t cleanup_radius = 1;
+
+    // Filling of invalid depth values.
+    hole_fill holes = hole_fill::none;
+    size_t holes_radius = 1;
+
+    // What the foreground is composited over instead of the background
+    // color: an image, scaled to the resolution, or the camera frame
+    // blurred with a radius in pixels.  The output is then opaque.
+    backdrop_mode backdrop = backdrop_mode::color;
+    size_t blur_radius = 16;
+    std::vector<uint8_t> backdrop_image;
+    size_t backdrop_width = 0;
+    size_t backdrop_height = 0;
+
+    // With the learned background only pixels closer than the background
+    // minus the margin, in meters, are foreground.
+    bool use_background = false;
+    float background_margin = 0.05f;
+    std::string background_dir;
+
+    // Evaluate the depth values only around the foreground of the previous
+    // frame, with periodic evaluations of the whole frame.
+    bool roi = false;
 
     unsigned char green_bytes[4] = { 0xdd, 0x44, 0xff, 0x00 };
 
-    size_t max_width;
-    size_t max_height;
-
-    using available_type = std::tuple<std::string,size_t,size_t,std::string,std::string>;
-    std::vector<available_type> available;
-
+    // Selected camera and resolution, empty and zero for the default.
+    std::string serial;
+    size_t width = 0;
+    size_t height = 0;
+
+    // Requested frame rate and depth resolution, zero for the default.
+    int fps = 0;
+    size_t depth_width = 0;
+    size_t depth_height = 0;
+
+    // Recording and playback of .bag files.
+    static constexpr char replay_serial[] = "replay";
+    static constexpr char replay_resolution[] = "recorded";
+    std::string replay_file;
+    bool replay_realtime;
+    std::string record_file;
+
+    // Queue the start of the camera with the current settings.
+    void start(const std::string& newserial, size_t newwidth, size_t newheight);
+    // Loop of the thread which starts the cameras.
+    void start_devices();
+    // Output a frame in the background color of the given size.
+    void publish_placeholder(size_t placeholder_width, size_t placeholder_height);
+    // Settings which are not passed to the constructor of the device.
+    void configure_device(device& newdev);
+
+    triple_buffer<output_frame> output;
+
+    // Kept across device changes.
+    frame_stats timing;
+    // Timestamp of the last frame returned by next_frame.
+    uint64_t last_timestamp_ns = 0;
+
+    // Used by the processing thread of the device.  One worker means all
+    // the work happens in the processing thread itself.
+    std::unique_ptr<worker_pool> pool;
+
+    // Protects the device and the start requests.
     std::mutex devlock;
     std::unique_ptr<device> dev;
+
+    // The camera is started in a separate thread, the most recent request
+    // wins.  The previous device keeps producing frames until the new one
+    // delivers frames, unless both use the same camera with different
+    // profiles.  Then the previous one has to be stopped first.
+    static constexpr uint64_t warmup_timeout_ns = 5'000'000'000;
+    std::condition_variable startcond;
+    bool opened = false;
+    bool closing = false;
+    bool starting = false;
+    bool placeholder_done = false;
+    std::unique_ptr<camera_request> pending;
+    std::string start_error;
+    std::thread starter;
   };
 
 } // namespace realsense
@@ -0,0 +1,53 @@
+#include <algorithm>
+
+#include "realsense-holefill.hh"
+#include "realsense-mask.hh"
+#include "worker-pool.hh"
+
+
+namespace realsense {
+
+  void hole_filler::configure(hole_fill mode_, size_t radius_)
+  {
+    mode = mode_;
+    radius = std::min(radius_, max_radius);
+  }
+
+
+  const uint16_t* hole_filler::apply(const uint16_t* depth, size_t width, size_t height, const kernels& kern, worker_pool* pool)
+  {
+    if (! active())
+      return depth;
+
+    if (filled.size() < width * height)
+      filled.resize(width * height);
+    if (border.size() < width)
+      border.resize(width);
+
+    // The median always uses the 3×3 window.
+    const size_t r = mode == hole_fill::median ? 1 : radius;
+    auto fill = mode == hole_fill::nearest ? kern.fill_nearest : mode == hole_fill::min ? kern.fill_min : kern.fill_median;
+
+    auto do_rows = [&](size_t from, size_t to) {
+      const uint16_t* rows[2 * max_radius + 1];
+      for (size_t y = from; y < to; ++y) {
+        for (size_t i = 0; i <= 2 * r; ++i)
+          rows[i] = y + i < r || y + i >= height + r ? border.data() : depth + (y + i - r) * width;
+        fill(&filled[y * width], rows, r, width);
+      }
+    };
+
+    if (pool == nullptr || pool->size() == 1)
+      do_rows(0, height);
+    else {
+      auto band_height = std::max(height / (4 * pool->size()), 1zu);
+      auto nbands = (height + band_height - 1) / band_height;
+      pool->run(nbands, [&](size_t band, size_t) {
+        do_rows(band * band_height, std::min((band + 1) * band_height, height));
+      });
+    }
+
+    return filled.data();
+  }
+
+} // namespace realsense
@@ -0,0 +1,62 @@
+#ifndef _REALSENSE_HOLEFILL_HH
+#define _REALSENSE_HOLEFILL_HH 1
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "frame-allocator.hh"
+
+struct worker_pool;
+
+
+namespace realsense {
+
+  struct kernels;
+
+
+  // Ways to replace invalid (zero) depth values before they enter the
+  // history.  Without filling they count as far away, a pixel which is
+  // invalid only once in the history then becomes background.
+  enum struct hole_fill {
+    none,
+    // The first valid value at distance 1, 2, … up to the radius, left,
+    // right, above, and below in this order.
+    nearest,
+    // The smallest valid value in the window, the closest object wins.
+    min,
+    // The lower median of the valid values among the eight neighbours.
+    // The radius is not used.
+    median,
+  };
+
+
+  // Filling of the holes in a depth frame.  Valid values are not changed.
+  // Each output row depends only on the input rows within the radius, the
+  // rows are processed in parallel.
+  struct hole_filler
+  {
+    void configure(hole_fill mode_, size_t radius_);
+    bool active() const { return mode != hole_fill::none && radius > 0; }
+
+    // Returns the filled copy of DEPTH which is valid until the next call.
+    const uint16_t* apply(const uint16_t* depth, size_t width, size_t height, const kernels& kern, worker_pool* pool = nullptr);
+
+    auto get_mode() const { return mode; }
+    auto get_radius() const { return radius; }
+
+    // The largest supported radius.
+    static constexpr size_t max_radius = 4;
+
+  private:
+    hole_fill mode = hole_fill::none;
+    size_t radius = 0;
+
+    frame_vector<uint16_t> filled;
+    // Invalid values for the rows beyond the border.
+    std::vector<uint16_t> border;
+  };
+
+} // namespace realsense
+
+#endif // realsense-holefill.hh
@@ -0,0 +1,2445 @@
+#include <algorithm>
+#include <cassert>
+#include <climits>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <numeric>
+
+#if defined __x86_64__ || defined __i386__
+# include <immintrin.h>
+#endif
+
+#include "realsense-mask.hh"
+#include "worker-pool.hh"
+
+
+namespace realsense {
+
+  namespace {
+
+    // Instead of computing the rounded average of the history values and
+    // comparing it with the limit compare the sum with a scaled limit:
+    //
+    //   (sum + N/2) / N <= limit   <=>   sum < (limit + 1) * N - N/2
+    //
+    // The average can never exceed the maximum 16-bit value and therefore
+    // clamping the limit keeps the result in the range of 32-bit integers.
+    uint32_t scaled_limit(size_t nhistory, size_t upper_limit)
+    {
+      auto limit = std::min(upper_limit, size_t(std::numeric_limits<uint16_t>::max()));
+      return uint32_t(std::min((limit + 1) * nhistory - nhistory / 2, size_t(INT32_MAX)));
+    }
+
+
+    // Weight of the new value for the moving average in units of 1/256,
+    // 2 / (N + 1) rounded.
+    uint32_t ema_weight_for(size_t nhistory)
+    {
+      return uint32_t((512 + (nhistory + 1) / 2) / (nhistory + 1));
+    }
+
+
+    inline bool valid_distance(uint32_t pixels_distance_sum, uint32_t sum_limit)
+    {
+      return pixels_distance_sum < sum_limit;
+    }
+
+
+    // The reference implementations.  Every other version must produce
+    // exactly the same output.
+    void threshold_generic(uint8_t* mask, uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n, uint32_t sum_limit)
+    {
+      for (size_t x = 0; x < n; ++x) {
+        // Zero means no valid value, treat it as far away.
+        uint16_t d = depth[x] ?: std::numeric_limits<uint16_t>::max();
+        sum[x] = sum[x] + d - oldest[x];
+        oldest[x] = d;
+        mask[x] = valid_distance(sum[x], sum_limit) ? 0xff : 0x00;
+      }
+    }
+
+
+    void blend_rgb_generic(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      for (size_t x = 0; x < n; ++x, dest += 3, src += 3)
+        std::memmove(dest, mask[x] ? src : color, 3);
+    }
+
+
+    void blend_rgba_generic(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      for (size_t x = 0; x < n; ++x, dest += 4, src += 3)
+        if (mask[x]) {
+          std::memcpy(dest, src, 3);
+          dest[3] = 0xff;
+        } else
+          std::memcpy(dest, color, 4);
+    }
+
+
+    void blend_rgba4_generic(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      for (size_t x = 0; x < n; ++x, dest += 4, src += 4)
+        if (mask[x]) {
+          std::memmove(dest, src, 3);
+          dest[3] = 0xff;
+        } else
+          std::memcpy(dest, color, 4);
+    }
+
+
+    // BT.709 with limited range in 8-bit fixed point.  The chroma values
+    // are computed from the sums of the four pixels which share them.
+    inline uint8_t luma(unsigned r, unsigned g, unsigned b)
+    {
+      return uint8_t(((47 * r + 157 * g + 16 * b + 128) >> 8) + 16);
+    }
+
+    inline uint8_t chroma_u(int r4, int g4, int b4)
+    {
+      return uint8_t(((-26 * r4 - 86 * g4 + 112 * b4 + 512) >> 10) + 128);
+    }
+
+    inline uint8_t chroma_v(int r4, int g4, int b4)
+    {
+      return uint8_t(((112 * r4 - 102 * g4 - 10 * b4 + 512) >> 10) + 128);
+    }
+
+
+    void blend_yuv_generic(uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, bool interleaved, const uint8_t* src0, const uint8_t* src1, const uint8_t* mask0, const uint8_t* mask1, size_t n, const unsigned char* color)
+    {
+      const size_t step = interleaved ? 2 : 1;
+      for (size_t x = 0; x < n; x += 2, u += step, v += step) {
+        // An odd last column is used twice.
+        auto x1 = std::min(x + 1, n - 1);
+        const uint8_t* p[4] = {
+          mask0[x] ? &src0[3 * x] : color, mask0[x1] ? &src0[3 * x1] : color,
+          mask1[x] ? &src1[3 * x] : color, mask1[x1] ? &src1[3 * x1] : color
+        };
+        y0[x] = luma(p[0][0], p[0][1], p[0][2]);
+        y0[x1] = luma(p[1][0], p[1][1], p[1][2]);
+        y1[x] = luma(p[2][0], p[2][1], p[2][2]);
+        y1[x1] = luma(p[3][0], p[3][1], p[3][2]);
+        int r4 = p[0][0] + p[1][0] + p[2][0] + p[3][0];
+        int g4 = p[0][1] + p[1][1] + p[2][1] + p[3][1];
+        int b4 = p[0][2] + p[1][2] + p[2][2] + p[3][2];
+        *u = chroma_u(r4, g4, b4);
+        *v = chroma_v(r4, g4, b4);
+      }
+    }
+
+
+    inline uint8_t matte_alpha(uint32_t sum, const matte_params& params)
+    {
+      auto t = std::clamp(int64_t(params.far) - int64_t(sum), int64_t(0), int64_t(params.range));
+      return uint8_t(std::min((t * params.scale) >> 16, int64_t(255)));
+    }
+
+
+    void matte_generic(uint8_t* alpha, uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n, const matte_params& params)
+    {
+      for (size_t x = 0; x < n; ++x) {
+        uint16_t d = depth[x] ?: std::numeric_limits<uint16_t>::max();
+        sum[x] = sum[x] + d - oldest[x];
+        oldest[x] = d;
+        alpha[x] = matte_alpha(sum[x], params);
+      }
+    }
+
+
+    void blend_alpha_generic(uint8_t* dest, const uint8_t* src, const uint8_t* alpha, size_t n, const unsigned char*)
+    {
+      for (size_t x = 0; x < n; ++x, dest += 4, src += 3) {
+        std::memcpy(dest, src, 3);
+        dest[3] = alpha[x];
+      }
+    }
+
+
+    void blend_alpha4_generic(uint8_t* dest, const uint8_t* src, const uint8_t* alpha, size_t n, const unsigned char*)
+    {
+      for (size_t x = 0; x < n; ++x, dest += 4, src += 4) {
+        std::memmove(dest, src, 3);
+        dest[3] = alpha[x];
+      }
+    }
+
+
+    void min_u8_generic(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t n)
+    {
+      for (size_t x = 0; x < n; ++x)
+        dest[x] = std::min(a[x], b[x]);
+    }
+
+
+    void max_u8_generic(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t n)
+    {
+      for (size_t x = 0; x < n; ++x)
+        dest[x] = std::max(a[x], b[x]);
+    }
+
+
+    void transpose_generic(uint8_t* dest, size_t dest_stride, const uint8_t* src, size_t src_stride, size_t nrows, size_t ncols)
+    {
+      for (size_t r = 0; r < nrows; ++r)
+        for (size_t c = 0; c < ncols; ++c)
+          dest[c * dest_stride + r] = src[r * src_stride + c];
+    }
+
+
+    // The hole filling functions process the columns [FROM, TO) of the row.
+    // Outside the frame all values are invalid.
+    void fill_nearest_range(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n, size_t from, size_t to)
+    {
+      auto c = rows[radius];
+      for (size_t x = from; x < to; ++x) {
+        auto v = c[x];
+        for (size_t d = 1; v == 0 && d <= radius; ++d)
+          v = (x >= d ? c[x - d] : 0) ?: (x + d < n ? c[x + d] : 0) ?: rows[radius - d][x] ?: rows[radius + d][x];
+        dest[x] = v;
+      }
+    }
+
+
+    // Subtracting one makes invalid values the largest, adding one to the
+    // minimum restores the value or zero if no value is valid.
+    void fill_min_range(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n, size_t from, size_t to)
+    {
+      auto c = rows[radius];
+      for (size_t x = from; x < to; ++x) {
+        if (c[x] != 0) {
+          dest[x] = c[x];
+          continue;
+        }
+        uint16_t m = 0xffff;
+        for (size_t i = 0; i <= 2 * radius; ++i)
+          for (size_t xx = x - std::min(x, radius); xx <= std::min(x + radius, n - 1); ++xx)
+            m = std::min(m, uint16_t(rows[i][xx] - 1));
+        dest[x] = uint16_t(m + 1);
+      }
+    }
+
+
+    void fill_median_range(uint16_t* dest, const uint16_t* const* rows, size_t n, size_t from, size_t to)
+    {
+      auto c = rows[1];
+      for (size_t x = from; x < to; ++x) {
+        if (c[x] != 0) {
+          dest[x] = c[x];
+          continue;
+        }
+        // The center is invalid, at most eight values are sorted in.
+        uint16_t v[9];
+        size_t k = 0;
+        for (size_t i = 0; i < 3; ++i)
+          for (size_t xx = x - std::min(x, 1zu); xx <= std::min(x + 1, n - 1); ++xx)
+            if (auto val = rows[i][xx]; val != 0) {
+              auto j = k++;
+              for (; j > 0 && v[j - 1] > val; --j)
+                v[j] = v[j - 1];
+              v[j] = val;
+            }
+        dest[x] = k == 0 ? 0 : v[(k - 1) / 2];
+      }
+    }
+
+
+    void fill_nearest_generic(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n)
+    {
+      fill_nearest_range(dest, rows, radius, n, 0, n);
+    }
+
+
+    void fill_min_generic(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n)
+    {
+      fill_min_range(dest, rows, radius, n, 0, n);
+    }
+
+
+    void fill_median_generic(uint16_t* dest, const uint16_t* const* rows, size_t, size_t n)
+    {
+      fill_median_range(dest, rows, n, 0, n);
+    }
+
+
+    // The exponential moving average keeps the depth values with four
+    // fractional bits.  WEIGHT is the weight of the new value in units of
+    // 1/256.  The products fit into 32 bits.
+    void ema_generic(uint32_t* acc, const uint16_t* depth, size_t n, uint32_t weight)
+    {
+      for (size_t x = 0; x < n; ++x) {
+        uint16_t d = depth[x] ?: std::numeric_limits<uint16_t>::max();
+        auto diff = int32_t(uint32_t(d) << 4) - int32_t(acc[x]);
+        acc[x] = uint32_t(int32_t(acc[x]) + ((diff * int32_t(weight) + 128) >> 8));
+      }
+    }
+
+
+    // FRAMES[0] is the oldest frame of the history, it is replaced by DEPTH.
+    // At most five frames.
+    void median_generic(uint32_t* value, uint16_t* const* frames, size_t nframes, const uint16_t* depth, size_t n)
+    {
+      for (size_t x = 0; x < n; ++x) {
+        frames[0][x] = depth[x] ?: std::numeric_limits<uint16_t>::max();
+        uint16_t v[5];
+        for (size_t i = 0; i < nframes; ++i) {
+          auto j = i;
+          for (; j > 0 && v[j - 1] > frames[i][x]; --j)
+            v[j] = v[j - 1];
+          v[j] = frames[i][x];
+        }
+        value[x] = v[nframes / 2];
+      }
+    }
+
+
+    // Mask and alpha matte for filtered values which are scaled like the
+    // sums of the history.
+    void classify_generic(uint8_t* mask, const uint32_t* value, size_t n, uint32_t limit)
+    {
+      for (size_t x = 0; x < n; ++x)
+        mask[x] = valid_distance(value[x], limit) ? 0xff : 0x00;
+    }
+
+
+    void matte_value_generic(uint8_t* alpha, const uint32_t* value, size_t n, const matte_params& params)
+    {
+      for (size_t x = 0; x < n; ++x)
+        alpha[x] = matte_alpha(value[x], params);
+    }
+
+
+    // The running sums of the average without the comparison, the learned
+    // background model compares them.
+    void accumulate_generic(uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n)
+    {
+      for (size_t x = 0; x < n; ++x) {
+        uint16_t d = depth[x] ?: std::numeric_limits<uint16_t>::max();
+        sum[x] = sum[x] + d - oldest[x];
+        oldest[x] = d;
+      }
+    }
+
+
+    inline uint32_t model_limit(uint16_t reference, const model_params& params)
+    {
+      uint16_t r = reference ?: std::numeric_limits<uint16_t>::max();
+      auto l = std::min(r > params.margin ? uint32_t(r - params.margin) : 0u, uint32_t(params.limit));
+      return l * params.scale + params.bias;
+    }
+
+
+    void classify_model_generic(uint8_t* mask, const uint32_t* value, const uint16_t* reference, size_t n, const model_params& params)
+    {
+      for (size_t x = 0; x < n; ++x)
+        mask[x] = valid_distance(value[x], model_limit(reference[x], params)) ? 0xff : 0x00;
+    }
+
+
+    void matte_model_generic(uint8_t* alpha, const uint32_t* value, const uint16_t* reference, size_t n, const model_params& params)
+    {
+      for (size_t x = 0; x < n; ++x) {
+        matte_params m = { int32_t(model_limit(reference[x], params)) - 1 + params.range, params.range, params.matte_scale };
+        alpha[x] = matte_alpha(value[x], m);
+      }
+    }
+
+
+    // S × A / 255 + B × (255 - A) / 255 rounded, exact for all values.
+    inline uint8_t mix(unsigned s, unsigned b, unsigned a)
+    {
+      unsigned t = s * a + b * (255 - a) + 128;
+      return uint8_t((t + (t >> 8)) >> 8);
+    }
+
+
+    void composite_generic(uint8_t* dest, const uint8_t* src, const uint8_t* backdrop, const uint8_t* alpha, size_t n)
+    {
+      for (size_t x = 0; x < n; ++x, dest += 3, src += 3, backdrop += 3)
+        for (size_t c = 0; c < 3; ++c)
+          dest[c] = mix(src[c], backdrop[c], alpha[x]);
+    }
+
+
+    void box_columns_generic(uint8_t* dest, uint16_t* sums, const uint8_t* add, const uint8_t* sub, size_t n, float inverse)
+    {
+      for (size_t x = 0; x < n; ++x) {
+        dest[x] = uint8_t(float(sums[x]) * inverse + 0.5f);
+        sums[x] = uint16_t(sums[x] + add[x] - sub[x]);
+      }
+    }
+
+
+    const kernels generic_kernels = {
+      "generic",
+      threshold_generic,
+      blend_rgb_generic,
+      blend_rgba_generic,
+      blend_rgba4_generic,
+      blend_yuv_generic,
+      matte_generic,
+      blend_alpha_generic,
+      blend_alpha4_generic,
+      min_u8_generic,
+      max_u8_generic,
+      transpose_generic,
+      fill_nearest_generic,
+      fill_min_generic,
+      fill_median_generic,
+      ema_generic,
+      median_generic,
+      classify_generic,
+      matte_value_generic,
+      accumulate_generic,
+      classify_model_generic,
+      matte_model_generic,
+      composite_generic,
+      box_columns_generic,
+    };
+
+
+#if defined __x86_64__ || defined __i386__
+    // Masks to distribute the per-pixel mask bytes to three-byte pixels.
+    alignas(16) const uint8_t expand3[3][16] = {
+      { 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 },
+      { 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 },
+      { 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 },
+    };
+    // Spread four three-byte pixels to four-byte pixels.
+    alignas(16) const uint8_t spread3to4[16] = {
+      0, 1, 2, 0x80, 3, 4, 5, 0x80, 6, 7, 8, 0x80, 9, 10, 11, 0x80
+    };
+    // Gather one channel of 16 three-byte pixels from each of the three
+    // 16-byte parts they occupy.
+    alignas(16) const uint8_t deinterleave3[3][3][16] = {
+      {
+        { 0, 3, 6, 9, 12, 15, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80 },
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13 },
+      }, {
+        { 1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15, 0x80, 0x80, 0x80, 0x80, 0x80 },
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 2, 5, 8, 11, 14 },
+      }, {
+        { 2, 5, 8, 11, 14, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 1, 4, 7, 10, 13, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80 },
+        { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0, 3, 6, 9, 12, 15 },
+      }
+    };
+
+
+    __attribute__((target("sse4.1")))
+    void threshold_sse41(uint8_t* mask, uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n, uint32_t sum_limit)
+    {
+      // The sums and the limit fit into signed 32-bit integers.
+      const auto limit = _mm_set1_epi32(int(sum_limit));
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        __m128i m[2];
+        for (size_t h = 0; h < 2; ++h) {
+          auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&depth[x + 8 * h]));
+          auto o = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&oldest[x + 8 * h]));
+          // Zero means no valid value, treat it as far away.
+          d = _mm_or_si128(d, _mm_cmpeq_epi16(d, zero));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&oldest[x + 8 * h]), d);
+          auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sum[x + 8 * h]));
+          auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sum[x + 8 * h + 4]));
+          s0 = _mm_sub_epi32(_mm_add_epi32(s0, _mm_unpacklo_epi16(d, zero)), _mm_unpacklo_epi16(o, zero));
+          s1 = _mm_sub_epi32(_mm_add_epi32(s1, _mm_unpackhi_epi16(d, zero)), _mm_unpackhi_epi16(o, zero));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&sum[x + 8 * h]), s0);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&sum[x + 8 * h + 4]), s1);
+          m[h] = _mm_packs_epi32(_mm_cmpgt_epi32(limit, s0), _mm_cmpgt_epi32(limit, s1));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&mask[x]), _mm_packs_epi16(m[0], m[1]));
+      }
+
+      threshold_generic(mask + x, sum + x, oldest + x, depth + x, n - x, sum_limit);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void blend_rgb_sse41(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      alignas(16) uint8_t pattern[48];
+      for (size_t i = 0; i < sizeof(pattern); i += 3)
+        std::memcpy(&pattern[i], color, 3);
+      const auto c0 = _mm_load_si128(reinterpret_cast<const __m128i*>(&pattern[0]));
+      const auto c1 = _mm_load_si128(reinterpret_cast<const __m128i*>(&pattern[16]));
+      const auto c2 = _mm_load_si128(reinterpret_cast<const __m128i*>(&pattern[32]));
+      const auto e0 = _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[0]));
+      const auto e1 = _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[1]));
+      const auto e2 = _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[2]));
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 48, dest += 48) {
+        auto m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask[x]));
+        auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        auto s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest), _mm_blendv_epi8(c0, s0, _mm_shuffle_epi8(m, e0)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16), _mm_blendv_epi8(c1, s1, _mm_shuffle_epi8(m, e1)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 32), _mm_blendv_epi8(c2, s2, _mm_shuffle_epi8(m, e2)));
+      }
+
+      blend_rgb_generic(dest, src, mask + x, n - x, color);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void blend_rgba_sse41(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      uint32_t color32;
+      std::memcpy(&color32, color, sizeof(color32));
+      const auto c = _mm_set1_epi32(int(color32));
+      const auto alpha = _mm_set1_epi32(int(0xff000000));
+      const auto spread = _mm_load_si128(reinterpret_cast<const __m128i*>(spread3to4));
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 48, dest += 64) {
+        auto m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask[x]));
+        auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        auto s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        // Each register gets the twelve bytes of four pixels at the beginning.
+        __m128i px[4] = { s0, _mm_alignr_epi8(s1, s0, 12), _mm_alignr_epi8(s2, s1, 8), _mm_srli_si128(s2, 4) };
+        for (int k = 0; k < 4; ++k) {
+          auto v = _mm_or_si128(_mm_shuffle_epi8(px[k], spread), alpha);
+          auto mk = _mm_cvtepi8_epi32(m);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16 * k), _mm_blendv_epi8(c, v, mk));
+          m = _mm_srli_si128(m, 4);
+        }
+      }
+
+      blend_rgba_generic(dest, src, mask + x, n - x, color);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void blend_rgba4_sse41(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      uint32_t color32;
+      std::memcpy(&color32, color, sizeof(color32));
+      const auto c = _mm_set1_epi32(int(color32));
+      const auto alpha = _mm_set1_epi32(int(0xff000000));
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 64, dest += 64) {
+        auto m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask[x]));
+        for (int k = 0; k < 4; ++k) {
+          auto v = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * k)), alpha);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16 * k), _mm_blendv_epi8(c, v, _mm_cvtepi8_epi32(m)));
+          m = _mm_srli_si128(m, 4);
+        }
+      }
+
+      blend_rgba4_generic(dest, src, mask + x, n - x, color);
+    }
+
+
+    // Load 16 three-byte pixels, select the color where the mask is not
+    // set, and split them into the channels.
+    __attribute__((target("sse4.1")))
+    inline void load_rgb_sse41(__m128i rgb[3], const uint8_t* src, __m128i m, const unsigned char* color)
+    {
+      __m128i s[3];
+      for (int p = 0; p < 3; ++p)
+        s[p] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * p));
+      for (int c = 0; c < 3; ++c) {
+        auto v = _mm_shuffle_epi8(s[0], _mm_load_si128(reinterpret_cast<const __m128i*>(deinterleave3[c][0])));
+        v = _mm_or_si128(v, _mm_shuffle_epi8(s[1], _mm_load_si128(reinterpret_cast<const __m128i*>(deinterleave3[c][1]))));
+        v = _mm_or_si128(v, _mm_shuffle_epi8(s[2], _mm_load_si128(reinterpret_cast<const __m128i*>(deinterleave3[c][2]))));
+        rgb[c] = _mm_blendv_epi8(_mm_set1_epi8(char(color[c])), v, m);
+      }
+    }
+
+
+    // The 16-bit products cannot overflow: 220 × 255 + 128 < 65536.
+    __attribute__((target("sse4.1")))
+    inline __m128i luma_sse41(const __m128i rgb[3])
+    {
+      const auto zero = _mm_setzero_si128();
+      const auto coef_r = _mm_set1_epi16(47);
+      const auto coef_g = _mm_set1_epi16(157);
+      const auto coef_b = _mm_set1_epi16(16);
+      const auto round = _mm_set1_epi16(128);
+      const auto offset = _mm_set1_epi16(16);
+
+      __m128i y[2];
+      for (int h = 0; h < 2; ++h) {
+        auto r = h == 0 ? _mm_cvtepu8_epi16(rgb[0]) : _mm_unpackhi_epi8(rgb[0], zero);
+        auto g = h == 0 ? _mm_cvtepu8_epi16(rgb[1]) : _mm_unpackhi_epi8(rgb[1], zero);
+        auto b = h == 0 ? _mm_cvtepu8_epi16(rgb[2]) : _mm_unpackhi_epi8(rgb[2], zero);
+        auto sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, coef_r), _mm_mullo_epi16(g, coef_g)), _mm_add_epi16(_mm_mullo_epi16(b, coef_b), round));
+        y[h] = _mm_add_epi16(_mm_srli_epi16(sum, 8), offset);
+      }
+      return _mm_packus_epi16(y[0], y[1]);
+    }
+
+
+    // R4, G4, B4 are the sums of four pixels, COEF_RG holds the coefficients
+    // for red and green alternately, COEF_B those for blue and one.  The
+    // result is in the lower eight bytes.
+    __attribute__((target("sse4.1")))
+    inline __m128i chroma_sse41(__m128i r4, __m128i g4, __m128i b4, __m128i coef_rg, __m128i coef_b)
+    {
+      const auto round = _mm_set1_epi16(512);
+      auto lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r4, g4), coef_rg), _mm_madd_epi16(_mm_unpacklo_epi16(b4, round), coef_b));
+      auto hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r4, g4), coef_rg), _mm_madd_epi16(_mm_unpackhi_epi16(b4, round), coef_b));
+      auto c = _mm_add_epi16(_mm_packs_epi32(_mm_srai_epi32(lo, 10), _mm_srai_epi32(hi, 10)), _mm_set1_epi16(128));
+      return _mm_packus_epi16(c, c);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void blend_yuv_sse41(uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, bool interleaved, const uint8_t* src0, const uint8_t* src1, const uint8_t* mask0, const uint8_t* mask1, size_t n, const unsigned char* color)
+    {
+      const auto ones = _mm_set1_epi8(1);
+      const auto coef_u_rg = _mm_set1_epi32(int((uint32_t(uint16_t(-86)) << 16) | uint16_t(-26)));
+      const auto coef_u_b = _mm_set1_epi32((1 << 16) | 112);
+      const auto coef_v_rg = _mm_set1_epi32(int((uint32_t(uint16_t(-102)) << 16) | 112));
+      const auto coef_v_b = _mm_set1_epi32(int((1u << 16) | uint16_t(-10)));
+      const size_t step = interleaved ? 16 : 8;
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src0 += 48, src1 += 48, u += step, v += step) {
+        __m128i rgb0[3];
+        __m128i rgb1[3];
+        load_rgb_sse41(rgb0, src0, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask0[x])), color);
+        load_rgb_sse41(rgb1, src1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask1[x])), color);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&y0[x]), luma_sse41(rgb0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&y1[x]), luma_sse41(rgb1));
+
+        // Sums of horizontally adjacent pixels of both rows.
+        __m128i sum4[3];
+        for (int c = 0; c < 3; ++c)
+          sum4[c] = _mm_add_epi16(_mm_maddubs_epi16(rgb0[c], ones), _mm_maddubs_epi16(rgb1[c], ones));
+        auto cu = chroma_sse41(sum4[0], sum4[1], sum4[2], coef_u_rg, coef_u_b);
+        auto cv = chroma_sse41(sum4[0], sum4[1], sum4[2], coef_v_rg, coef_v_b);
+        if (interleaved)
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(u), _mm_unpacklo_epi8(cu, cv));
+        else {
+          _mm_storel_epi64(reinterpret_cast<__m128i*>(u), cu);
+          _mm_storel_epi64(reinterpret_cast<__m128i*>(v), cv);
+        }
+      }
+
+      blend_yuv_generic(y0 + x, y1 + x, u, v, interleaved, src0, src1, mask0 + x, mask1 + x, n - x, color);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void matte_sse41(uint8_t* alpha, uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n, const matte_params& params)
+    {
+      const auto far = _mm_set1_epi32(params.far);
+      const auto range = _mm_set1_epi32(params.range);
+      const auto scale = _mm_set1_epi32(params.scale);
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        __m128i a[2];
+        for (size_t h = 0; h < 2; ++h) {
+          auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&depth[x + 8 * h]));
+          auto o = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&oldest[x + 8 * h]));
+          d = _mm_or_si128(d, _mm_cmpeq_epi16(d, zero));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&oldest[x + 8 * h]), d);
+          auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sum[x + 8 * h]));
+          auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sum[x + 8 * h + 4]));
+          s0 = _mm_sub_epi32(_mm_add_epi32(s0, _mm_unpacklo_epi16(d, zero)), _mm_unpacklo_epi16(o, zero));
+          s1 = _mm_sub_epi32(_mm_add_epi32(s1, _mm_unpackhi_epi16(d, zero)), _mm_unpackhi_epi16(o, zero));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&sum[x + 8 * h]), s0);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&sum[x + 8 * h + 4]), s1);
+          // The products fit into 32 bits, the packing saturates to 255.
+          auto t0 = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(far, s0), zero), range);
+          auto t1 = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(far, s1), zero), range);
+          a[h] = _mm_packus_epi32(_mm_srli_epi32(_mm_mullo_epi32(t0, scale), 16), _mm_srli_epi32(_mm_mullo_epi32(t1, scale), 16));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&alpha[x]), _mm_packus_epi16(a[0], a[1]));
+      }
+
+      matte_generic(alpha + x, sum + x, oldest + x, depth + x, n - x, params);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void blend_alpha_sse41(uint8_t* dest, const uint8_t* src, const uint8_t* alpha, size_t n, const unsigned char* color)
+    {
+      const auto spread = _mm_load_si128(reinterpret_cast<const __m128i*>(spread3to4));
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 48, dest += 64) {
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&alpha[x]));
+        auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        auto s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        __m128i px[4] = { s0, _mm_alignr_epi8(s1, s0, 12), _mm_alignr_epi8(s2, s1, 8), _mm_srli_si128(s2, 4) };
+        for (int k = 0; k < 4; ++k) {
+          auto v = _mm_or_si128(_mm_shuffle_epi8(px[k], spread), _mm_slli_epi32(_mm_cvtepu8_epi32(a), 24));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16 * k), v);
+          a = _mm_srli_si128(a, 4);
+        }
+      }
+
+      blend_alpha_generic(dest, src, alpha + x, n - x, color);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void blend_alpha4_sse41(uint8_t* dest, const uint8_t* src, const uint8_t* alpha, size_t n, const unsigned char* color)
+    {
+      const auto rgb = _mm_set1_epi32(0x00ffffff);
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 64, dest += 64) {
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&alpha[x]));
+        for (int k = 0; k < 4; ++k) {
+          auto v = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * k)), rgb);
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16 * k), _mm_or_si128(v, _mm_slli_epi32(_mm_cvtepu8_epi32(a), 24)));
+          a = _mm_srli_si128(a, 4);
+        }
+      }
+
+      blend_alpha4_generic(dest, src, alpha + x, n - x, color);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void min_u8_sse41(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t n)
+    {
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        auto va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&a[x]));
+        auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&b[x]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[x]), _mm_min_epu8(va, vb));
+      }
+
+      min_u8_generic(dest + x, a + x, b + x, n - x);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void max_u8_sse41(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t n)
+    {
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        auto va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&a[x]));
+        auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&b[x]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[x]), _mm_max_epu8(va, vb));
+      }
+
+      max_u8_generic(dest + x, a + x, b + x, n - x);
+    }
+
+
+    // After the four rounds of interleaving register M holds the column
+    // with the bits of M reversed.
+    const uint8_t transpose_order[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+
+
+    __attribute__((target("sse4.1")))
+    void transpose16_sse41(uint8_t* dest, size_t dest_stride, const uint8_t* src, size_t src_stride)
+    {
+      __m128i a[16];
+      __m128i b[16];
+      for (size_t i = 0; i < 16; ++i)
+        a[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * src_stride));
+      for (size_t i = 0; i < 8; ++i) {
+        b[i] = _mm_unpacklo_epi8(a[2 * i], a[2 * i + 1]);
+        b[i + 8] = _mm_unpackhi_epi8(a[2 * i], a[2 * i + 1]);
+      }
+      for (size_t i = 0; i < 8; ++i) {
+        a[i] = _mm_unpacklo_epi16(b[2 * i], b[2 * i + 1]);
+        a[i + 8] = _mm_unpackhi_epi16(b[2 * i], b[2 * i + 1]);
+      }
+      for (size_t i = 0; i < 8; ++i) {
+        b[i] = _mm_unpacklo_epi32(a[2 * i], a[2 * i + 1]);
+        b[i + 8] = _mm_unpackhi_epi32(a[2 * i], a[2 * i + 1]);
+      }
+      for (size_t i = 0; i < 8; ++i) {
+        a[i] = _mm_unpacklo_epi64(b[2 * i], b[2 * i + 1]);
+        a[i + 8] = _mm_unpackhi_epi64(b[2 * i], b[2 * i + 1]);
+      }
+      for (size_t i = 0; i < 16; ++i)
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + transpose_order[i] * dest_stride), a[i]);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void transpose_sse41(uint8_t* dest, size_t dest_stride, const uint8_t* src, size_t src_stride, size_t nrows, size_t ncols)
+    {
+      size_t r = 0;
+      for (; r + 16 <= nrows; r += 16) {
+        size_t c = 0;
+        for (; c + 16 <= ncols; c += 16)
+          transpose16_sse41(dest + c * dest_stride + r, dest_stride, src + r * src_stride + c, src_stride);
+        transpose_generic(dest + c * dest_stride + r, dest_stride, src + r * src_stride + c, src_stride, 16, ncols - c);
+      }
+
+      transpose_generic(dest + r, dest_stride, src + r * src_stride, src_stride, nrows - r, ncols);
+    }
+
+
+    // Sorting network for eight values, used for the median of the
+    // neighbours.
+    const uint8_t sort8_network[19][2] = {
+      { 0, 1 }, { 2, 3 }, { 4, 5 }, { 6, 7 }, { 0, 2 }, { 1, 3 }, { 4, 6 }, { 5, 7 }, { 1, 2 }, { 5, 6 },
+      { 0, 4 }, { 3, 7 }, { 1, 5 }, { 2, 6 }, { 1, 4 }, { 3, 6 }, { 2, 4 }, { 3, 5 }, { 3, 4 }
+    };
+
+
+    __attribute__((target("sse4.1")))
+    void fill_nearest_sse41(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n)
+    {
+      const auto zero = _mm_setzero_si128();
+      auto c = rows[radius];
+
+      size_t x = std::min(radius, n);
+      fill_nearest_range(dest, rows, radius, n, 0, x);
+      for (; x + 8 + radius <= n; x += 8) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c + x));
+        for (size_t d = 1; d <= radius; ++d)
+          for (auto p : { c + x - d, c + x + d, rows[radius - d] + x, rows[radius + d] + x })
+            v = _mm_blendv_epi8(v, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), _mm_cmpeq_epi16(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), v);
+      }
+
+      fill_nearest_range(dest, rows, radius, n, x, n);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void fill_min_sse41(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n)
+    {
+      const auto zero = _mm_setzero_si128();
+      const auto one = _mm_set1_epi16(1);
+      auto c = rows[radius];
+
+      size_t x = std::min(radius, n);
+      fill_min_range(dest, rows, radius, n, 0, x);
+      for (; x + 8 + radius <= n; x += 8) {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c + x));
+        auto invalid = _mm_cmpeq_epi16(v, zero);
+        if (_mm_testz_si128(invalid, invalid)) {
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), v);
+          continue;
+        }
+        auto m = _mm_set1_epi16(-1);
+        for (size_t i = 0; i <= 2 * radius; ++i)
+          for (size_t j = 0; j <= 2 * radius; ++j)
+            m = _mm_min_epu16(m, _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[i] + x + j - radius)), one));
+        v = _mm_blendv_epi8(v, _mm_add_epi16(m, one), invalid);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), v);
+      }
+
+      fill_min_range(dest, rows, radius, n, x, n);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void fill_median_sse41(uint16_t* dest, const uint16_t* const* rows, size_t, size_t n)
+    {
+      const auto zero = _mm_setzero_si128();
+      const auto one = _mm_set1_epi16(1);
+      const auto seven = _mm_set1_epi16(7);
+
+      size_t x = std::min(1zu, n);
+      fill_median_range(dest, rows, n, 0, x);
+      for (; x + 9 <= n; x += 8) {
+        // Most values are valid.
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[1] + x));
+        auto invalid = _mm_cmpeq_epi16(v, zero);
+        if (_mm_testz_si128(invalid, invalid)) {
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), v);
+          continue;
+        }
+        const uint16_t* p[8] = { rows[0] + x - 1, rows[0] + x, rows[0] + x + 1, rows[1] + x - 1, rows[1] + x + 1, rows[2] + x - 1, rows[2] + x, rows[2] + x + 1 };
+        __m128i s[8];
+        auto ninvalid = zero;
+        for (size_t k = 0; k < 8; ++k) {
+          auto nv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p[k]));
+          ninvalid = _mm_sub_epi16(ninvalid, _mm_cmpeq_epi16(nv, zero));
+          s[k] = _mm_sub_epi16(nv, one);
+        }
+        for (const auto& cmp : sort8_network) {
+          auto lo = _mm_min_epu16(s[cmp[0]], s[cmp[1]]);
+          s[cmp[1]] = _mm_max_epu16(s[cmp[0]], s[cmp[1]]);
+          s[cmp[0]] = lo;
+        }
+        // With K valid values the lower median is at (K - 1) / 2.  Without
+        // valid values s[0] is the invalid value.
+        auto idx = _mm_srli_epi16(_mm_max_epi16(_mm_sub_epi16(seven, ninvalid), zero), 1);
+        auto m = s[0];
+        for (int i = 1; i < 4; ++i)
+          m = _mm_blendv_epi8(m, s[i], _mm_cmpeq_epi16(idx, _mm_set1_epi16(int16_t(i))));
+        v = _mm_blendv_epi8(v, _mm_add_epi16(m, one), invalid);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), v);
+      }
+
+      fill_median_range(dest, rows, n, x, n);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void ema_sse41(uint32_t* acc, const uint16_t* depth, size_t n, uint32_t weight)
+    {
+      const auto w = _mm_set1_epi32(int(weight));
+      const auto round = _mm_set1_epi32(128);
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 8 <= n; x += 8) {
+        auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&depth[x]));
+        d = _mm_or_si128(d, _mm_cmpeq_epi16(d, zero));
+        __m128i t[2] = { _mm_slli_epi32(_mm_unpacklo_epi16(d, zero), 4), _mm_slli_epi32(_mm_unpackhi_epi16(d, zero), 4) };
+        for (size_t h = 0; h < 2; ++h) {
+          auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&acc[x + 4 * h]));
+          a = _mm_add_epi32(a, _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(t[h], a), w), round), 8));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&acc[x + 4 * h]), a);
+        }
+      }
+
+      ema_generic(acc + x, depth + x, n - x, weight);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    inline __m128i median3_sse41(__m128i a, __m128i b, __m128i c)
+    {
+      return _mm_max_epu16(_mm_min_epu16(a, b), _mm_min_epu16(_mm_max_epu16(a, b), c));
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void median_sse41(uint32_t* value, uint16_t* const* frames, size_t nframes, const uint16_t* depth, size_t n)
+    {
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      if (nframes == 1 || nframes == 3 || nframes == 5)
+        for (; x + 8 <= n; x += 8) {
+          auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&depth[x]));
+          d = _mm_or_si128(d, _mm_cmpeq_epi16(d, zero));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&frames[0][x]), d);
+          auto m = d;
+          if (nframes > 1) {
+            auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&frames[1][x]));
+            auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&frames[2][x]));
+            if (nframes == 3)
+              m = median3_sse41(d, a, b);
+            else {
+              // The median of five is the median of the fifth value and the
+              // two middle values of the other four.
+              auto c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&frames[3][x]));
+              auto e = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&frames[4][x]));
+              auto lo = _mm_max_epu16(_mm_min_epu16(d, a), _mm_min_epu16(b, c));
+              auto hi = _mm_min_epu16(_mm_max_epu16(d, a), _mm_max_epu16(b, c));
+              m = median3_sse41(lo, hi, e);
+            }
+          }
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&value[x]), _mm_unpacklo_epi16(m, zero));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(&value[x + 4]), _mm_unpackhi_epi16(m, zero));
+        }
+
+      uint16_t* rest[5];
+      for (size_t i = 0; i < nframes; ++i)
+        rest[i] = frames[i] + x;
+      median_generic(value + x, rest, nframes, depth + x, n - x);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void classify_sse41(uint8_t* mask, const uint32_t* value, size_t n, uint32_t limit)
+    {
+      // The values fit into signed 32-bit integers.
+      const auto l = _mm_set1_epi32(int(limit));
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        __m128i c[4];
+        for (size_t q = 0; q < 4; ++q)
+          c[q] = _mm_cmpgt_epi32(l, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&value[x + 4 * q])));
+        auto m = _mm_packs_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], c[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&mask[x]), m);
+      }
+
+      classify_generic(mask + x, value + x, n - x, limit);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void matte_value_sse41(uint8_t* alpha, const uint32_t* value, size_t n, const matte_params& params)
+    {
+      const auto far = _mm_set1_epi32(params.far);
+      const auto range = _mm_set1_epi32(params.range);
+      const auto scale = _mm_set1_epi32(params.scale);
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        __m128i a[4];
+        for (size_t q = 0; q < 4; ++q) {
+          auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&value[x + 4 * q]));
+          auto t = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(far, v), zero), range);
+          a[q] = _mm_srli_epi32(_mm_mullo_epi32(t, scale), 16);
+        }
+        auto m = _mm_packus_epi16(_mm_packus_epi32(a[0], a[1]), _mm_packus_epi32(a[2], a[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&alpha[x]), m);
+      }
+
+      matte_value_generic(alpha + x, value + x, n - x, params);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void accumulate_sse41(uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n)
+    {
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 8 <= n; x += 8) {
+        auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&depth[x]));
+        auto o = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&oldest[x]));
+        d = _mm_or_si128(d, _mm_cmpeq_epi16(d, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&oldest[x]), d);
+        auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sum[x]));
+        auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sum[x + 4]));
+        s0 = _mm_sub_epi32(_mm_add_epi32(s0, _mm_unpacklo_epi16(d, zero)), _mm_unpacklo_epi16(o, zero));
+        s1 = _mm_sub_epi32(_mm_add_epi32(s1, _mm_unpackhi_epi16(d, zero)), _mm_unpackhi_epi16(o, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&sum[x]), s0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&sum[x + 4]), s1);
+      }
+
+      accumulate_generic(sum + x, oldest + x, depth + x, n - x);
+    }
+
+
+    // The limits of eight pixels from their reference values, see model_params.
+    __attribute__((target("sse4.1")))
+    inline void model_limits_sse41(__m128i limits[2], const uint16_t* reference, const model_params& params)
+    {
+      const auto zero = _mm_setzero_si128();
+      auto r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(reference));
+      r = _mm_or_si128(r, _mm_cmpeq_epi16(r, zero));
+      r = _mm_min_epu16(_mm_subs_epu16(r, _mm_set1_epi16(int16_t(params.margin))), _mm_set1_epi16(int16_t(params.limit)));
+      const auto scale = _mm_set1_epi32(int(params.scale));
+      const auto bias = _mm_set1_epi32(int(params.bias));
+      limits[0] = _mm_add_epi32(_mm_mullo_epi32(_mm_unpacklo_epi16(r, zero), scale), bias);
+      limits[1] = _mm_add_epi32(_mm_mullo_epi32(_mm_unpackhi_epi16(r, zero), scale), bias);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void classify_model_sse41(uint8_t* mask, const uint32_t* value, const uint16_t* reference, size_t n, const model_params& params)
+    {
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        __m128i l[4];
+        model_limits_sse41(&l[0], &reference[x], params);
+        model_limits_sse41(&l[2], &reference[x + 8], params);
+        __m128i c[4];
+        for (size_t q = 0; q < 4; ++q)
+          c[q] = _mm_cmpgt_epi32(l[q], _mm_loadu_si128(reinterpret_cast<const __m128i*>(&value[x + 4 * q])));
+        auto m = _mm_packs_epi16(_mm_packs_epi32(c[0], c[1]), _mm_packs_epi32(c[2], c[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&mask[x]), m);
+      }
+
+      classify_model_generic(mask + x, value + x, reference + x, n - x, params);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void matte_model_sse41(uint8_t* alpha, const uint32_t* value, const uint16_t* reference, size_t n, const model_params& params)
+    {
+      const auto offset = _mm_set1_epi32(params.range - 1);
+      const auto range = _mm_set1_epi32(params.range);
+      const auto scale = _mm_set1_epi32(params.matte_scale);
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        __m128i l[4];
+        model_limits_sse41(&l[0], &reference[x], params);
+        model_limits_sse41(&l[2], &reference[x + 8], params);
+        __m128i a[4];
+        for (size_t q = 0; q < 4; ++q) {
+          auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&value[x + 4 * q]));
+          auto t = _mm_min_epi32(_mm_max_epi32(_mm_sub_epi32(_mm_add_epi32(l[q], offset), v), zero), range);
+          a[q] = _mm_srli_epi32(_mm_mullo_epi32(t, scale), 16);
+        }
+        auto m = _mm_packus_epi16(_mm_packus_epi32(a[0], a[1]), _mm_packus_epi32(a[2], a[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&alpha[x]), m);
+      }
+
+      matte_model_generic(alpha + x, value + x, reference + x, n - x, params);
+    }
+
+
+    // mix for eight values in 16-bit lanes.  All intermediate values fit.
+    __attribute__((target("sse4.1")))
+    inline __m128i mix_sse41(__m128i s, __m128i b, __m128i a)
+    {
+      auto t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(b, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+      t = _mm_add_epi16(t, _mm_set1_epi16(128));
+      return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+
+
+    __attribute__((target("sse4.1")))
+    void composite_sse41(uint8_t* dest, const uint8_t* src, const uint8_t* backdrop, const uint8_t* alpha, size_t n)
+    {
+      const __m128i e[3] = {
+        _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[0])),
+        _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[1])),
+        _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[2])),
+      };
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, dest += 48, src += 48, backdrop += 48) {
+        auto m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&alpha[x]));
+        for (size_t i = 0; i < 3; ++i) {
+          auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * i));
+          auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(backdrop + 16 * i));
+          auto a = _mm_shuffle_epi8(m, e[i]);
+          auto lo = mix_sse41(_mm_cvtepu8_epi16(s), _mm_cvtepu8_epi16(b), _mm_cvtepu8_epi16(a));
+          auto hi = mix_sse41(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(a, zero));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16 * i), _mm_packus_epi16(lo, hi));
+        }
+      }
+
+      composite_generic(dest, src, backdrop, alpha + x, n - x);
+    }
+
+
+    // The same operations as the scalar code, the results are identical.
+    __attribute__((target("sse4.1")))
+    void box_columns_sse41(uint8_t* dest, uint16_t* sums, const uint8_t* add, const uint8_t* sub, size_t n, float inverse)
+    {
+      const auto inv = _mm_set1_ps(inverse);
+      const auto half = _mm_set1_ps(0.5f);
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        __m128i s[2];
+        __m128i q[4];
+        for (size_t h = 0; h < 2; ++h) {
+          s[h] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sums[x + 8 * h]));
+          q[2 * h] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(s[h], zero)), inv), half));
+          q[2 * h + 1] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(s[h], zero)), inv), half));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[x]), _mm_packus_epi16(_mm_packus_epi32(q[0], q[1]), _mm_packus_epi32(q[2], q[3])));
+
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&add[x]));
+        auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&sub[x]));
+        s[0] = _mm_sub_epi16(_mm_add_epi16(s[0], _mm_cvtepu8_epi16(a)), _mm_cvtepu8_epi16(b));
+        s[1] = _mm_sub_epi16(_mm_add_epi16(s[1], _mm_unpackhi_epi8(a, zero)), _mm_unpackhi_epi8(b, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&sums[x]), s[0]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&sums[x + 8]), s[1]);
+      }
+
+      box_columns_generic(dest + x, sums + x, add + x, sub + x, n - x, inverse);
+    }
+
+
+    const kernels sse41_kernels = {
+      "sse4.1",
+      threshold_sse41,
+      blend_rgb_sse41,
+      blend_rgba_sse41,
+      blend_rgba4_sse41,
+      blend_yuv_sse41,
+      matte_sse41,
+      blend_alpha_sse41,
+      blend_alpha4_sse41,
+      min_u8_sse41,
+      max_u8_sse41,
+      transpose_sse41,
+      fill_nearest_sse41,
+      fill_min_sse41,
+      fill_median_sse41,
+      ema_sse41,
+      median_sse41,
+      classify_sse41,
+      matte_value_sse41,
+      accumulate_sse41,
+      classify_model_sse41,
+      matte_model_sse41,
+      composite_sse41,
+      box_columns_sse41,
+    };
+
+
+    __attribute__((target("avx2")))
+    void threshold_avx2(uint8_t* mask, uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n, uint32_t sum_limit)
+    {
+      const auto limit = _mm256_set1_epi32(int(sum_limit));
+      const auto zero = _mm256_setzero_si256();
+      // Undo the lane-wise operation of the pack instructions.
+      const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32) {
+        __m256i m[2];
+        for (size_t h = 0; h < 2; ++h) {
+          auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&depth[x + 16 * h]));
+          auto o = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&oldest[x + 16 * h]));
+          d = _mm256_or_si256(d, _mm256_cmpeq_epi16(d, zero));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&oldest[x + 16 * h]), d);
+          auto s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&sum[x + 16 * h]));
+          auto s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&sum[x + 16 * h + 8]));
+          s0 = _mm256_add_epi32(s0, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(d)));
+          s0 = _mm256_sub_epi32(s0, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(o)));
+          s1 = _mm256_add_epi32(s1, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(d, 1)));
+          s1 = _mm256_sub_epi32(s1, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(o, 1)));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&sum[x + 16 * h]), s0);
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&sum[x + 16 * h + 8]), s1);
+          m[h] = _mm256_packs_epi32(_mm256_cmpgt_epi32(limit, s0), _mm256_cmpgt_epi32(limit, s1));
+        }
+        auto mm = _mm256_permutevar8x32_epi32(_mm256_packs_epi16(m[0], m[1]), order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&mask[x]), mm);
+      }
+
+      threshold_sse41(mask + x, sum + x, oldest + x, depth + x, n - x, sum_limit);
+    }
+
+
+    __attribute__((target("avx2")))
+    void blend_rgb_avx2(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      alignas(32) uint8_t pattern[96];
+      for (size_t i = 0; i < sizeof(pattern); i += 3)
+        std::memcpy(&pattern[i], color, 3);
+      const auto c0 = _mm256_load_si256(reinterpret_cast<const __m256i*>(&pattern[0]));
+      const auto c1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(&pattern[32]));
+      const auto c2 = _mm256_load_si256(reinterpret_cast<const __m256i*>(&pattern[64]));
+      const auto e0 = _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[0]));
+      const auto e1 = _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[1]));
+      const auto e2 = _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[2]));
+      const auto e01 = _mm256_set_m128i(e1, e0);
+      const auto e20 = _mm256_set_m128i(e0, e2);
+      const auto e12 = _mm256_set_m128i(e2, e1);
+
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32, src += 96, dest += 96) {
+        auto mlo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask[x]));
+        auto mhi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask[x + 16]));
+        auto m0 = _mm256_shuffle_epi8(_mm256_set_m128i(mlo, mlo), e01);
+        auto m1 = _mm256_shuffle_epi8(_mm256_set_m128i(mhi, mlo), e20);
+        auto m2 = _mm256_shuffle_epi8(_mm256_set_m128i(mhi, mhi), e12);
+        auto s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        auto s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32));
+        auto s2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 64));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_blendv_epi8(c0, s0, m0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 32), _mm256_blendv_epi8(c1, s1, m1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 64), _mm256_blendv_epi8(c2, s2, m2));
+      }
+
+      blend_rgb_sse41(dest, src, mask + x, n - x, color);
+    }
+
+
+    __attribute__((target("avx2")))
+    void blend_rgba_avx2(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      uint32_t color32;
+      std::memcpy(&color32, color, sizeof(color32));
+      const auto c = _mm256_set1_epi32(int(color32));
+      const auto alpha = _mm256_set1_epi32(int(0xff000000));
+      const auto spread = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(spread3to4)));
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 48, dest += 64) {
+        auto m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask[x]));
+        auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        auto s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        auto v0 = _mm256_set_m128i(_mm_alignr_epi8(s1, s0, 12), s0);
+        auto v1 = _mm256_set_m128i(_mm_srli_si128(s2, 4), _mm_alignr_epi8(s2, s1, 8));
+        v0 = _mm256_or_si256(_mm256_shuffle_epi8(v0, spread), alpha);
+        v1 = _mm256_or_si256(_mm256_shuffle_epi8(v1, spread), alpha);
+        auto m0 = _mm256_cvtepi8_epi32(m);
+        auto m1 = _mm256_cvtepi8_epi32(_mm_srli_si128(m, 8));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_blendv_epi8(c, v0, m0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 32), _mm256_blendv_epi8(c, v1, m1));
+      }
+
+      blend_rgba_generic(dest, src, mask + x, n - x, color);
+    }
+
+
+    __attribute__((target("avx2")))
+    void blend_rgba4_avx2(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color)
+    {
+      uint32_t color32;
+      std::memcpy(&color32, color, sizeof(color32));
+      const auto c = _mm256_set1_epi32(int(color32));
+      const auto alpha = _mm256_set1_epi32(int(0xff000000));
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 64, dest += 64) {
+        auto m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&mask[x]));
+        auto v0 = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)), alpha);
+        auto v1 = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32)), alpha);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_blendv_epi8(c, v0, _mm256_cvtepi8_epi32(m)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 32), _mm256_blendv_epi8(c, v1, _mm256_cvtepi8_epi32(_mm_srli_si128(m, 8))));
+      }
+
+      blend_rgba4_generic(dest, src, mask + x, n - x, color);
+    }
+
+
+    __attribute__((target("avx2")))
+    void matte_avx2(uint8_t* alpha, uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n, const matte_params& params)
+    {
+      const auto far = _mm256_set1_epi32(params.far);
+      const auto range = _mm256_set1_epi32(params.range);
+      const auto scale = _mm256_set1_epi32(params.scale);
+      const auto zero = _mm256_setzero_si256();
+      // Undo the lane-wise operation of the pack instructions.
+      const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32) {
+        __m256i a[2];
+        for (size_t h = 0; h < 2; ++h) {
+          auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&depth[x + 16 * h]));
+          auto o = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&oldest[x + 16 * h]));
+          d = _mm256_or_si256(d, _mm256_cmpeq_epi16(d, zero));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&oldest[x + 16 * h]), d);
+          auto s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&sum[x + 16 * h]));
+          auto s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&sum[x + 16 * h + 8]));
+          s0 = _mm256_add_epi32(s0, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(d)));
+          s0 = _mm256_sub_epi32(s0, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(o)));
+          s1 = _mm256_add_epi32(s1, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(d, 1)));
+          s1 = _mm256_sub_epi32(s1, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(o, 1)));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&sum[x + 16 * h]), s0);
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&sum[x + 16 * h + 8]), s1);
+          auto t0 = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(far, s0), zero), range);
+          auto t1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(far, s1), zero), range);
+          a[h] = _mm256_packus_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(t0, scale), 16), _mm256_srli_epi32(_mm256_mullo_epi32(t1, scale), 16));
+        }
+        auto aa = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(a[0], a[1]), order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&alpha[x]), aa);
+      }
+
+      matte_sse41(alpha + x, sum + x, oldest + x, depth + x, n - x, params);
+    }
+
+
+    __attribute__((target("avx2")))
+    void blend_alpha_avx2(uint8_t* dest, const uint8_t* src, const uint8_t* alpha, size_t n, const unsigned char* color)
+    {
+      const auto spread = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(spread3to4)));
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 48, dest += 64) {
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&alpha[x]));
+        auto s0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        auto s1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+        auto s2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+        auto v0 = _mm256_shuffle_epi8(_mm256_set_m128i(_mm_alignr_epi8(s1, s0, 12), s0), spread);
+        auto v1 = _mm256_shuffle_epi8(_mm256_set_m128i(_mm_srli_si128(s2, 4), _mm_alignr_epi8(s2, s1, 8)), spread);
+        auto a0 = _mm256_slli_epi32(_mm256_cvtepu8_epi32(a), 24);
+        auto a1 = _mm256_slli_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(a, 8)), 24);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_or_si256(v0, a0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 32), _mm256_or_si256(v1, a1));
+      }
+
+      blend_alpha_generic(dest, src, alpha + x, n - x, color);
+    }
+
+
+    __attribute__((target("avx2")))
+    void blend_alpha4_avx2(uint8_t* dest, const uint8_t* src, const uint8_t* alpha, size_t n, const unsigned char* color)
+    {
+      const auto rgb = _mm256_set1_epi32(0x00ffffff);
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, src += 64, dest += 64) {
+        auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&alpha[x]));
+        auto v0 = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)), rgb);
+        auto v1 = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32)), rgb);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest), _mm256_or_si256(v0, _mm256_slli_epi32(_mm256_cvtepu8_epi32(a), 24)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + 32), _mm256_or_si256(v1, _mm256_slli_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(a, 8)), 24)));
+      }
+
+      blend_alpha4_generic(dest, src, alpha + x, n - x, color);
+    }
+
+
+    __attribute__((target("avx2")))
+    void min_u8_avx2(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t n)
+    {
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32) {
+        auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&a[x]));
+        auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&b[x]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dest[x]), _mm256_min_epu8(va, vb));
+      }
+
+      min_u8_generic(dest + x, a + x, b + x, n - x);
+    }
+
+
+    __attribute__((target("avx2")))
+    void max_u8_avx2(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t n)
+    {
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32) {
+        auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&a[x]));
+        auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&b[x]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&dest[x]), _mm256_max_epu8(va, vb));
+      }
+
+      max_u8_generic(dest + x, a + x, b + x, n - x);
+    }
+
+
+    __attribute__((target("avx2")))
+    void fill_nearest_avx2(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n)
+    {
+      const auto zero = _mm256_setzero_si256();
+      auto c = rows[radius];
+
+      size_t x = std::min(radius, n);
+      fill_nearest_range(dest, rows, radius, n, 0, x);
+      for (; x + 16 + radius <= n; x += 16) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c + x));
+        for (size_t d = 1; d <= radius; ++d)
+          for (auto p : { c + x - d, c + x + d, rows[radius - d] + x, rows[radius + d] + x })
+            v = _mm256_blendv_epi8(v, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)), _mm256_cmpeq_epi16(v, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), v);
+      }
+
+      fill_nearest_range(dest, rows, radius, n, x, n);
+    }
+
+
+    __attribute__((target("avx2")))
+    void fill_min_avx2(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n)
+    {
+      const auto zero = _mm256_setzero_si256();
+      const auto one = _mm256_set1_epi16(1);
+      auto c = rows[radius];
+
+      size_t x = std::min(radius, n);
+      fill_min_range(dest, rows, radius, n, 0, x);
+      for (; x + 16 + radius <= n; x += 16) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(c + x));
+        auto invalid = _mm256_cmpeq_epi16(v, zero);
+        if (_mm256_testz_si256(invalid, invalid)) {
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), v);
+          continue;
+        }
+        auto m = _mm256_set1_epi16(-1);
+        for (size_t i = 0; i <= 2 * radius; ++i)
+          for (size_t j = 0; j <= 2 * radius; ++j)
+            m = _mm256_min_epu16(m, _mm256_sub_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[i] + x + j - radius)), one));
+        v = _mm256_blendv_epi8(v, _mm256_add_epi16(m, one), invalid);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), v);
+      }
+
+      fill_min_range(dest, rows, radius, n, x, n);
+    }
+
+
+    __attribute__((target("avx2")))
+    void fill_median_avx2(uint16_t* dest, const uint16_t* const* rows, size_t, size_t n)
+    {
+      const auto zero = _mm256_setzero_si256();
+      const auto one = _mm256_set1_epi16(1);
+      const auto seven = _mm256_set1_epi16(7);
+
+      size_t x = std::min(1zu, n);
+      fill_median_range(dest, rows, n, 0, x);
+      for (; x + 17 <= n; x += 16) {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[1] + x));
+        auto invalid = _mm256_cmpeq_epi16(v, zero);
+        if (_mm256_testz_si256(invalid, invalid)) {
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), v);
+          continue;
+        }
+        const uint16_t* p[8] = { rows[0] + x - 1, rows[0] + x, rows[0] + x + 1, rows[1] + x - 1, rows[1] + x + 1, rows[2] + x - 1, rows[2] + x, rows[2] + x + 1 };
+        __m256i s[8];
+        auto ninvalid = zero;
+        for (size_t k = 0; k < 8; ++k) {
+          auto nv = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p[k]));
+          ninvalid = _mm256_sub_epi16(ninvalid, _mm256_cmpeq_epi16(nv, zero));
+          s[k] = _mm256_sub_epi16(nv, one);
+        }
+        for (const auto& cmp : sort8_network) {
+          auto lo = _mm256_min_epu16(s[cmp[0]], s[cmp[1]]);
+          s[cmp[1]] = _mm256_max_epu16(s[cmp[0]], s[cmp[1]]);
+          s[cmp[0]] = lo;
+        }
+        auto idx = _mm256_srli_epi16(_mm256_max_epi16(_mm256_sub_epi16(seven, ninvalid), zero), 1);
+        auto m = s[0];
+        for (int i = 1; i < 4; ++i)
+          m = _mm256_blendv_epi8(m, s[i], _mm256_cmpeq_epi16(idx, _mm256_set1_epi16(int16_t(i))));
+        v = _mm256_blendv_epi8(v, _mm256_add_epi16(m, one), invalid);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), v);
+      }
+
+      fill_median_range(dest, rows, n, x, n);
+    }
+
+
+    __attribute__((target("avx2")))
+    void ema_avx2(uint32_t* acc, const uint16_t* depth, size_t n, uint32_t weight)
+    {
+      const auto w = _mm256_set1_epi32(int(weight));
+      const auto round = _mm256_set1_epi32(128);
+      const auto zero = _mm_setzero_si128();
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16)
+        for (size_t h = 0; h < 2; ++h) {
+          auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&depth[x + 8 * h]));
+          d = _mm_or_si128(d, _mm_cmpeq_epi16(d, zero));
+          auto t = _mm256_slli_epi32(_mm256_cvtepu16_epi32(d), 4);
+          auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&acc[x + 8 * h]));
+          a = _mm256_add_epi32(a, _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(t, a), w), round), 8));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&acc[x + 8 * h]), a);
+        }
+
+      ema_sse41(acc + x, depth + x, n - x, weight);
+    }
+
+
+    __attribute__((target("avx2")))
+    inline __m256i median3_avx2(__m256i a, __m256i b, __m256i c)
+    {
+      return _mm256_max_epu16(_mm256_min_epu16(a, b), _mm256_min_epu16(_mm256_max_epu16(a, b), c));
+    }
+
+
+    __attribute__((target("avx2")))
+    void median_avx2(uint32_t* value, uint16_t* const* frames, size_t nframes, const uint16_t* depth, size_t n)
+    {
+      const auto zero = _mm256_setzero_si256();
+
+      size_t x = 0;
+      if (nframes == 1 || nframes == 3 || nframes == 5)
+        for (; x + 16 <= n; x += 16) {
+          auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&depth[x]));
+          d = _mm256_or_si256(d, _mm256_cmpeq_epi16(d, zero));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&frames[0][x]), d);
+          auto m = d;
+          if (nframes > 1) {
+            auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&frames[1][x]));
+            auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&frames[2][x]));
+            if (nframes == 3)
+              m = median3_avx2(d, a, b);
+            else {
+              auto c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&frames[3][x]));
+              auto e = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&frames[4][x]));
+              auto lo = _mm256_max_epu16(_mm256_min_epu16(d, a), _mm256_min_epu16(b, c));
+              auto hi = _mm256_min_epu16(_mm256_max_epu16(d, a), _mm256_max_epu16(b, c));
+              m = median3_avx2(lo, hi, e);
+            }
+          }
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&value[x]), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(m)));
+          _mm256_storeu_si256(reinterpret_cast<__m256i*>(&value[x + 8]), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(m, 1)));
+        }
+
+      uint16_t* rest[5];
+      for (size_t i = 0; i < nframes; ++i)
+        rest[i] = frames[i] + x;
+      median_sse41(value + x, rest, nframes, depth + x, n - x);
+    }
+
+
+    __attribute__((target("avx2")))
+    void classify_avx2(uint8_t* mask, const uint32_t* value, size_t n, uint32_t limit)
+    {
+      const auto l = _mm256_set1_epi32(int(limit));
+      const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32) {
+        __m256i c[4];
+        for (size_t q = 0; q < 4; ++q)
+          c[q] = _mm256_cmpgt_epi32(l, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&value[x + 8 * q])));
+        auto m = _mm256_packs_epi16(_mm256_packs_epi32(c[0], c[1]), _mm256_packs_epi32(c[2], c[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&mask[x]), _mm256_permutevar8x32_epi32(m, order));
+      }
+
+      classify_sse41(mask + x, value + x, n - x, limit);
+    }
+
+
+    __attribute__((target("avx2")))
+    void matte_value_avx2(uint8_t* alpha, const uint32_t* value, size_t n, const matte_params& params)
+    {
+      const auto far = _mm256_set1_epi32(params.far);
+      const auto range = _mm256_set1_epi32(params.range);
+      const auto scale = _mm256_set1_epi32(params.scale);
+      const auto zero = _mm256_setzero_si256();
+      const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32) {
+        __m256i a[4];
+        for (size_t q = 0; q < 4; ++q) {
+          auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&value[x + 8 * q]));
+          auto t = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(far, v), zero), range);
+          a[q] = _mm256_srli_epi32(_mm256_mullo_epi32(t, scale), 16);
+        }
+        auto m = _mm256_packus_epi16(_mm256_packus_epi32(a[0], a[1]), _mm256_packus_epi32(a[2], a[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&alpha[x]), _mm256_permutevar8x32_epi32(m, order));
+      }
+
+      matte_value_sse41(alpha + x, value + x, n - x, params);
+    }
+
+
+    __attribute__((target("avx2")))
+    void accumulate_avx2(uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n)
+    {
+      const auto zero = _mm256_setzero_si256();
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        auto d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&depth[x]));
+        auto o = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&oldest[x]));
+        d = _mm256_or_si256(d, _mm256_cmpeq_epi16(d, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&oldest[x]), d);
+        auto s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&sum[x]));
+        auto s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&sum[x + 8]));
+        s0 = _mm256_add_epi32(s0, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(d)));
+        s0 = _mm256_sub_epi32(s0, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(o)));
+        s1 = _mm256_add_epi32(s1, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(d, 1)));
+        s1 = _mm256_sub_epi32(s1, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(o, 1)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&sum[x]), s0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&sum[x + 8]), s1);
+      }
+
+      accumulate_sse41(sum + x, oldest + x, depth + x, n - x);
+    }
+
+
+    // The limits of sixteen pixels from their reference values.
+    __attribute__((target("avx2")))
+    inline void model_limits_avx2(__m256i limits[2], const uint16_t* reference, const model_params& params)
+    {
+      const auto zero = _mm256_setzero_si256();
+      auto r = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(reference));
+      r = _mm256_or_si256(r, _mm256_cmpeq_epi16(r, zero));
+      r = _mm256_min_epu16(_mm256_subs_epu16(r, _mm256_set1_epi16(int16_t(params.margin))), _mm256_set1_epi16(int16_t(params.limit)));
+      const auto scale = _mm256_set1_epi32(int(params.scale));
+      const auto bias = _mm256_set1_epi32(int(params.bias));
+      limits[0] = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(r)), scale), bias);
+      limits[1] = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(r, 1)), scale), bias);
+    }
+
+
+    __attribute__((target("avx2")))
+    void classify_model_avx2(uint8_t* mask, const uint32_t* value, const uint16_t* reference, size_t n, const model_params& params)
+    {
+      const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32) {
+        __m256i l[4];
+        model_limits_avx2(&l[0], &reference[x], params);
+        model_limits_avx2(&l[2], &reference[x + 16], params);
+        __m256i c[4];
+        for (size_t q = 0; q < 4; ++q)
+          c[q] = _mm256_cmpgt_epi32(l[q], _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&value[x + 8 * q])));
+        auto m = _mm256_packs_epi16(_mm256_packs_epi32(c[0], c[1]), _mm256_packs_epi32(c[2], c[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&mask[x]), _mm256_permutevar8x32_epi32(m, order));
+      }
+
+      classify_model_sse41(mask + x, value + x, reference + x, n - x, params);
+    }
+
+
+    __attribute__((target("avx2")))
+    void matte_model_avx2(uint8_t* alpha, const uint32_t* value, const uint16_t* reference, size_t n, const model_params& params)
+    {
+      const auto offset = _mm256_set1_epi32(params.range - 1);
+      const auto range = _mm256_set1_epi32(params.range);
+      const auto scale = _mm256_set1_epi32(params.matte_scale);
+      const auto zero = _mm256_setzero_si256();
+      const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+      size_t x = 0;
+      for (; x + 32 <= n; x += 32) {
+        __m256i l[4];
+        model_limits_avx2(&l[0], &reference[x], params);
+        model_limits_avx2(&l[2], &reference[x + 16], params);
+        __m256i a[4];
+        for (size_t q = 0; q < 4; ++q) {
+          auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&value[x + 8 * q]));
+          auto t = _mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(_mm256_add_epi32(l[q], offset), v), zero), range);
+          a[q] = _mm256_srli_epi32(_mm256_mullo_epi32(t, scale), 16);
+        }
+        auto m = _mm256_packus_epi16(_mm256_packus_epi32(a[0], a[1]), _mm256_packus_epi32(a[2], a[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&alpha[x]), _mm256_permutevar8x32_epi32(m, order));
+      }
+
+      matte_model_sse41(alpha + x, value + x, reference + x, n - x, params);
+    }
+
+
+    // The weights are distributed to the three-byte pixels as for SSE4.1,
+    // the arithmetic uses the wider registers.
+    __attribute__((target("avx2")))
+    void composite_avx2(uint8_t* dest, const uint8_t* src, const uint8_t* backdrop, const uint8_t* alpha, size_t n)
+    {
+      const __m128i e[3] = {
+        _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[0])),
+        _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[1])),
+        _mm_load_si128(reinterpret_cast<const __m128i*>(expand3[2])),
+      };
+      const auto c128 = _mm256_set1_epi16(128);
+      const auto c255 = _mm256_set1_epi16(255);
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16, dest += 48, src += 48, backdrop += 48) {
+        auto m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&alpha[x]));
+        for (size_t i = 0; i < 3; ++i) {
+          auto s = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * i)));
+          auto b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(backdrop + 16 * i)));
+          auto a = _mm256_cvtepu8_epi16(_mm_shuffle_epi8(m, e[i]));
+          auto t = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(b, _mm256_sub_epi16(c255, a)));
+          t = _mm256_add_epi16(t, c128);
+          t = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+          auto r = _mm_packus_epi16(_mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1));
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 16 * i), r);
+        }
+      }
+
+      composite_generic(dest, src, backdrop, alpha + x, n - x);
+    }
+
+
+    __attribute__((target("avx2")))
+    void box_columns_avx2(uint8_t* dest, uint16_t* sums, const uint8_t* add, const uint8_t* sub, size_t n, float inverse)
+    {
+      const auto inv = _mm256_set1_ps(inverse);
+      const auto half = _mm256_set1_ps(0.5f);
+
+      size_t x = 0;
+      for (; x + 16 <= n; x += 16) {
+        auto s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&sums[x]));
+        auto lo = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(s))), inv), half));
+        auto hi = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(s, 1))), inv), half));
+        // Undo the lane-wise operation of the pack instruction.
+        auto q = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&dest[x]), _mm_packus_epi16(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1)));
+
+        auto a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&add[x])));
+        auto b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&sub[x])));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&sums[x]), _mm256_sub_epi16(_mm256_add_epi16(s, a), b));
+      }
+
+      box_columns_sse41(dest + x, sums + x, add + x, sub + x, n - x, inverse);
+    }
+
+
+    // The YUV conversion is limited by the deinterleaving of the
+    // three-byte pixels which does not gain from the wider registers, the
+    // SSE4.1 version is used.  The same is true for the transposition
+    // which is limited by the loads and stores of the rows.
+    const kernels avx2_kernels = {
+      "avx2",
+      threshold_avx2,
+      blend_rgb_avx2,
+      blend_rgba_avx2,
+      blend_rgba4_avx2,
+      blend_yuv_sse41,
+      matte_avx2,
+      blend_alpha_avx2,
+      blend_alpha4_avx2,
+      min_u8_avx2,
+      max_u8_avx2,
+      transpose_sse41,
+      fill_nearest_avx2,
+      fill_min_avx2,
+      fill_median_avx2,
+      ema_avx2,
+      median_avx2,
+      classify_avx2,
+      matte_value_avx2,
+      accumulate_avx2,
+      classify_model_avx2,
+      matte_model_avx2,
+      composite_avx2,
+      box_columns_avx2,
+    };
+#endif
+
+
+    // Outside the region of interest all pixels get the background color.
+    // The block holds the color of 16 RGB or 12 RGBA pixels, or 24 pairs
+    // of chroma values.  Copies of the fixed size compile to a few vector
+    // stores, as fast as memset.
+    using fill_block = uint8_t[48];
+
+    void make_fill_block(fill_block& block, const uint8_t* pattern, size_t len)
+    {
+      for (size_t i = 0; i < sizeof(block); ++i)
+        block[i] = pattern[i % len];
+    }
+
+
+    void fill_pattern(uint8_t* dest, size_t n, const fill_block& block)
+    {
+      size_t x = 0;
+      for (; x + sizeof(block) <= n; x += sizeof(block))
+        std::memcpy(dest + x, block, sizeof(block));
+      std::memcpy(dest + x, block, n - x);
+    }
+
+
+    // First nonzero byte of the N bytes at P, N if there is none.
+    size_t first_nonzero(const uint8_t* p, size_t n)
+    {
+      size_t x = 0;
+      for (uint64_t w; x + 8 <= n; x += 8) {
+        std::memcpy(&w, p + x, sizeof(w));
+        if (w != 0)
+          break;
+      }
+      while (x < n && p[x] == 0)
+        ++x;
+      return x;
+    }
+
+
+    // One past the last nonzero byte of the N bytes at P, zero if there is
+    // none.
+    size_t end_nonzero(const uint8_t* p, size_t n)
+    {
+      for (uint64_t w; n >= 8; n -= 8) {
+        std::memcpy(&w, p + n - 8, sizeof(w));
+        if (w != 0)
+          break;
+      }
+      while (n > 0 && p[n - 1] == 0)
+        --n;
+      return n;
+    }
+
+  } // anonymous namespace
+
+
+  const kernels& select_kernels()
+  {
+    return *available_kernels().front();
+  }
+
+
+  std::vector<const kernels*> available_kernels()
+  {
+    std::vector<const kernels*> res;
+#if defined __x86_64__ || defined __i386__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      res.push_back(&avx2_kernels);
+    if (__builtin_cpu_supports("sse4.1"))
+      res.push_back(&sse41_kernels);
+#endif
+    res.push_back(&generic_kernels);
+    return res;
+  }
+
+
+  depth_mask::depth_mask(video_format format_, size_t ndepth_history_, const unsigned char* color)
+  : format(format_), sum_limit(scaled_limit(ndepth_history_, upper_limit)), bpp(format == video_format::rgb ? 3 : format == video_format::rgba ? 4 : 1), ndepth_history(ndepth_history_), kern(&select_kernels())
+  {
+    std::copy_n(color, sizeof(green_bytes), green_bytes);
+    update_matte();
+  }
+
+
+  void depth_mask::resize(size_t width_, size_t height_)
+  {
+    width = width_;
+    height = height_;
+
+    // A reference for another size is of no use.
+    if (! background.ready(width, height))
+      background.clear();
+
+    // The frames start at cache line boundaries.
+    reserve_history(history_capacity(), (width * height + 31) & ~31zu);
+    reset_history();
+
+    reserve_workers();
+    opaque.assign(width, 0xff);
+  }
+
+
+  void depth_mask::set_nworkers(size_t newnworkers)
+  {
+    max_workers = std::max(newnworkers, 1zu);
+    reserve_workers();
+  }
+
+
+  void depth_mask::reserve_workers()
+  {
+    // Keep the rows of the workers in separate cache lines.
+    row_mask_stride = (width + 63) & ~63zu;
+    row_mask.resize(max_workers * 2 * row_mask_stride);
+    row_value.resize(max_workers * row_mask_stride);
+    worker_found.resize(max_workers);
+    row_pixels_stride = (3 * width + 63) & ~63zu;
+    row_pixels.resize(max_workers * 2 * row_pixels_stride);
+    cleanup.reserve(max_workers);
+    backdrop.reserve(width, max_workers);
+  }
+
+
+  size_t depth_mask::get_framesize() const
+  {
+    if (is_yuv(format))
+      return width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+    return width * height * bpp;
+  }
+
+
+  void depth_mask::rebuild_sum()
+  {
+    switch (filter) {
+    case depth_filter::average:
+      depth_sum.assign(width * height, 0);
+      for (size_t j = 0; j < ndepth_history; ++j) {
+        auto h = history_frame(j);
+        for (size_t i = 0; i < width * height; ++i)
+          depth_sum[i] += h[i];
+      }
+      break;
+    case depth_filter::ema:
+      // As if all previous values had been invalid.
+      depth_sum.assign(width * height, uint32_t(std::numeric_limits<uint16_t>::max()) << 4);
+      break;
+    case depth_filter::median:
+      depth_sum.clear();
+      break;
+    }
+  }
+
+
+  size_t depth_mask::history_length() const
+  {
+    switch (filter) {
+    case depth_filter::ema:
+      return 0;
+    case depth_filter::median:
+      return ndepth_history < 3 ? 1 : ndepth_history < 5 ? 3 : 5;
+    default:
+      return ndepth_history;
+    }
+  }
+
+
+  size_t depth_mask::history_capacity() const
+  {
+    switch (filter) {
+    case depth_filter::ema:
+      return 0;
+    case depth_filter::median:
+      return 5;
+    default:
+      return std::max(ndepth_history, max_ndepth_history);
+    }
+  }
+
+
+  size_t depth_mask::value_scale() const
+  {
+    switch (filter) {
+    case depth_filter::ema:
+      return 16;
+    case depth_filter::median:
+      return 1;
+    default:
+      return ndepth_history;
+    }
+  }
+
+
+  void depth_mask::reset_history()
+  {
+    reserve_history(history_capacity(), history_stride);
+    std::fill_n(depth_history.get(), history_length() * history_stride, std::numeric_limits<uint16_t>::max());
+    last_depth_frame = 0;
+    rebuild_sum();
+    sum_limit = scaled_limit(value_scale(), upper_limit);
+    ema_weight = ema_weight_for(ndepth_history);
+    update_matte();
+  }
+
+
+  void depth_mask::reserve_history(size_t nframes, size_t stride)
+  {
+    // The frames in use are preserved if the stride does not change.
+    if (auto nelems = nframes * stride; nelems > history_elements) {
+      auto bytes = nelems * sizeof(uint16_t);
+      auto p = static_cast<uint16_t*>(allocate_frame_memory(bytes));
+      if (stride == history_stride)
+        std::copy_n(depth_history.get(), history_elements, p);
+      depth_history = decltype(depth_history)(p, frame_deleter{ bytes });
+      history_elements = nelems;
+    }
+    history_stride = stride;
+  }
+
+
+  void depth_mask::process(uint8_t* dest, size_t framesize, const uint8_t* src, const uint16_t* depth, worker_pool* pool)
+  {
+    // The moving average has no history.  For the median the order of the
+    // other frames does not matter.
+    const size_t nframes = history_length();
+    const size_t oldest_frame = last_depth_frame;
+    uint16_t* oldest = nullptr;
+    if (nframes > 0) {
+      oldest = history_frame(oldest_frame);
+      if (++last_depth_frame == nframes)
+        last_depth_frame = 0;
+    }
+
+    // The holes are filled in a separate pass, the values of each row
+    // depend on the neighbouring rows.
+    depth = holes.apply(depth, width, height, *kern, pool);
+
+    // The capture takes a few seconds, a separate pass is good enough.
+    if (background.capturing())
+      background.add(depth);
+    const bool use_model = use_background && background.ready(width, height);
+
+    // With a backdrop the mask selects between the camera pixels and the
+    // backdrop, the background color is not used.  The blur needs the
+    // whole frame before it is masked, in place or not.
+    const uint8_t* back = backdrop.active() ? backdrop.apply(src, src_bpp, width, height, *kern, pool) : nullptr;
+
+    // The planes of the YUV formats are only written if they fit completely.
+    const bool yuv = is_yuv(format);
+    size_t copy_height;
+    if (yuv)
+      copy_height = get_framesize() <= framesize ? height : 0;
+    else
+      copy_height = width * height * bpp <= framesize ? height : (framesize / (width * bpp));
+
+    // Without the region of interest, periodically, and while the depth
+    // filter catches up afterwards all pixels are evaluated.  Outside the
+    // region the state of the filter is not updated, it keeps older but
+    // consistent values.
+    region active{ 0, height, 0, width };
+    if (use_roi) {
+      // The moving average takes about twice as long to forget old values.
+      auto window = std::max(ndepth_history, 1zu) * (filter == depth_filter::ema ? 2 : 1);
+      if (roi_frame >= window)
+        active = roi;
+      if (++roi_frame == std::max(roi_rescan_interval, 2 * window))
+        roi_frame = 0;
+    }
+    evaluated_pixels = active.area();
+
+    // The cleanup can grow the foreground beyond the evaluated region.
+    region out = active;
+    if (cleanup.active() && ! active.empty()) {
+      auto radius = cleanup.get_radius();
+      out.top = active.top > radius ? active.top - radius : 0;
+      out.bottom = std::min(active.bottom + radius, height);
+      out.left = (active.left > radius ? active.left - radius : 0) & ~15zu;
+      out.right = std::min((active.right + radius + 15) & ~15zu, width);
+      if (yuv) {
+        out.top &= ~1zu;
+        out.bottom = std::min((out.bottom + 1) & ~1zu, height);
+      }
+    }
+
+    // The history has to be updated for all rows of the region, even those
+    // not copied.  Without the cleanup the mask of each row is used right
+    // away.  With it the mask of the whole frame is computed first, cleaned
+    // up, and then applied.
+    assert(src_bpp == 3 || (src_bpp == 4 && bpp == 4));
+    enum struct pass { both, mask, blend };
+    const bool use_matte = alpha_matte && format == video_format::rgba;
+    auto blend = bpp == 3 ? kern->blend_rgb : src_bpp == 3 ? kern->blend_rgba : kern->blend_rgba4;
+    if (use_matte)
+      blend = src_bpp == 3 ? kern->blend_alpha : kern->blend_alpha4;
+    // Update the filter with N depth values of a row starting at OFFSET and
+    // compute the mask or the alpha values.  VALUE is used for the median
+    // of the row.
+    auto evaluate = [&](uint8_t* mask, size_t offset, uint32_t* value, size_t n) {
+      switch (filter) {
+      case depth_filter::average:
+        if (use_model) {
+          value = &depth_sum[offset];
+          kern->accumulate(value, &oldest[offset], &depth[offset], n);
+          break;
+        }
+        if (use_matte)
+          kern->matte(mask, &depth_sum[offset], &oldest[offset], &depth[offset], n, matte);
+        else
+          kern->threshold(mask, &depth_sum[offset], &oldest[offset], &depth[offset], n, sum_limit);
+        return;
+      case depth_filter::ema:
+        value = &depth_sum[offset];
+        kern->ema(value, &depth[offset], n, ema_weight);
+        break;
+      case depth_filter::median: {
+        uint16_t* frames[5];
+        for (size_t i = 0; i < nframes; ++i)
+          frames[i] = history_frame((oldest_frame + i) % nframes) + offset;
+        kern->median(value, frames, nframes, &depth[offset], n);
+        break;
+      }
+      }
+      if (use_model) {
+        if (use_matte)
+          kern->matte_model(mask, value, background.data() + offset, n, model);
+        else
+          kern->classify_model(mask, value, background.data() + offset, n, model);
+      } else if (use_matte)
+        kern->matte_value(mask, value, n, matte);
+      else
+        kern->classify(mask, value, n, sum_limit);
+    };
+    // The mask outside the evaluated region is only used by the alpha matte,
+    // which copies the pixels as transparent, the backdrop, and the cleanup.
+    const bool clear_mask = use_matte || back != nullptr || cleanup.active();
+    // The background color of the pixels outside the output region, for
+    // the YUV formats the luma value and the pair of chroma values.
+    const uint8_t key_y = luma(green_bytes[0], green_bytes[1], green_bytes[2]);
+    const uint8_t key_uv[2] = { chroma_u(4 * green_bytes[0], 4 * green_bytes[1], 4 * green_bytes[2]), chroma_v(4 * green_bytes[0], 4 * green_bytes[1], 4 * green_bytes[2]) };
+    fill_block key_block;
+    if (yuv)
+      make_fill_block(key_block, key_uv, 2);
+    else
+      make_fill_block(key_block, green_bytes, bpp);
+    auto evaluate_row = [&](uint8_t* mask, size_t y, uint32_t* value) {
+      if (y >= active.top && y < active.bottom) {
+        evaluate(mask + active.left, y * width + active.left, value, active.right - active.left);
+        if (clear_mask) {
+          std::memset(mask, 0, active.left);
+          std::memset(mask + active.right, 0, width - active.right);
+        }
+      } else if (clear_mask)
+        std::memset(mask, 0, width);
+    };
+    // Bounding box of the foreground in the output region.
+    auto track = [&](const uint8_t* mask, size_t y, region& found) {
+      if (! use_roi || y < out.top || y >= out.bottom)
+        return;
+      auto n = out.right - out.left;
+      if (auto first = first_nonzero(mask + out.left, n); first < n) {
+        found.top = std::min(found.top, y);
+        found.bottom = std::max(found.bottom, y + 1);
+        found.left = std::min(found.left, out.left + first);
+        found.right = std::max(found.right, out.left + end_nonzero(mask + out.left, n));
+      }
+    };
+    // The columns of the output region of row Y, empty outside.
+    auto out_columns = [&](size_t y) {
+      return y >= out.top && y < out.bottom ? std::pair(out.left, out.right) : std::pair(width, width);
+    };
+    auto do_rows = [&](size_t from, size_t to, uint8_t* row, uint32_t* value, uint8_t* pixels, pass which, region& found) {
+      for (size_t y = from; y < to; ++y) {
+        auto offset = y * width;
+        auto mask = which == pass::both ? row : &frame_mask[offset];
+        if (which != pass::blend)
+          evaluate_row(mask, y, value);
+        if (which == pass::mask)
+          continue;
+        track(mask, y, found);
+        if (y >= copy_height)
+          continue;
+        auto d = &dest[offset * bpp];
+        auto s = &src[offset * src_bpp];
+        if (back != nullptr) {
+          // RGB is composited directly into the output.  Frames masked in
+          // place with four bytes per pixel are packed first.
+          if (src_bpp == 4) {
+            for (size_t x = 0; x < width; ++x)
+              std::memcpy(&pixels[3 * x], &s[4 * x], 3);
+            s = pixels;
+          }
+          auto p = bpp == 3 ? d : pixels;
+          kern->composite(p, s, back + offset * 3, mask, width);
+          if (bpp == 4)
+            kern->blend_rgba(d, p, opaque.data(), width, green_bytes);
+        } else if (use_matte)
+          blend(d, s, mask, width, green_bytes);
+        else {
+          auto [left, right] = out_columns(y);
+          fill_pattern(d, left * bpp, key_block);
+          if (left < right)
+            blend(d + left * bpp, s + left * src_bpp, mask + left, right - left, green_bytes);
+          fill_pattern(d + right * bpp, (width - right) * bpp, key_block);
+        }
+      }
+    };
+
+    // Pairs of rows share the chroma values.  FROM is even.
+    const size_t chroma_width = (width + 1) / 2;
+    const bool interleaved = format == video_format::nv12;
+    // Chroma values [FROM, TO) of the background color.
+    auto fill_chroma = [&](uint8_t* u, uint8_t* v, size_t from, size_t to) {
+      if (interleaved)
+        fill_pattern(u + 2 * from, 2 * (to - from), key_block);
+      else {
+        std::memset(u + from, key_uv[0], to - from);
+        std::memset(v + from, key_uv[1], to - from);
+      }
+    };
+    auto do_yuv_rows = [&](size_t from, size_t to, uint8_t* row, uint32_t* value, uint8_t* pixels, pass which, region& found) {
+      auto chroma = dest + width * height;
+      for (size_t y = from; y < to; y += 2) {
+        auto offset0 = y * width;
+        auto offset1 = offset0;
+        auto mask0 = which == pass::both ? row : &frame_mask[offset0];
+        auto mask1 = mask0;
+        if (which != pass::blend)
+          evaluate_row(mask0, y, value);
+        // An odd last row is used twice.
+        if (y + 1 < height) {
+          offset1 += width;
+          mask1 = which == pass::both ? row + row_mask_stride : &frame_mask[offset1];
+          if (which != pass::blend)
+            evaluate_row(mask1, y + 1, value);
+        }
+        if (which == pass::mask)
+          continue;
+        track(mask0, y, found);
+        if (y + 1 < height)
+          track(mask1, y + 1, found);
+        if (y < copy_height) {
+          auto coffset = (y / 2) * chroma_width;
+          auto u = interleaved ? &chroma[2 * coffset] : &chroma[coffset];
+          auto v = interleaved ? u + 1 : &chroma[chroma_width * ((height + 1) / 2) + coffset];
+          if (back != nullptr) {
+            auto p0 = pixels;
+            auto p1 = p0;
+            kern->composite(p0, &src[offset0 * 3], back + offset0 * 3, mask0, width);
+            if (offset1 != offset0) {
+              p1 = pixels + row_pixels_stride;
+              kern->composite(p1, &src[offset1 * 3], back + offset1 * 3, mask1, width);
+            }
+            kern->blend_yuv(&dest[offset0], &dest[offset1], u, v, interleaved, p0, p1, opaque.data(), opaque.data(), width, green_bytes);
+            continue;
+          }
+          // LEFT is even, RIGHT as well unless it is the width.
+          auto [left, right] = out_columns(y);
+          std::memset(&dest[offset0], key_y, left);
+          std::memset(&dest[offset1], key_y, left);
+          fill_chroma(u, v, 0, (left + 1) / 2);
+          if (left < right) {
+            auto step = interleaved ? left : left / 2;
+            kern->blend_yuv(&dest[offset0 + left], &dest[offset1 + left], u + step, v + step, interleaved, &src[(offset0 + left) * 3], &src[(offset1 + left) * 3], mask0 + left, mask1 + left, right - left, green_bytes);
+          }
+          std::memset(&dest[offset0 + right], key_y, width - right);
+          std::memset(&dest[offset1 + right], key_y, width - right);
+          fill_chroma(u, v, (right + 1) / 2, chroma_width);
+        }
+      }
+    };
+    assert(! yuv || src_bpp == 3);
+
+    // The bands start at cache line boundaries of the output, for the YUV
+    // formats of the chroma rows and with an even number of luma rows.
+    // About four bands per worker allow to balance the load.
+    const bool parallel = pool != nullptr && pool->size() > 1;
+    size_t band_height = height;
+    size_t nbands = 1;
+    size_t nworkers = 1;
+    if (parallel) {
+      nworkers = pool->size();
+      assert(nworkers <= max_workers);
+
+      auto granularity = yuv ? 2 * (64 / std::gcd(interleaved ? 2 * chroma_width : chroma_width, 64zu)) : 64 / std::gcd(width * bpp, 64zu);
+      band_height = std::max((height / (4 * nworkers)) / granularity, 1zu) * granularity;
+      nbands = (height + band_height - 1) / band_height;
+    }
+    std::fill_n(worker_found.begin(), nworkers, region{ height, 0, width, 0 });
+
+    auto run = [&](pass which) {
+      auto do_band = [&](size_t band, size_t worker) {
+        auto from = band * band_height;
+        auto to = std::min((band + 1) * band_height, height);
+        auto row = &row_mask[worker * 2 * row_mask_stride];
+        auto value = &row_value[worker * row_mask_stride];
+        auto pixels = &row_pixels[worker * 2 * row_pixels_stride];
+        if (yuv)
+          do_yuv_rows(from, to, row, value, pixels, which, worker_found[worker]);
+        else
+          do_rows(from, to, row, value, pixels, which, worker_found[worker]);
+      };
+      if (parallel)
+        pool->run(nbands, do_band);
+      else
+        do_band(0, 0);
+    };
+
+    if (cleanup.active()) {
+      if (frame_mask.size() < width * height)
+        frame_mask.resize(width * height);
+      run(pass::mask);
+      cleanup.apply(frame_mask.data(), width, height, *kern, pool);
+      run(pass::blend);
+    } else
+      run(pass::both);
+
+    if (use_roi) {
+      region found{ height, 0, width, 0 };
+      for (size_t i = 0; i < nworkers; ++i) {
+        found.top = std::min(found.top, worker_found[i].top);
+        found.bottom = std::max(found.bottom, worker_found[i].bottom);
+        found.left = std::min(found.left, worker_found[i].left);
+        found.right = std::max(found.right, worker_found[i].right);
+      }
+      update_roi(active, found);
+    }
+  }
+
+
+  void depth_mask::set_color(uint32_t newcol)
+  {
+    green_bytes[0] = (newcol >> 16) & 0xff;
+    green_bytes[1] = (newcol >> 8) & 0xff;
+    green_bytes[2] = newcol & 0xff;
+  }
+
+
+  void depth_mask::set_depth_filter(depth_filter newfilter)
+  {
+    if (newfilter != filter) {
+      filter = newfilter;
+      reset_history();
+    }
+  }
+
+
+  void depth_mask::set_ndepth_history(size_t newsize)
+  {
+    if (newsize != ndepth_history && filter != depth_filter::average) {
+      // The moving average only changes the weight, the median keeps its
+      // values if the window does not change.
+      auto oldlength = history_length();
+      ndepth_history = newsize;
+      if (history_length() != oldlength)
+        reset_history();
+      ema_weight = ema_weight_for(newsize);
+    } else if (newsize != ndepth_history) {
+      // Only the dropped or added frames change the sums.
+      if (newsize < ndepth_history) {
+        for (size_t j = newsize; j < ndepth_history; ++j) {
+          auto h = history_frame(j);
+          for (size_t i = 0; i < depth_sum.size(); ++i)
+            depth_sum[i] -= h[i];
+        }
+        if (last_depth_frame >= newsize)
+          last_depth_frame = 0;
+      } else {
+        reserve_history(newsize, history_stride);
+        std::fill(history_frame(ndepth_history), history_frame(newsize), std::numeric_limits<uint16_t>::max());
+        const uint32_t added = uint32_t(newsize - ndepth_history) * std::numeric_limits<uint16_t>::max();
+        for (auto& s : depth_sum)
+          s += added;
+      }
+      ndepth_history = newsize;
+
+      sum_limit = scaled_limit(newsize, upper_limit);
+      update_matte();
+    }
+  }
+
+
+  void depth_mask::set_background(bool newuse, size_t newmargin)
+  {
+    use_background = newuse;
+    background_margin = newmargin;
+    update_model();
+  }
+
+
+  void depth_mask::set_upper_limit(size_t newlimit)
+  {
+    upper_limit = newlimit;
+    sum_limit = scaled_limit(value_scale(), upper_limit);
+    update_matte();
+  }
+
+
+  void depth_mask::set_feather(size_t newfeather)
+  {
+    feather = newfeather;
+    update_matte();
+  }
+
+
+  void depth_mask::update_matte()
+  {
+    // A pixel is opaque where the threshold accepts it, SUM < SUM_LIMIT.  The
+    // range is limited so that the products in the kernels fit into 32 bits.
+    auto range = int64_t(std::clamp(feather * value_scale(), 1zu, 1zu << 24));
+    matte.far = int32_t(std::min(int64_t(sum_limit) - 1 + range, int64_t(INT32_MAX)));
+    matte.range = int32_t(range);
+    matte.scale = int32_t(((255 << 16) + range - 1) / range);
+
+    // The model's limits depend on the same values.
+    update_model();
+  }
+
+
+  void depth_mask::update_model()
+  {
+    auto scale = value_scale();
+    model.margin = uint16_t(std::min(background_margin, size_t(std::numeric_limits<uint16_t>::max())));
+    model.limit = uint16_t(std::min(upper_limit, size_t(std::numeric_limits<uint16_t>::max())));
+    model.scale = uint32_t(scale);
+    model.bias = uint32_t(scale - scale / 2);
+    model.range = matte.range;
+    model.matte_scale = matte.scale;
+
+    // The foreground can change everywhere.
+    roi_frame = 0;
+  }
+
+
+  void depth_mask::set_roi(bool newval)
+  {
+    use_roi = newval;
+    roi_frame = 0;
+  }
+
+
+  void depth_mask::update_roi(const region& active, const region& found)
+  {
+    evaluated_pixels = active.area();
+    if (found.empty()) {
+      roi = region();
+      return;
+    }
+
+    // The margin covers the movement between two frames and the growth of
+    // the mask by the cleanup.  The columns start and end at multiples of
+    // 16 pixels, for the YUV formats the rows at pairs of rows.
+    auto margin_y = std::max(height / 20, 16zu) + cleanup.get_radius();
+    auto margin_x = std::max(width / 20, 16zu) + cleanup.get_radius();
+    roi.top = found.top > margin_y ? found.top - margin_y : 0;
+    roi.bottom = std::min(found.bottom + margin_y, height);
+    roi.left = (found.left > margin_x ? found.left - margin_x : 0) & ~15zu;
+    roi.right = std::min((found.right + margin_x + 15) & ~15zu, width);
+    if (is_yuv(format)) {
+      roi.top &= ~1zu;
+      roi.bottom = std::min((roi.bottom + 1) & ~1zu, height);
+    }
+
+    // The foreground reaches beyond the evaluated region, the next frame
+    // evaluates the whole frame.
+    if ((found.top <= active.top && active.top > 0) || (found.bottom >= active.bottom && active.bottom < height)
+        || (found.left <= active.left && active.left > 0) || (found.right >= active.right && active.right < width))
+      roi_frame = 0;
+  }
+
+} // namespace realsense
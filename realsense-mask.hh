@@ -0,0 +1,327 @@
+#ifndef _REALSENSE_MASK_HH
+#define _REALSENSE_MASK_HH 1
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "frame-allocator.hh"
+#include "realsense-backdrop.hh"
+#include "realsense-background.hh"
+#include "realsense-cleanup.hh"
+#include "realsense-holefill.hh"
+
+struct worker_pool;
+
+
+namespace realsense {
+
+  enum struct video_format {
+    rgb,
+    rgba,
+    // Planar YUV 4:2:0 with BT.709 coefficients and limited range.  The
+    // luma plane is followed by one plane with interleaved U and V values
+    // (NV12) or by two planes with first U and then V values (I420).  For
+    // odd sizes the last column and row have their own chroma values.
+    nv12,
+    i420,
+  };
+
+  inline bool is_yuv(video_format format) { return format == video_format::nv12 || format == video_format::i420; }
+
+
+  // How the depth values of the recent frames are combined before the
+  // comparison with the limit.  With a history length of N and P pixels:
+  enum struct depth_filter {
+    // The average of the last N frames.  The history needs N × 2 × P bytes
+    // and the running sums 4 × P bytes.
+    average,
+    // Exponential moving average with the weight 2 / (N + 1) for the new
+    // frame, which matches the average of N frames in the mean age of the
+    // values.  Only 4 × P bytes, there is no history.  Old values never
+    // vanish completely, a value far away fades out more slowly.
+    ema,
+    // The median of the last 1, 3, or 5 frames (N < 3, N < 5, otherwise),
+    // 2 × P bytes per frame.  Single outliers, e.g., invalid values, do not
+    // change the result at all.
+    median,
+  };
+
+
+  // For the alpha matte the alpha value of a pixel with the history sum S is
+  //
+  //   min(min(max(far - S, 0), range) × scale >> 16, 255)
+  //
+  // RANGE is the width of the feather band scaled by the length of the
+  // history, SCALE maps it to 0…255.
+  struct matte_params {
+    int32_t far;
+    int32_t range;
+    int32_t scale;
+  };
+
+
+  // With the learned background the limit of a pixel with the reference
+  // depth R (invalid values count as the maximum) is
+  //
+  //   L = min(max(R - margin, 0), limit) × scale + bias
+  //
+  // scaled like the values of the depth filter.  The pixel is foreground if
+  // the value is below L.  The alpha matte uses L - 1 + range as FAR with
+  // RANGE and MATTE_SCALE as in matte_params.
+  struct model_params {
+    uint16_t margin;
+    uint16_t limit;
+    uint32_t scale;
+    uint32_t bias;
+    int32_t range;
+    int32_t matte_scale;
+  };
+
+
+  // Implementations of the per-pixel work.  The depth evaluation adds the
+  // new depth values to the running sums, replaces the oldest values in the
+  // history with them, compares the sums with the limit scaled by the
+  // length of the history, and produces one byte per pixel (0xff for foreground,
+  // 0x00 for background) which the blend functions then use to select between
+  // the camera pixel and the background color.  The source pixels have
+  // three bytes, except for blend_rgba4 where they have four.  The blend
+  // functions also work in place, DEST and SRC can be the same.  blend_yuv
+  // converts two rows at a time to luma and the chroma values they share,
+  // stored at the same position of U and V (I420) or interleaved at U (NV12).
+  // For the alpha matte the matte function replaces the threshold, it
+  // produces alpha values instead of the mask.  blend_alpha and blend_alpha4
+  // copy the pixels from three- and four-byte source pixels and add these
+  // alpha values, they do not use the color.  The remaining functions
+  // are used for the cleanup of the mask: element-wise minimum and maximum
+  // of two rows and the transposition of NROWS × NCOLS bytes.  The fill
+  // functions replace the invalid values of one depth row, ROWS are the
+  // 2 × RADIUS + 1 rows around it, see hole_fill for the methods.  The
+  // other depth filters have their own update functions: ema updates the
+  // moving averages ACC, median replaces the oldest of the NFRAMES (1, 3,
+  // or 5) history rows with DEPTH and computes the medians.  Their results
+  // are compared with the limit by classify or turned into alpha values
+  // by matte_value.  With the learned background classify_model and
+  // matte_model replace these, they compute the limit of each pixel from
+  // its REFERENCE depth.  For the average accumulate then only updates
+  // the sums.  composite mixes three-byte SRC and BACKDROP pixels with the
+  // mask or alpha values as the weights of SRC, DEST can be SRC.  For the
+  // blurred backdrop box_columns stores the rounded products of the column
+  // SUMS and INVERSE and then moves the window down by one row.
+  struct kernels {
+    const char* name;
+    void (*threshold)(uint8_t* mask, uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n, uint32_t sum_limit);
+    void (*blend_rgb)(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color);
+    void (*blend_rgba)(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color);
+    void (*blend_rgba4)(uint8_t* dest, const uint8_t* src, const uint8_t* mask, size_t n, const unsigned char* color);
+    void (*blend_yuv)(uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, bool interleaved, const uint8_t* src0, const uint8_t* src1, const uint8_t* mask0, const uint8_t* mask1, size_t n, const unsigned char* color);
+    void (*matte)(uint8_t* alpha, uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n, const matte_params& params);
+    void (*blend_alpha)(uint8_t* dest, const uint8_t* src, const uint8_t* alpha, size_t n, const unsigned char* color);
+    void (*blend_alpha4)(uint8_t* dest, const uint8_t* src, const uint8_t* alpha, size_t n, const unsigned char* color);
+    void (*min_u8)(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t n);
+    void (*max_u8)(uint8_t* dest, const uint8_t* a, const uint8_t* b, size_t n);
+    void (*transpose)(uint8_t* dest, size_t dest_stride, const uint8_t* src, size_t src_stride, size_t nrows, size_t ncols);
+    void (*fill_nearest)(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n);
+    void (*fill_min)(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n);
+    void (*fill_median)(uint16_t* dest, const uint16_t* const* rows, size_t radius, size_t n);
+    void (*ema)(uint32_t* acc, const uint16_t* depth, size_t n, uint32_t weight);
+    void (*median)(uint32_t* value, uint16_t* const* frames, size_t nframes, const uint16_t* depth, size_t n);
+    void (*classify)(uint8_t* mask, const uint32_t* value, size_t n, uint32_t limit);
+    void (*matte_value)(uint8_t* alpha, const uint32_t* value, size_t n, const matte_params& params);
+    void (*accumulate)(uint32_t* sum, uint16_t* oldest, const uint16_t* depth, size_t n);
+    void (*classify_model)(uint8_t* mask, const uint32_t* value, const uint16_t* reference, size_t n, const model_params& params);
+    void (*matte_model)(uint8_t* alpha, const uint32_t* value, const uint16_t* reference, size_t n, const model_params& params);
+    void (*composite)(uint8_t* dest, const uint8_t* src, const uint8_t* backdrop, const uint8_t* alpha, size_t n);
+    void (*box_columns)(uint8_t* dest, uint16_t* sums, const uint8_t* add, const uint8_t* sub, size_t n, float inverse);
+  };
+
+  // The best implementation for the current CPU.
+  const kernels& select_kernels();
+  // All implementations the current CPU can execute, the best first.
+  std::vector<const kernels*> available_kernels();
+
+
+  // Removal of the background based on the depth information.  This is
+  // independent of the camera so that it can be used without hardware.
+  struct depth_mask
+  {
+    depth_mask(video_format format_, size_t ndepth_history_, const unsigned char* color);
+
+    void resize(size_t width_, size_t height_);
+
+    // Without a pool the calling thread processes all rows.  DEST and SRC
+    // can be the same if the source has as many bytes per pixel as the
+    // output.
+    void process(uint8_t* dest, size_t framesize, const uint8_t* src, const uint16_t* depth, worker_pool* pool = nullptr);
+
+    auto get_width() const { return width; }
+    auto get_height() const { return height; }
+    // For the YUV formats the bytes per pixel of the luma plane.
+    auto get_bpp() const { return bpp; }
+    size_t get_framesize() const;
+    auto get_ndepth_history() const { return ndepth_history; }
+    // The longest history the plugin offers.  The memory for it is
+    // allocated up front, longer histories allocate when they are set.
+    static constexpr size_t max_ndepth_history = 16;
+
+    void set_color(uint32_t newcol);
+    void set_transparency(unsigned char newa) { green_bytes[3] = newa; }
+    void set_upper_limit(size_t newlimit);
+    // With the alpha matte, only for RGBA output, the background color is
+    // not used.  Pixels up to the limit are opaque, beyond they become
+    // transparent over the feather width, in depth units.
+    void set_alpha_matte(bool newval) { alpha_matte = newval; roi_frame = 0; }
+    void set_feather(size_t newfeather);
+    // Morphological cleanup of the mask, or the alpha matte, before it is
+    // applied.  The radius is in pixels.
+    void set_cleanup(cleanup_op newop, size_t newradius) { cleanup.configure(newop, newradius); cleanup.reserve(max_workers); roi_frame = 0; }
+    // Filling of invalid depth values before they enter the history.
+    void set_hole_fill(hole_fill newmode, size_t newradius) { holes.configure(newmode, newradius); roi_frame = 0; }
+    // Composite the foreground over an image or the blurred frame instead
+    // of using the background color.  The output is opaque, the alpha
+    // matte becomes the weight of the camera pixels.
+    void set_backdrop(backdrop_mode newmode, size_t newradius) { backdrop.configure(newmode, newradius); backdrop.reserve(width, max_workers); }
+    void set_backdrop_image(const uint8_t* pixels, size_t width_, size_t height_) { backdrop.set_image(pixels, width_, height_); }
+    void set_ndepth_history(size_t newsize);
+    // With the learned background a pixel is foreground if it is closer
+    // than its reference depth minus the margin, in depth units, and
+    // within the limit.  Without a reference for the current size only the
+    // limit is used.
+    void set_background(bool newuse, size_t newmargin);
+    // Learn the reference depth from the next NFRAMES frames.
+    void capture_background(size_t nframes) { background.start_capture(width, height, nframes); }
+    // Changing the filter starts with an empty history.
+    void set_depth_filter(depth_filter newfilter);
+    auto get_depth_filter() const { return filter; }
+    // With the region of interest the depth values are only evaluated in
+    // the bounding box of the foreground of the previous frame, grown by a
+    // margin.  Everything outside is background.  Periodically, and when
+    // the foreground reaches the border of the region, the whole frame is
+    // evaluated for as many frames as the depth filter needs to catch up so
+    // that new objects are picked up.
+    void set_roi(bool newval);
+    auto get_roi() const { return use_roi; }
+    // Number of pixels of the last frame whose depth values were evaluated.
+    auto get_evaluated_pixels() const { return evaluated_pixels; }
+    void set_kernels(const kernels& newkern) { kern = &newkern; }
+    // The size of the pools passed to process from now on.  The buffers of
+    // the workers are allocated here, process does not allocate.
+    void set_nworkers(size_t newnworkers);
+    // Three (RGB) or, for RGBA output, four (RGBA) bytes per source pixel.
+    void set_source_bpp(size_t newbpp) { src_bpp = newbpp; }
+
+    void rebuild_sum();
+    void reserve_history(size_t nframes, size_t stride);
+    // Fill the history with invalid values.
+    void reset_history();
+    // Number of frames kept for the filter.
+    size_t history_length() const;
+    // Number of frames allocated for the filter, enough for the longest
+    // history so that changing its length does not allocate.
+    size_t history_capacity() const;
+    // Factor between the values the filter produces and depth values.
+    size_t value_scale() const;
+    uint16_t* history_frame(size_t idx) { return &depth_history[idx * history_stride]; }
+
+    const video_format format;
+
+    // Computed limit for foreground;
+    size_t upper_limit = 0;
+    // The same limit scaled for the comparison with the history sums or
+    // the other filters' values.
+    uint32_t sum_limit = 0;
+
+    depth_filter filter = depth_filter::average;
+    // Weight of the new frame in the moving average in units of 1/256.
+    uint32_t ema_weight = 256;
+
+    bool alpha_matte = false;
+    size_t feather = 0;
+    matte_params matte;
+    void update_matte();
+
+    background_model background;
+    bool use_background = false;
+    size_t background_margin = 0;
+    model_params model;
+    void update_model();
+
+    // Rows [top, bottom) and columns [left, right).
+    struct region {
+      size_t top = 0;
+      size_t bottom = 0;
+      size_t left = 0;
+      size_t right = 0;
+
+      bool empty() const { return top >= bottom || left >= right; }
+      size_t area() const { return empty() ? 0 : (bottom - top) * (right - left); }
+    };
+    // Frames between the starts of the evaluations of the whole frame.
+    static constexpr size_t roi_rescan_interval = 30;
+    bool use_roi = false;
+    region roi;
+    // Frames since the last evaluation of the whole frame started.
+    size_t roi_frame = 0;
+    size_t evaluated_pixels = 0;
+    // The bounding box of the foreground found by each worker.
+    std::vector<region> worker_found;
+    void update_roi(const region& active, const region& found);
+
+    size_t width = 0;
+    size_t height = 0;
+    size_t bpp;
+    size_t src_bpp = 3;
+
+    // The history contains the depth values with invalid values (zero)
+    // already replaced by the maximum value.  All frames are in one
+    // allocation, each starting at a cache line boundary.  With the running
+    // sums only the oldest frame is read and it is read sequentially.  The
+    // allocation only grows and is made for the longest history, changing
+    // the length of the history does not allocate.
+    struct frame_deleter {
+      size_t bytes;
+      void operator()(uint16_t* p) const { free_frame_memory(p, bytes); }
+    };
+    std::unique_ptr<uint16_t[], frame_deleter> depth_history;
+    size_t history_elements = 0;
+    size_t history_stride = 0;
+    size_t ndepth_history;
+    size_t last_depth_frame = 0;
+
+    // Sum of the values in the history for each pixel.  For the moving
+    // average the averages with four fractional bits.
+    frame_vector<uint32_t> depth_sum;
+    // For the median the values of one row for each worker.
+    std::vector<uint32_t> row_value;
+
+    // Mask for two rows for each worker.  The YUV formats need both.
+    std::vector<uint8_t> row_mask;
+    size_t row_mask_stride = 0;
+    // The number of workers the buffers are sized for.
+    size_t max_workers = 1;
+    void reserve_workers();
+
+    hole_filler holes;
+
+    // With the cleanup the mask for the whole frame is computed first.
+    mask_cleanup cleanup;
+    frame_vector<uint8_t> frame_mask;
+
+    backdrop_source backdrop;
+    // For the backdrop the composited pixels of two rows for each worker,
+    // and a mask which selects all of them for the conversion to the
+    // output format.
+    frame_vector<uint8_t> row_pixels;
+    size_t row_pixels_stride = 0;
+    frame_vector<uint8_t> opaque;
+
+    // device color.
+    unsigned char green_bytes[4];
+
+    const kernels* kern;
+  };
+
+} // namespace realsense
+
+#endif // realsense-mask.hh
@@ -0,0 +1,1423 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "realsense-align.hh"
+#include "realsense-mask.hh"
+#include "worker-pool.hh"
+
+
+// Count all allocations so that the steady state can be checked.  The frame
+// buffers are allocated with the aligned variants.
+namespace {
+  std::atomic<uint64_t> nallocs = 0;
+}
+
+void* operator new(size_t size)
+{
+  nallocs.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size ?: 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+  nallocs.fetch_add(1, std::memory_order_relaxed);
+  auto a = size_t(align);
+  if (auto p = std::aligned_alloc(a, (std::max(size, 1zu) + a - 1) & ~(a - 1)))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+  std::free(p);
+}
+
+
+namespace {
+
+  std::mt19937 rng(42);
+
+
+  // Depth values around the interesting limits with a fair share of invalid values.
+  std::vector<uint16_t> random_depth(size_t n)
+  {
+    std::uniform_int_distribution<unsigned> dist(0, 5000);
+    std::vector<uint16_t> res(n);
+    for (auto& d : res) {
+      d = dist(rng);
+      if (d < 500)
+        d = 0;
+    }
+    return res;
+  }
+
+
+  std::vector<uint8_t> random_pixels(size_t n)
+  {
+    std::uniform_int_distribution<unsigned> dist(0, 255);
+    std::vector<uint8_t> res(n);
+    for (auto& p : res)
+      p = dist(rng);
+    return res;
+  }
+
+
+  const char* format_name(realsense::video_format format)
+  {
+    switch (format) {
+    case realsense::video_format::rgb:
+      return "rgb";
+    case realsense::video_format::rgba:
+      return "rgba";
+    case realsense::video_format::nv12:
+      return "nv12";
+    case realsense::video_format::i420:
+      return "i420";
+    }
+    return "?";
+  }
+
+
+  // Straightforward conversion of an RGB frame to YUV 4:2:0 with BT.709
+  // coefficients and limited range in 8-bit fixed point.  The chroma values
+  // are computed from the sum of the 2×2 block, at the right and bottom edges
+  // of odd sizes the last column and row are used twice.
+  void reference_yuv(uint8_t* dest, const uint8_t* rgb, size_t width, size_t height, bool interleaved)
+  {
+    for (size_t i = 0; i < width * height; ++i)
+      dest[i] = uint8_t(((47 * rgb[3 * i] + 157 * rgb[3 * i + 1] + 16 * rgb[3 * i + 2] + 128) >> 8) + 16);
+
+    auto chroma_width = (width + 1) / 2;
+    auto chroma_height = (height + 1) / 2;
+    auto chroma = dest + width * height;
+    for (size_t cy = 0; cy < chroma_height; ++cy)
+      for (size_t cx = 0; cx < chroma_width; ++cx) {
+        int sum[3] = { 0, 0, 0 };
+        for (auto y : { 2 * cy, std::min(2 * cy + 1, height - 1) })
+          for (auto x : { 2 * cx, std::min(2 * cx + 1, width - 1) })
+            for (size_t c = 0; c < 3; ++c)
+              sum[c] += rgb[3 * (y * width + x) + c];
+        auto u = uint8_t(((-26 * sum[0] - 86 * sum[1] + 112 * sum[2] + 512) >> 10) + 128);
+        auto v = uint8_t(((112 * sum[0] - 102 * sum[1] - 10 * sum[2] + 512) >> 10) + 128);
+        auto idx = cy * chroma_width + cx;
+        if (interleaved) {
+          chroma[2 * idx] = u;
+          chroma[2 * idx + 1] = v;
+        } else {
+          chroma[idx] = u;
+          chroma[chroma_width * chroma_height + idx] = v;
+        }
+      }
+  }
+
+
+  // The original implementation: the depth values of all frames in the
+  // history are averaged for each pixel.  The YUV formats are converted
+  // from the RGB result.
+  struct reference_mask {
+    reference_mask(realsense::video_format format_, size_t width_, size_t height_, size_t ndepth_history, const unsigned char* color)
+    : format(format_), width(width_), height(height_), bpp(format == realsense::video_format::rgba ? 4 : 3),
+      depth_history(ndepth_history, std::vector<uint16_t>(width * height)), rgb(width * height * 3)
+    {
+      std::memcpy(green_bytes, color, sizeof(green_bytes));
+    }
+
+    void set_ndepth_history(size_t newsize)
+    {
+      if (newsize < depth_history.size()) {
+        depth_history.resize(newsize);
+        if (last_depth_frame >= newsize)
+          last_depth_frame = 0;
+      } else
+        for (auto i = depth_history.size(); i < newsize; ++i)
+          depth_history.emplace_back(width * height);
+    }
+
+    void process(uint8_t* dest, const uint8_t* src, const uint16_t* depth, size_t upper_limit)
+    {
+      if (realsense::is_yuv(format)) {
+        process_rgb(rgb.data(), src, depth, upper_limit);
+        reference_yuv(dest, rgb.data(), width, height, format == realsense::video_format::nv12);
+      } else
+        process_rgb(dest, src, depth, upper_limit);
+    }
+
+    void process_rgb(uint8_t* dest, const uint8_t* src, const uint16_t* depth, size_t upper_limit)
+    {
+      auto ndepth_history = depth_history.size();
+      std::copy_n(depth, width * height, depth_history[last_depth_frame].data());
+      if (++last_depth_frame == ndepth_history)
+        last_depth_frame = 0;
+
+      for (size_t i = 0; i < width * height; ++i) {
+        auto pixels_distance = 0zu;
+        for (size_t j = 0; j < ndepth_history; ++j)
+          pixels_distance += depth_history[j][i] ?: std::numeric_limits<uint16_t>::max();
+        pixels_distance = (pixels_distance + ndepth_history / 2) / ndepth_history;
+        if (pixels_distance <= upper_limit) {
+          std::memcpy(&dest[i * bpp], &src[i * 3], 3);
+          if (bpp == 4)
+            dest[i * bpp + 3] = 0xff;
+        } else
+          std::memcpy(&dest[i * bpp], green_bytes, bpp);
+      }
+    }
+
+    realsense::video_format format;
+    size_t width;
+    size_t height;
+    size_t bpp;
+    std::vector<std::vector<uint16_t>> depth_history;
+    size_t last_depth_frame = 0;
+    unsigned char green_bytes[4];
+    std::vector<uint8_t> rgb;
+  };
+
+
+  // Run the running-sum implementation through a sequence of frames while
+  // the history length changes and compare with the original averaging.
+  int test_history(realsense::video_format format, size_t width, size_t height, size_t limit)
+  {
+    static const unsigned char color[4] = { 0x00, 0xff, 0x00, 0x80 };
+    static const size_t sizes[] = { 4, 4, 4, 4, 4, 8, 8, 8, 2, 2, 2, 2, 16, 16, 16, 1, 1, 5, 5, 5, 5, 5, 5, 3, 16, 16 };
+
+    realsense::depth_mask mask(format, sizes[0], color);
+    mask.resize(width, height);
+    mask.set_upper_limit(limit);
+    reference_mask ref(format, width, height, sizes[0], color);
+
+    const size_t framesize = mask.get_framesize();
+    std::vector<uint8_t> out(framesize);
+    std::vector<uint8_t> expected(framesize);
+
+    int result = 0;
+    for (size_t frame = 0; frame < std::size(sizes); ++frame) {
+      mask.set_ndepth_history(sizes[frame]);
+      ref.set_ndepth_history(sizes[frame]);
+
+      auto src = random_pixels(width * height * 3);
+      auto depth = random_depth(width * height);
+
+      mask.process(out.data(), framesize, src.data(), depth.data());
+      ref.process(expected.data(), src.data(), depth.data(), limit);
+
+      if (out != expected) {
+        std::cout << "FAIL: running sum differs from average for " << width << "x" << height
+                  << " " << format_name(format)
+                  << " limit " << limit << " frame " << frame << " history " << sizes[frame] << std::endl;
+        result = 1;
+      }
+    }
+
+    return result;
+  }
+
+
+  // Run all kernels over the same sequence of frames and compare the output
+  // with the generic implementation.
+  int test_kernels(realsense::video_format format, size_t width, size_t height, size_t ndepth_history, size_t limit)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    auto kerns = realsense::available_kernels();
+
+    std::vector<realsense::depth_mask> masks;
+    for (auto k : kerns) {
+      masks.emplace_back(format, ndepth_history, color);
+      masks.back().resize(width, height);
+      masks.back().set_upper_limit(limit);
+      masks.back().set_kernels(*k);
+    }
+
+    const size_t framesize = masks.front().get_framesize();
+    std::vector<std::vector<uint8_t>> out(kerns.size(), std::vector<uint8_t>(framesize));
+
+    int result = 0;
+    for (size_t frame = 0; frame < ndepth_history + 3; ++frame) {
+      auto src = random_pixels(width * height * 3);
+      auto depth = random_depth(width * height);
+
+      for (size_t i = 0; i < kerns.size(); ++i)
+        masks[i].process(out[i].data(), framesize, src.data(), depth.data());
+
+      for (size_t i = 0; i + 1 < kerns.size(); ++i)
+        if (out[i] != out.back()) {
+          std::cout << "FAIL: " << kerns[i]->name << " differs from " << kerns.back()->name
+                    << " for " << width << "x" << height << " " << format_name(format)
+                    << " history " << ndepth_history << " limit " << limit << " frame " << frame << std::endl;
+          result = 1;
+        }
+    }
+
+    return result;
+  }
+
+  // Masking the camera's buffer in place, with three bytes per pixel for RGB
+  // and four for RGBA, must give the same result as masking into a separate
+  // buffer from three-byte pixels.  The alpha channel of the source is ignored.
+  int test_in_place(realsense::video_format format, size_t width, size_t height)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x80 };
+    auto kerns = realsense::available_kernels();
+
+    int result = 0;
+    for (auto k : kerns) {
+      realsense::depth_mask copying(format, 3, color);
+      realsense::depth_mask in_place(format, 3, color);
+      copying.resize(width, height);
+      in_place.resize(width, height);
+      copying.set_upper_limit(2500);
+      in_place.set_upper_limit(2500);
+      copying.set_kernels(*k);
+      in_place.set_kernels(*k);
+      in_place.set_source_bpp(in_place.get_bpp());
+
+      const size_t framesize = width * height * copying.get_bpp();
+      std::vector<uint8_t> expected(framesize);
+
+      for (size_t frame = 0; frame < 5; ++frame) {
+        auto src = random_pixels(width * height * 3);
+        auto buf = random_pixels(framesize);
+        for (size_t i = 0; i < width * height; ++i)
+          std::memcpy(&buf[i * in_place.get_bpp()], &src[i * 3], 3);
+        auto depth = random_depth(width * height);
+
+        copying.process(expected.data(), framesize, src.data(), depth.data());
+        in_place.process(buf.data(), framesize, buf.data(), depth.data());
+
+        if (buf != expected) {
+          std::cout << "FAIL: " << k->name << " in place differs for " << width << "x" << height
+                    << " " << format_name(format) << " frame " << frame << std::endl;
+          result = 1;
+        }
+      }
+    }
+
+    return result;
+  }
+
+
+  // The alpha matte of all kernels must agree.  Without a feather band it
+  // is the alpha channel the background color with zero alpha produces.
+  // Within a wide enough band alpha falls linearly with the distance.
+  int test_matte(size_t width, size_t height, size_t ndepth_history, size_t feather)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    const size_t limit = 2500;
+    auto kerns = realsense::available_kernels();
+
+    std::vector<realsense::depth_mask> masks;
+    for (auto k : kerns) {
+      masks.emplace_back(realsense::video_format::rgba, ndepth_history, color);
+      masks.back().resize(width, height);
+      masks.back().set_upper_limit(limit);
+      masks.back().set_kernels(*k);
+      masks.back().set_alpha_matte(true);
+      masks.back().set_feather(feather);
+    }
+    realsense::depth_mask binary(realsense::video_format::rgba, ndepth_history, color);
+    binary.resize(width, height);
+    binary.set_upper_limit(limit);
+
+    const size_t framesize = binary.get_framesize();
+    std::vector<std::vector<uint8_t>> out(kerns.size(), std::vector<uint8_t>(framesize));
+    std::vector<uint8_t> expected(framesize);
+
+    int result = 0;
+    for (size_t frame = 0; frame < ndepth_history + 3; ++frame) {
+      auto src = random_pixels(width * height * 3);
+      auto depth = random_depth(width * height);
+
+      for (size_t i = 0; i < kerns.size(); ++i)
+        masks[i].process(out[i].data(), framesize, src.data(), depth.data());
+      binary.process(expected.data(), framesize, src.data(), depth.data());
+
+      for (size_t i = 0; i + 1 < kerns.size(); ++i)
+        if (out[i] != out.back()) {
+          std::cout << "FAIL: " << kerns[i]->name << " matte differs from " << kerns.back()->name << " for " << width << "x" << height
+                    << " history " << ndepth_history << " feather " << feather << " frame " << frame << std::endl;
+          result = 1;
+        }
+
+      for (size_t i = 0; i < width * height; ++i)
+        if (std::memcmp(&out.back()[4 * i], &src[3 * i], 3) != 0 || (feather == 0 && out.back()[4 * i + 3] != expected[4 * i + 3])) {
+          std::cout << "FAIL: matte pixel " << i << " wrong for " << width << "x" << height
+                    << " history " << ndepth_history << " feather " << feather << " frame " << frame << std::endl;
+          result = 1;
+          break;
+        }
+    }
+
+    if (feather >= 100)
+      for (auto [distance, low, high] : { std::tuple(limit, 255u, 255u), std::tuple(limit + feather / 2, 120u, 135u), std::tuple(limit + feather + 1, 0u, 0u) }) {
+        auto src = random_pixels(width * height * 3);
+        std::vector<uint16_t> depth(width * height, uint16_t(distance));
+        for (size_t frame = 0; frame < ndepth_history; ++frame)
+          masks.back().process(out.back().data(), framesize, src.data(), depth.data());
+        for (size_t i = 0; i < width * height; ++i)
+          if (out.back()[4 * i + 3] < low || out.back()[4 * i + 3] > high) {
+            std::cout << "FAIL: matte alpha " << unsigned(out.back()[4 * i + 3]) << " at distance " << distance << " feather " << feather << std::endl;
+            result = 1;
+            break;
+          }
+      }
+
+    return result;
+  }
+
+
+  // Processing the bands in parallel must not change the result.
+  int test_pool(realsense::video_format format, size_t width, size_t height, size_t nworkers)
+  {
+    static const unsigned char color[4] = { 0x10, 0x20, 0x30, 0x40 };
+
+    worker_pool pool(nworkers);
+    realsense::depth_mask serial(format, 4, color);
+    realsense::depth_mask parallel(format, 4, color);
+    serial.resize(width, height);
+    parallel.resize(width, height);
+    parallel.set_nworkers(nworkers);
+    serial.set_upper_limit(2500);
+    parallel.set_upper_limit(2500);
+
+    const size_t framesize = serial.get_framesize();
+    std::vector<uint8_t> expected(framesize);
+    std::vector<uint8_t> out(framesize);
+
+    int result = 0;
+    for (size_t frame = 0; frame < 8; ++frame) {
+      auto src = random_pixels(width * height * 3);
+      auto depth = random_depth(width * height);
+
+      serial.process(expected.data(), framesize, src.data(), depth.data());
+      parallel.process(out.data(), framesize, src.data(), depth.data(), &pool);
+
+      if (out != expected) {
+        std::cout << "FAIL: " << nworkers << " workers differ for " << width << "x" << height
+                  << " " << format_name(format) << " frame " << frame << std::endl;
+        result = 1;
+      }
+    }
+
+    return result;
+  }
+
+
+  // Minimum or maximum over the square window, computed directly.  The
+  // window is clipped at the border.
+  std::vector<uint8_t> reference_filter(const std::vector<uint8_t>& in, size_t width, size_t height, bool erode, size_t radius)
+  {
+    std::vector<uint8_t> out(width * height);
+    for (size_t y = 0; y < height; ++y)
+      for (size_t x = 0; x < width; ++x) {
+        uint8_t v = erode ? 0xff : 0x00;
+        for (size_t yy = y - std::min(y, radius); yy <= std::min(y + radius, height - 1); ++yy)
+          for (size_t xx = x - std::min(x, radius); xx <= std::min(x + radius, width - 1); ++xx)
+            v = erode ? std::min(v, in[yy * width + xx]) : std::max(v, in[yy * width + xx]);
+        out[y * width + x] = v;
+      }
+    return out;
+  }
+
+
+  const char* cleanup_name(realsense::cleanup_op op)
+  {
+    switch (op) {
+    case realsense::cleanup_op::none:
+      return "none";
+    case realsense::cleanup_op::erode:
+      return "erode";
+    case realsense::cleanup_op::dilate:
+      return "dilate";
+    case realsense::cleanup_op::open:
+      return "open";
+    case realsense::cleanup_op::close:
+      return "close";
+    }
+    return "?";
+  }
+
+
+  // The separable filter with the running minima and maxima must give the
+  // same result as the direct computation, for all kernels and when the
+  // strips are processed in parallel.  Masks with large blobs and with
+  // arbitrary values as in the alpha matte are used.
+  int test_cleanup(size_t width, size_t height, realsense::cleanup_op op, size_t radius, size_t nworkers)
+  {
+    worker_pool pool(nworkers);
+
+    std::uniform_int_distribution<unsigned> dist(0, 99);
+    std::vector<uint8_t> blobs(width * height);
+    for (size_t y = 0; y < height; ++y)
+      for (size_t x = 0; x < width; ++x)
+        blobs[y * width + x] = ((x / 5 + y / 3) % 3 == 0) != (dist(rng) < 10) ? 0xff : 0x00;
+
+    int result = 0;
+    for (const auto& in : { blobs, random_pixels(width * height) }) {
+      bool erode_first = op == realsense::cleanup_op::erode || op == realsense::cleanup_op::open;
+      auto expected = reference_filter(in, width, height, erode_first, radius);
+      if (op == realsense::cleanup_op::open || op == realsense::cleanup_op::close)
+        expected = reference_filter(expected, width, height, ! erode_first, radius);
+
+      for (auto k : realsense::available_kernels()) {
+        realsense::mask_cleanup cleanup;
+        cleanup.configure(op, radius);
+        auto out = in;
+        cleanup.apply(out.data(), width, height, *k, &pool);
+        if (out != expected) {
+          std::cout << "FAIL: " << k->name << " " << cleanup_name(op) << " radius " << radius << " differs for " << width << "x" << height
+                    << " with " << nworkers << " workers" << std::endl;
+          result = 1;
+        }
+      }
+    }
+
+    return result;
+  }
+
+
+  // With the cleanup the masking must still agree for all kernels and when
+  // run in parallel.
+  int test_cleanup_mask(realsense::video_format format, size_t width, size_t height)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    auto kerns = realsense::available_kernels();
+
+    worker_pool pool(3);
+    std::vector<realsense::depth_mask> masks;
+    for (auto k : kerns) {
+      masks.emplace_back(format, 4, color);
+      masks.back().resize(width, height);
+      masks.back().set_nworkers(pool.size());
+      masks.back().set_upper_limit(2500);
+      masks.back().set_kernels(*k);
+      masks.back().set_alpha_matte(true);
+      masks.back().set_feather(300);
+      masks.back().set_cleanup(realsense::cleanup_op::open, 2);
+    }
+
+    const size_t framesize = masks.front().get_framesize();
+    std::vector<std::vector<uint8_t>> out(kerns.size(), std::vector<uint8_t>(framesize));
+
+    int result = 0;
+    for (size_t frame = 0; frame < 6; ++frame) {
+      auto src = random_pixels(width * height * 3);
+      auto depth = random_depth(width * height);
+
+      for (size_t i = 0; i < kerns.size(); ++i)
+        masks[i].process(out[i].data(), framesize, src.data(), depth.data(), i == 0 ? &pool : nullptr);
+
+      for (size_t i = 0; i + 1 < kerns.size(); ++i)
+        if (out[i] != out.back()) {
+          std::cout << "FAIL: " << kerns[i]->name << " with cleanup differs from " << kerns.back()->name << " for " << width << "x" << height
+                    << " " << format_name(format) << " frame " << frame << std::endl;
+          result = 1;
+        }
+    }
+
+    return result;
+  }
+
+
+  // The hole filling methods computed directly from their definition.
+  std::vector<uint16_t> reference_fill(const std::vector<uint16_t>& depth, size_t width, size_t height, realsense::hole_fill mode, size_t radius)
+  {
+    auto at = [&](size_t x, size_t y) -> uint16_t { return x < width && y < height ? depth[y * width + x] : 0; };
+
+    std::vector<uint16_t> res(depth);
+    for (size_t y = 0; y < height; ++y)
+      for (size_t x = 0; x < width; ++x) {
+        if (at(x, y) != 0)
+          continue;
+        uint16_t v = 0;
+        if (mode == realsense::hole_fill::nearest) {
+          for (size_t d = 1; v == 0 && d <= radius; ++d)
+            for (auto c : { at(x - d, y), at(x + d, y), at(x, y - d), at(x, y + d) })
+              if (v == 0)
+                v = c;
+        } else if (mode == realsense::hole_fill::min) {
+          for (size_t yy = y - std::min(y, radius); yy <= y + radius; ++yy)
+            for (size_t xx = x - std::min(x, radius); xx <= x + radius; ++xx)
+              if (auto c = at(xx, yy); c != 0 && (v == 0 || c < v))
+                v = c;
+        } else {
+          std::vector<uint16_t> valid;
+          for (size_t yy = y - std::min(y, 1zu); yy <= y + 1; ++yy)
+            for (size_t xx = x - std::min(x, 1zu); xx <= x + 1; ++xx)
+              if (auto c = at(xx, yy); c != 0)
+                valid.push_back(c);
+          std::sort(valid.begin(), valid.end());
+          if (! valid.empty())
+            v = valid[(valid.size() - 1) / 2];
+        }
+        res[y * width + x] = v;
+      }
+    return res;
+  }
+
+
+  const char* fill_name(realsense::hole_fill mode)
+  {
+    switch (mode) {
+    case realsense::hole_fill::none:
+      return "none";
+    case realsense::hole_fill::nearest:
+      return "nearest";
+    case realsense::hole_fill::min:
+      return "min";
+    case realsense::hole_fill::median:
+      return "median";
+    }
+    return "?";
+  }
+
+
+  // All kernels, serial and parallel, must fill the holes as the
+  // definition says.  The masking with hole filling must be the same as
+  // masking the filled depth values.
+  int test_hole_fill(realsense::hole_fill mode, size_t radius, size_t width, size_t height)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    worker_pool pool(3);
+
+    // Isolated invalid values and larger holes.
+    auto depth = random_depth(width * height);
+    std::uniform_int_distribution<size_t> dist(0, width * height - 1);
+    for (size_t i = 0; i < width * height / 50; ++i) {
+      auto p = dist(rng);
+      std::fill_n(&depth[p], std::min(7zu, width * height - p), uint16_t(0));
+    }
+    auto expected = reference_fill(depth, width, height, mode, radius);
+
+    int result = 0;
+    for (auto k : realsense::available_kernels())
+      for (auto p : { static_cast<worker_pool*>(nullptr), &pool }) {
+        realsense::hole_filler filler;
+        filler.configure(mode, radius);
+        auto out = filler.apply(depth.data(), width, height, *k, p);
+        if (! std::equal(expected.begin(), expected.end(), out)) {
+          std::cout << "FAIL: " << k->name << " " << fill_name(mode) << " radius " << radius << " differs for " << width << "x" << height
+                    << (p != nullptr ? " in parallel" : "") << std::endl;
+          result = 1;
+        }
+      }
+
+    realsense::depth_mask filling(realsense::video_format::rgba, 1, color);
+    realsense::depth_mask plain(realsense::video_format::rgba, 1, color);
+    filling.resize(width, height);
+    plain.resize(width, height);
+    filling.set_nworkers(pool.size());
+    plain.set_nworkers(pool.size());
+    filling.set_upper_limit(2500);
+    plain.set_upper_limit(2500);
+    filling.set_hole_fill(mode, radius);
+    const size_t framesize = filling.get_framesize();
+    std::vector<uint8_t> out(framesize);
+    std::vector<uint8_t> reference(framesize);
+    auto src = random_pixels(width * height * 3);
+    filling.process(out.data(), framesize, src.data(), depth.data());
+    plain.process(reference.data(), framesize, src.data(), expected.data());
+    if (out != reference) {
+      std::cout << "FAIL: masking with " << fill_name(mode) << " radius " << radius << " differs for " << width << "x" << height << std::endl;
+      result = 1;
+    }
+
+    return result;
+  }
+
+
+  const char* filter_name(realsense::depth_filter filter)
+  {
+    switch (filter) {
+    case realsense::depth_filter::average:
+      return "average";
+    case realsense::depth_filter::ema:
+      return "ema";
+    case realsense::depth_filter::median:
+      return "median";
+    }
+    return "?";
+  }
+
+
+  // Foreground decision of the moving average and the median, computed
+  // directly for each pixel.  The history length changes on the way.
+  struct reference_filter_mask {
+    reference_filter_mask(realsense::depth_filter filter_, size_t npixels_)
+    : filter(filter_), npixels(npixels_)
+    {
+      set_ndepth_history(1);
+    }
+
+    void set_ndepth_history(size_t n)
+    {
+      size_t window = n < 3 ? 1 : n < 5 ? 3 : 5;
+      if (acc.empty() || (filter == realsense::depth_filter::median && window != frames.size())) {
+        frames.assign(window, std::vector<uint16_t>(npixels, std::numeric_limits<uint16_t>::max()));
+        acc.assign(npixels, 0xffff * 16.0);
+        last = 0;
+      }
+      weight = std::round(512.0 / (n + 1)) / 256.0;
+    }
+
+    std::vector<bool> process(const uint16_t* depth, size_t limit)
+    {
+      std::vector<bool> res(npixels);
+      for (size_t i = 0; i < npixels; ++i) {
+        uint16_t d = depth[i] ?: std::numeric_limits<uint16_t>::max();
+        if (filter == realsense::depth_filter::ema) {
+          acc[i] = int64_t(acc[i]) + std::floor(((d * 16.0 - acc[i]) * weight * 256.0 + 128) / 256.0);
+          res[i] = std::floor((acc[i] + 8) / 16) <= limit;
+        } else {
+          frames[last][i] = d;
+          std::vector<uint16_t> v;
+          for (auto& f : frames)
+            v.push_back(f[i]);
+          std::ranges::sort(v);
+          res[i] = v[v.size() / 2] <= limit;
+        }
+      }
+      if (++last == frames.size())
+        last = 0;
+      return res;
+    }
+
+    realsense::depth_filter filter;
+    size_t npixels;
+    std::vector<std::vector<uint16_t>> frames;
+    size_t last = 0;
+    std::vector<double> acc;
+    double weight = 1.0;
+  };
+
+
+  // The moving average and the median must match the direct computation,
+  // for all kernels and in parallel, also when the history length changes.
+  // For the formats the reference does not handle and for the alpha matte
+  // the kernels are compared with each other.
+  int test_depth_filter(realsense::depth_filter filter, realsense::video_format format, size_t width, size_t height, size_t limit, bool matte)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    static const size_t sizes[] = { 1, 1, 3, 3, 3, 3, 8, 8, 8, 8, 8, 8, 4, 4, 2, 2, 5, 5, 5, 5, 16, 16 };
+    worker_pool pool(3);
+
+    auto kerns = realsense::available_kernels();
+    std::vector<realsense::depth_mask> masks;
+    for (size_t i = 0; i <= kerns.size(); ++i) {
+      masks.emplace_back(format, sizes[0], color);
+      masks.back().resize(width, height);
+      masks.back().set_nworkers(pool.size());
+      masks.back().set_upper_limit(limit);
+      masks.back().set_depth_filter(filter);
+      masks.back().set_kernels(*kerns[std::min(i, kerns.size() - 1)]);
+      masks.back().set_alpha_matte(matte);
+      masks.back().set_feather(100);
+    }
+    reference_filter_mask ref(filter, width * height);
+
+    const size_t framesize = masks.front().get_framesize();
+    std::vector<std::vector<uint8_t>> out(masks.size(), std::vector<uint8_t>(framesize));
+    const bool compare_ref = ! matte && ! realsense::is_yuv(format);
+    const size_t bpp = masks.front().get_bpp();
+
+    int result = 0;
+    for (size_t frame = 0; frame < std::size(sizes); ++frame) {
+      auto src = random_pixels(width * height * 3);
+      auto depth = random_depth(width * height);
+      // Stretches of stable values so that the moving average reaches them.
+      if (frame % 4 != 0 && frame > 0)
+        for (size_t i = 0; i < width * height; i += 3)
+          depth[i] = uint16_t(limit / 2 + i % 7);
+
+      for (size_t i = 0; i < masks.size(); ++i) {
+        masks[i].set_ndepth_history(sizes[frame]);
+        masks[i].process(out[i].data(), framesize, src.data(), depth.data(), i == kerns.size() ? &pool : nullptr);
+      }
+      ref.set_ndepth_history(sizes[frame]);
+      auto fg = ref.process(depth.data(), limit);
+
+      for (size_t i = 0; i + 1 < masks.size(); ++i)
+        if (out[i] != out.back()) {
+          std::cout << "FAIL: " << filter_name(filter) << " " << kerns[i]->name << " differs from parallel "
+                    << kerns.back()->name << " for " << width << "x" << height << " " << format_name(format)
+                    << (matte ? " matte" : "") << " limit " << limit << " frame " << frame << std::endl;
+          result = 1;
+        }
+
+      if (compare_ref)
+        for (size_t i = 0; i < width * height; ++i)
+          if (fg[i] != (std::memcmp(&out.back()[i * bpp], &src[i * 3], 3) == 0 && (bpp == 3 || out.back()[i * bpp + 3] == 0xff))
+              && std::memcmp(&src[i * 3], color, 3) != 0) {
+            std::cout << "FAIL: " << filter_name(filter) << " pixel " << i << " wrong for " << width << "x" << height
+                      << " " << format_name(format) << " limit " << limit << " frame " << frame << std::endl;
+            result = 1;
+            break;
+          }
+    }
+
+    return result;
+  }
+
+
+  // The median ignores a single frame of invalid values, the moving
+  // average does not.  Both settle on a stable value.
+  int test_depth_filter_outlier()
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    const size_t width = 64;
+    const size_t height = 2;
+
+    int result = 0;
+    for (auto [filter, keeps] : { std::pair(realsense::depth_filter::median, true), std::pair(realsense::depth_filter::ema, false) }) {
+      realsense::depth_mask mask(realsense::video_format::rgb, 3, color);
+      mask.resize(width, height);
+      mask.set_upper_limit(2500);
+      mask.set_depth_filter(filter);
+      std::vector<uint8_t> out(mask.get_framesize());
+      std::vector<uint8_t> src(width * height * 3, 0x01);
+      std::vector<uint16_t> near(width * height, 1000);
+      std::vector<uint16_t> invalid(width * height, 0);
+
+      for (size_t frame = 0; frame < 8; ++frame)
+        mask.process(out.data(), out.size(), src.data(), near.data());
+      if (out != src) {
+        std::cout << "FAIL: " << filter_name(filter) << " does not settle" << std::endl;
+        result = 1;
+      }
+      mask.process(out.data(), out.size(), src.data(), invalid.data());
+      if ((out == src) != keeps) {
+        std::cout << "FAIL: " << filter_name(filter) << (keeps ? " does not ignore" : " ignores") << " a single invalid frame" << std::endl;
+        result = 1;
+      }
+    }
+    return result;
+  }
+
+
+  // With the learned background a pixel is foreground if it is closer than
+  // the reference minus the margin and within the limit.  With a history of
+  // one frame all filters use the depth values directly.  All kernels must
+  // agree, also for longer histories, the alpha matte, and in parallel.
+  int test_background(realsense::depth_filter filter, realsense::video_format format, size_t width, size_t height, size_t margin, bool matte)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    const size_t limit = 4000;
+    worker_pool pool(3);
+
+    // The scene: a wall at 2000-3000 with invalid spots, learned from three
+    // frames of which two have more invalid values.
+    auto wall = random_depth(width * height);
+    for (auto& d : wall)
+      if (d != 0)
+        d = uint16_t(2000 + d % 1000);
+    auto wall2 = wall;
+    for (size_t i = 0; i < wall2.size(); i += 5)
+      wall2[i] = 0;
+
+    auto kerns = realsense::available_kernels();
+    std::vector<realsense::depth_mask> masks;
+    for (size_t i = 0; i <= kerns.size(); ++i) {
+      masks.emplace_back(format, 1, color);
+      masks.back().resize(width, height);
+      masks.back().set_nworkers(pool.size());
+      masks.back().set_upper_limit(limit);
+      masks.back().set_depth_filter(filter);
+      masks.back().set_kernels(*kerns[std::min(i, kerns.size() - 1)]);
+      masks.back().set_alpha_matte(matte);
+      masks.back().set_feather(100);
+      masks.back().set_background(true, margin);
+    }
+
+    const size_t framesize = masks.front().get_framesize();
+    std::vector<std::vector<uint8_t>> out(masks.size(), std::vector<uint8_t>(framesize));
+    const size_t bpp = masks.front().get_bpp();
+
+    int result = 0;
+    auto src = random_pixels(width * height * 3);
+    for (auto& m : masks) {
+      m.capture_background(3);
+      m.process(out[0].data(), framesize, src.data(), wall.data());
+      m.process(out[0].data(), framesize, src.data(), wall2.data());
+      m.process(out[0].data(), framesize, src.data(), wall2.data());
+      if (m.background.capturing() || ! m.background.ready(width, height)) {
+        std::cout << "FAIL: background capture not complete for " << width << "x" << height << std::endl;
+        return 1;
+      }
+    }
+    for (size_t i = 0; i < width * height; ++i)
+      if (masks.back().background.data()[i] != (i % 5 == 0 ? 0 : wall[i])) {
+        std::cout << "FAIL: background reference " << masks.back().background.data()[i] << " at " << i << " for " << width << "x" << height << std::endl;
+        return 1;
+      }
+
+    for (size_t frame = 0; frame < 8; ++frame) {
+      // Half the pixels in front of the wall, some within the margin.
+      auto depth = random_depth(width * height);
+      for (size_t i = 0; i < width * height; i += 2)
+        depth[i] = uint16_t(std::max(int(wall[i]) - int(margin) - 50 + int(i % 100), 0));
+
+      if (frame == 4)
+        for (auto& m : masks)
+          m.set_ndepth_history(5);
+      for (size_t i = 0; i < masks.size(); ++i)
+        masks[i].process(out[i].data(), framesize, src.data(), depth.data(), i == kerns.size() ? &pool : nullptr);
+
+      for (size_t i = 0; i + 1 < masks.size(); ++i)
+        if (out[i] != out.back()) {
+          std::cout << "FAIL: " << filter_name(filter) << " background " << kerns[i]->name << " differs from parallel "
+                    << kerns.back()->name << " for " << width << "x" << height << " " << format_name(format)
+                    << (matte ? " matte" : "") << " margin " << margin << " frame " << frame << std::endl;
+          result = 1;
+        }
+
+      if (frame < 4 && ! matte && ! realsense::is_yuv(format))
+        for (size_t i = 0; i < width * height; ++i) {
+          uint16_t d = depth[i] ?: 0xffff;
+          uint16_t r = i % 5 == 0 ? 0xffff : wall[i] ?: 0xffff;
+          bool fg = d <= std::min(r > margin ? r - margin : 0zu, limit);
+          if (fg != (std::memcmp(&out.back()[i * bpp], &src[i * 3], 3) == 0 && (bpp == 3 || out.back()[i * bpp + 3] == 0xff))
+              && std::memcmp(&src[i * 3], color, 3) != 0) {
+            std::cout << "FAIL: " << filter_name(filter) << " background pixel " << i << " wrong for " << width << "x" << height
+                      << " " << format_name(format) << " margin " << margin << " frame " << frame << std::endl;
+            result = 1;
+            break;
+          }
+        }
+    }
+
+    return result;
+  }
+
+
+  // The reference survives saving and loading, other depth scales and
+  // broken files are rejected.  A failed save leaves no temporary file.
+  int test_background_file()
+  {
+    const char fname[] = "testmask-background.bin";
+    const size_t width = 93;
+    const size_t height = 7;
+
+    realsense::background_model model;
+    model.start_capture(width, height, 1);
+    auto depth = random_depth(width * height);
+    model.add(depth.data());
+
+    int result = 0;
+    realsense::background_model loaded;
+    if (! model.save(fname, 0.001f) || ! loaded.load(fname, 0.001f) || ! loaded.ready(width, height)
+        || ! std::equal(depth.begin(), depth.end(), loaded.data())) {
+      std::cout << "FAIL: background model does not survive saving" << std::endl;
+      result = 1;
+    }
+    realsense::background_model other;
+    if (other.load(fname, 0.0001f)) {
+      std::cout << "FAIL: background model with another depth scale loaded" << std::endl;
+      result = 1;
+    }
+    std::filesystem::resize_file(fname, 100);
+    if (other.load(fname, 0.001f)) {
+      std::cout << "FAIL: truncated background model loaded" << std::endl;
+      result = 1;
+    }
+    // A directory cannot be replaced by the file.
+    std::filesystem::remove(fname);
+    std::filesystem::create_directory(fname);
+    if (model.save(fname, 0.001f) || std::filesystem::exists(std::string(fname) + ".tmp")) {
+      std::cout << "FAIL: failed save of the background model leaves a temporary file" << std::endl;
+      result = 1;
+    }
+    std::filesystem::remove(fname);
+    std::filesystem::remove(std::string(fname) + ".tmp");
+    return result;
+  }
+
+  // With the region of interest the output must be the same as without as
+  // long as nothing appears outside the region.  An object which enters
+  // outside is picked up by the periodic evaluation of the whole frame.
+  int test_roi(realsense::depth_filter filter, realsense::video_format format, size_t width, size_t height, bool matte, realsense::cleanup_op op, size_t nworkers)
+  {
+    static const unsigned char color[4] = { 0x00, 0xb1, 0x40, 0x00 };
+    const size_t limit = 4000;
+    worker_pool pool(nworkers);
+
+    realsense::depth_mask masks[2] = { { format, 4, color }, { format, 4, color } };
+    for (auto& m : masks) {
+      m.resize(width, height);
+      m.set_nworkers(nworkers);
+      m.set_upper_limit(limit);
+      m.set_depth_filter(filter);
+      m.set_alpha_matte(matte);
+      m.set_feather(100);
+      m.set_cleanup(op, 2);
+    }
+    masks[1].set_roi(true);
+
+    const size_t framesize = masks[0].get_framesize();
+    std::vector<uint8_t> out[2] = { std::vector<uint8_t>(framesize), std::vector<uint8_t>(framesize) };
+
+    // The background, including the invalid values, is beyond the limit.
+    // The first object is always there, the second enters later.
+    auto in_first = [&](size_t x, size_t y) { return y >= height / 4 && y < height / 2 && x >= width / 3 && x < width / 2; };
+    auto in_second = [&](size_t x, size_t y) { return y >= 3 * height / 4 && x >= 3 * width / 4; };
+    const size_t enter = 40;
+    const size_t settled = enter + 3 * realsense::depth_mask::roi_rescan_interval;
+    std::uniform_int_distribution<unsigned> near(500, 2500);
+    std::uniform_int_distribution<unsigned> far(4500, 6000);
+
+    int result = 0;
+    bool skipped = false;
+    for (size_t frame = 0; frame < settled + 10; ++frame) {
+      auto src = random_pixels(width * height * 3);
+      std::vector<uint16_t> depth(width * height);
+      for (size_t y = 0; y < height; ++y)
+        for (size_t x = 0; x < width; ++x) {
+          auto& d = depth[y * width + x];
+          if (in_first(x, y) || (frame >= enter && in_second(x, y)))
+            d = uint16_t(near(rng));
+          else
+            d = (x + y + frame) % 7 == 0 ? 0 : uint16_t(far(rng));
+        }
+
+      for (size_t i = 0; i < 2; ++i)
+        masks[i].process(out[i].data(), framesize, src.data(), depth.data(), nworkers > 1 ? &pool : nullptr);
+      skipped |= masks[1].get_evaluated_pixels() < width * height;
+
+      if ((frame < enter || frame >= settled) && out[0] != out[1]) {
+        std::cout << "FAIL: " << filter_name(filter) << " region of interest differs for " << width << "x" << height << " "
+                  << format_name(format) << (matte ? " matte" : "") << " " << cleanup_name(op) << " with " << nworkers
+                  << " workers frame " << frame << std::endl;
+        return 1;
+      }
+    }
+    if (! skipped) {
+      std::cout << "FAIL: " << filter_name(filter) << " region of interest always covers the whole frame for " << width << "x" << height
+                << " " << format_name(format) << std::endl;
+      result = 1;
+    }
+
+    return result;
+  }
+
+
+  // Box blur with the pixels beyond the border repeating the last pixel:
+  // the rounded averages of the rows, and of these the rounded averages
+  // of the columns.
+  std::vector<uint8_t> reference_blur(const std::vector<uint8_t>& src, size_t width, size_t height, size_t radius)
+  {
+    const auto r = ptrdiff_t(radius);
+    const size_t size = 2 * radius + 1;
+    auto average = [&](const std::vector<uint8_t>& in, bool vertical) {
+      std::vector<uint8_t> res(in.size());
+      for (ptrdiff_t y = 0; y < ptrdiff_t(height); ++y)
+        for (ptrdiff_t x = 0; x < ptrdiff_t(width); ++x)
+          for (size_t c = 0; c < 3; ++c) {
+            size_t sum = 0;
+            for (auto d = -r; d <= r; ++d) {
+              auto sy = vertical ? size_t(std::clamp(y + d, ptrdiff_t(0), ptrdiff_t(height) - 1)) : size_t(y);
+              auto sx = vertical ? size_t(x) : size_t(std::clamp(x + d, ptrdiff_t(0), ptrdiff_t(width) - 1));
+              sum += in[(sy * width + sx) * 3 + c];
+            }
+            res[(size_t(y) * width + size_t(x)) * 3 + c] = uint8_t((sum + size / 2) / size);
+          }
+      return res;
+    };
+    return average(average(src, false), true);
+  }
+
+
+  // The foreground composited over the backdrop must match the camera
+  // pixels mixed with the backdrop by the alpha values of RGBA output
+  // with a transparent background color, in all output formats, for all
+  // kernels, and with workers.
+  int test_backdrop(realsense::video_format format, size_t width, size_t height, realsense::backdrop_mode mode, bool matte, size_t nworkers)
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    const size_t radius = 3;
+    worker_pool pool(nworkers);
+    auto image = random_pixels(width * height * 3);
+
+    int result = 0;
+    for (auto k : realsense::available_kernels()) {
+      realsense::depth_mask mask(format, 3, color);
+      realsense::depth_mask plain(realsense::video_format::rgba, 3, color);
+      for (auto m : { &mask, &plain }) {
+        m->resize(width, height);
+        m->set_nworkers(nworkers);
+        m->set_upper_limit(2500);
+        m->set_alpha_matte(matte);
+        m->set_feather(500);
+        m->set_kernels(*k);
+      }
+      mask.set_backdrop(mode, radius);
+      if (mode == realsense::backdrop_mode::image)
+        mask.set_backdrop_image(image.data(), width, height);
+
+      const size_t framesize = mask.get_framesize();
+      std::vector<uint8_t> out(framesize);
+      std::vector<uint8_t> expected(framesize);
+      std::vector<uint8_t> alpha(width * height * 4);
+      std::vector<uint8_t> rgb(width * height * 3);
+
+      for (size_t frame = 0; frame < 5; ++frame) {
+        auto src = random_pixels(width * height * 3);
+        auto depth = random_depth(width * height);
+        mask.process(out.data(), framesize, src.data(), depth.data(), nworkers > 1 ? &pool : nullptr);
+        plain.process(alpha.data(), alpha.size(), src.data(), depth.data());
+
+        auto back = mode == realsense::backdrop_mode::image ? image : reference_blur(src, width, height, radius);
+        for (size_t i = 0; i < width * height; ++i) {
+          unsigned a = alpha[4 * i + 3];
+          for (size_t c = 0; c < 3; ++c)
+            rgb[3 * i + c] = uint8_t((src[3 * i + c] * a + back[3 * i + c] * (255 - a) + 127) / 255);
+        }
+        if (realsense::is_yuv(format))
+          reference_yuv(expected.data(), rgb.data(), width, height, format == realsense::video_format::nv12);
+        else
+          for (size_t i = 0; i < width * height; ++i) {
+            std::memcpy(&expected[i * mask.get_bpp()], &rgb[3 * i], 3);
+            if (mask.get_bpp() == 4)
+              expected[4 * i + 3] = 0xff;
+          }
+
+        if (out != expected) {
+          std::cout << "FAIL: " << k->name << (mode == realsense::backdrop_mode::image ? " image" : " blur") << " backdrop differs for "
+                    << width << "x" << height << " " << format_name(format) << (matte ? " matte" : "") << " with " << nworkers
+                    << " workers frame " << frame << std::endl;
+          result = 1;
+        }
+      }
+    }
+
+    return result;
+  }
+
+
+  // An image of another size is scaled to cover the frame and centered.
+  // A uniform image stays uniform, the middle of a twice as wide image
+  // fills the frame.
+  int test_backdrop_scale()
+  {
+    static const unsigned char color[4] = { 0xdd, 0x44, 0xff, 0x00 };
+    const size_t width = 64;
+    const size_t height = 48;
+
+    // Left quarter red, middle half gray, right quarter blue.
+    std::vector<uint8_t> image(2 * width * height * 3);
+    for (size_t y = 0; y < height; ++y)
+      for (size_t x = 0; x < 2 * width; ++x) {
+        auto p = &image[(y * 2 * width + x) * 3];
+        if (x < width / 2)
+          p[0] = 0xff;
+        else if (x >= width / 2 + width)
+          p[2] = 0xff;
+        else
+          std::memset(p, 0x80, 3);
+      }
+
+    realsense::depth_mask mask(realsense::video_format::rgb, 1, color);
+    mask.resize(width, height);
+    mask.set_upper_limit(1000);
+    mask.set_backdrop(realsense::backdrop_mode::image, 0);
+    mask.set_backdrop_image(image.data(), 2 * width, height);
+
+    std::vector<uint8_t> src(width * height * 3);
+    std::vector<uint16_t> depth(width * height, 5000);
+    std::vector<uint8_t> out(mask.get_framesize());
+    mask.process(out.data(), out.size(), src.data(), depth.data());
+
+    for (auto v : out)
+      if (v != 0x80) {
+        std::cout << "FAIL: scaled backdrop image is not the middle of the image" << std::endl;
+        return 1;
+      }
+    return 0;
+  }
+
+
+  // Changing the length of the history within the allocated size must not
+  // allocate, the frames must start at cache line boundaries.
+  int test_history_allocation()
+  {
+    static const unsigned char color[4] = { 0x10, 0x20, 0x30, 0x40 };
+
+    realsense::depth_mask mask(realsense::video_format::rgba, 4, color);
+    mask.resize(93, 7);
+    auto history = mask.depth_history.get();
+
+    int result = 0;
+    for (auto n : { 2zu, 9zu, 1zu, 16zu }) {
+      mask.set_ndepth_history(n);
+      if (mask.depth_history.get() != history) {
+        std::cout << "FAIL: changing the history length to " << n << " reallocates" << std::endl;
+        result = 1;
+      }
+      for (size_t i = 0; i < n; ++i)
+        if (reinterpret_cast<uintptr_t>(mask.history_frame(i)) % 64 != 0) {
+          std::cout << "FAIL: history frame " << i << " of " << n << " is not aligned" << std::endl;
+          result = 1;
+        }
+    }
+    return result;
+  }
+
+
+  realsense::intrinsics pinhole(size_t width, size_t height, float ppx, float ppy, float f)
+  {
+    return { width, height, ppx, ppy, f, f, realsense::distortion::none, {} };
+  }
+
+
+  // With identical cameras all alignment engines must reproduce the depth frame.
+  int test_align_identity(realsense::align_engine engine, size_t nworkers)
+  {
+    const size_t width = 93;
+    const size_t height = 37;
+    auto intrin = pinhole(width, height, 46.0f, 18.0f, 60.0f);
+    realsense::extrinsics extr = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0, 0, 0 } };
+
+    worker_pool pool(nworkers);
+    realsense::depth_aligner aligner;
+    aligner.configure(engine, intrin, intrin, extr, 0.001f, 1.0f);
+
+    auto depth = random_depth(width * height);
+    std::vector<uint16_t> out(width * height);
+    aligner.process(out.data(), depth.data(), &pool);
+
+    if (out != depth) {
+      std::cout << "FAIL: alignment engine " << int(engine) << " with " << nworkers << " workers changes the depth frame" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+
+  // For objects at the cutoff distance the lookup table and the rays must
+  // agree, also with the color camera offset and at twice the resolution.
+  int test_align_plane()
+  {
+    auto depth_intrin = pinhole(160, 120, 80.0f, 60.0f, 120.0f);
+    auto color_intrin = pinhole(320, 240, 160.5f, 120.5f, 240.0f);
+    realsense::extrinsics extr = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0.015f, 0.002f, 0 } };
+    const float depth_scale = 0.0001f;
+
+    // Between 1.0m and 1.005m, the parallax difference is below a tenth of a pixel.
+    std::vector<uint16_t> depth(depth_intrin.width * depth_intrin.height);
+    for (size_t i = 0; i < depth.size(); ++i)
+      depth[i] = uint16_t(10000 + i % 50);
+
+    realsense::depth_aligner lookup;
+    realsense::depth_aligner rays;
+    lookup.configure(realsense::align_engine::lookup, depth_intrin, color_intrin, extr, depth_scale, 1.0f);
+    rays.configure(realsense::align_engine::rays, depth_intrin, color_intrin, extr, depth_scale, 1.0f);
+
+    std::vector<uint16_t> out_lookup(color_intrin.width * color_intrin.height);
+    std::vector<uint16_t> out_rays(out_lookup.size());
+    lookup.process(out_lookup.data(), depth.data());
+    rays.process(out_rays.data(), depth.data());
+
+    size_t ndiff = 0;
+    for (size_t i = 0; i < out_lookup.size(); ++i)
+      ndiff += out_lookup[i] != out_rays[i];
+    if (ndiff > out_lookup.size() / 100) {
+      std::cout << "FAIL: lookup table and rays differ in " << ndiff << " of " << out_lookup.size() << " pixels" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+
+  // Once the first frames are processed, with the background learned and the
+  // aligner configured, processing a frame must not allocate, neither must
+  // growing the history to the maximum or the pool in the middle.
+  int test_steady_state_allocation(realsense::depth_filter filter, realsense::video_format format, size_t nworkers, realsense::align_engine engine, bool extras)
+  {
+    static const unsigned char color[4] = { 0x00, 0xb1, 0x40, 0x00 };
+    const size_t width = 93;
+    const size_t height = 77;
+    const size_t warmup = 10;
+    const size_t nframes = 20;
+    worker_pool pool(nworkers);
+
+    realsense::depth_mask mask(format, 4, color);
+    mask.resize(width, height);
+    mask.set_upper_limit(4000);
+    mask.set_depth_filter(filter);
+    if (extras) {
+      mask.set_hole_fill(realsense::hole_fill::median, 2);
+      mask.set_cleanup(realsense::cleanup_op::close, 2);
+      mask.set_roi(true);
+      mask.set_background(true, 100);
+      mask.capture_background(warmup / 2);
+      if (format == realsense::video_format::rgba) {
+        mask.set_alpha_matte(true);
+        mask.set_feather(100);
+      }
+      mask.set_backdrop(realsense::backdrop_mode::blur, 4);
+    }
+
+    auto intrin = pinhole(width, height, 46.0f, 38.0f, 60.0f);
+    realsense::extrinsics extr = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0.015f, 0, 0 } };
+    realsense::depth_aligner aligner;
+    aligner.configure(engine, intrin, intrin, extr, 0.001f, 1.0f);
+
+    // All input is created up front.
+    std::vector<std::vector<uint8_t>> src;
+    std::vector<std::vector<uint16_t>> depth;
+    for (size_t i = 0; i < 4; ++i) {
+      src.push_back(random_pixels(width * height * 3));
+      depth.push_back(random_depth(width * height));
+    }
+    std::vector<uint16_t> aligned(width * height);
+    std::vector<uint8_t> out(mask.get_framesize());
+
+    uint64_t before = 0;
+    for (size_t frame = 0; frame < warmup + nframes; ++frame) {
+      if (frame == warmup)
+        before = nallocs.load();
+      if (frame == warmup + nframes / 2) {
+        mask.set_ndepth_history(realsense::depth_mask::max_ndepth_history);
+        // The mask starts with one worker like a device before its pool is
+        // set.  Only the setter may allocate for the larger pool.
+        auto n = nallocs.load();
+        mask.set_nworkers(nworkers);
+        before += nallocs.load() - n;
+      }
+      auto maskpool = nworkers > 1 && frame >= warmup + nframes / 2 ? &pool : nullptr;
+      aligner.process(aligned.data(), depth[frame % depth.size()].data(), nworkers > 1 ? &pool : nullptr);
+      mask.process(out.data(), out.size(), src[frame % src.size()].data(), aligned.data(), maskpool);
+    }
+
+    if (auto n = nallocs.load() - before; n != 0) {
+      std::cout << "FAIL: " << filter_name(filter) << " " << format_name(format) << (extras ? " with all stages" : "")
+                << " with " << nworkers << " workers allocates " << n << " times in " << nframes << " frames" << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+} // anonymous namespace
+
+
+int main()
+{
+  int result = 0;
+
+  for (auto k : realsense::available_kernels())
+    std::cout << "kernel " << k->name << std::endl;
+
+  for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12, realsense::video_format::i420 })
+    for (auto [width, height] : { std::pair(64zu, 4zu), std::pair(93zu, 7zu), std::pair(640zu, 48zu) })
+      for (auto ndepth_history : { 1zu, 2zu, 3zu, 4zu, 7zu, 16zu })
+        for (auto limit : { 0zu, 1000zu, 2500zu, 4000zu, 65535zu, 100000zu })
+          result |= test_kernels(format, width, height, ndepth_history, limit);
+
+  for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12, realsense::video_format::i420 })
+    for (auto limit : { 0zu, 1500zu, 2500zu, 4000zu, 65535zu })
+      result |= test_history(format, 317, 11, limit);
+
+  for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12, realsense::video_format::i420 })
+    for (auto nworkers : { 1zu, 2zu, 3zu, 8zu })
+      for (auto [width, height] : { std::pair(64zu, 3zu), std::pair(93zu, 77zu), std::pair(640zu, 480zu) })
+        result |= test_pool(format, width, height, nworkers);
+
+  for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba })
+    for (auto [width, height] : { std::pair(64zu, 4zu), std::pair(93zu, 7zu), std::pair(640zu, 48zu) })
+      result |= test_in_place(format, width, height);
+
+  for (auto [width, height] : { std::pair(64zu, 4zu), std::pair(93zu, 7zu), std::pair(640zu, 48zu) })
+    for (auto ndepth_history : { 1zu, 4zu, 7zu })
+      for (auto feather : { 0zu, 1zu, 100zu, 500zu })
+        result |= test_matte(width, height, ndepth_history, feather);
+
+  for (auto [width, height] : { std::pair(1zu, 1zu), std::pair(16zu, 16zu), std::pair(93zu, 7zu), std::pair(67zu, 45zu), std::pair(640zu, 48zu) })
+    for (auto op : { realsense::cleanup_op::erode, realsense::cleanup_op::dilate, realsense::cleanup_op::open, realsense::cleanup_op::close })
+      for (auto radius : { 1zu, 2zu, 5zu, 16zu })
+        for (auto nworkers : { 1zu, 3zu })
+          result |= test_cleanup(width, height, op, radius, nworkers);
+
+  for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12, realsense::video_format::i420 })
+    for (auto [width, height] : { std::pair(93zu, 7zu), std::pair(640zu, 48zu) })
+      result |= test_cleanup_mask(format, width, height);
+
+  for (auto mode : { realsense::hole_fill::nearest, realsense::hole_fill::min, realsense::hole_fill::median })
+    for (auto radius : { 1zu, 2zu, 4zu })
+      for (auto [width, height] : { std::pair(1zu, 1zu), std::pair(5zu, 3zu), std::pair(93zu, 7zu), std::pair(640zu, 48zu) })
+        result |= test_hole_fill(mode, radius, width, height);
+
+  for (auto filter : { realsense::depth_filter::ema, realsense::depth_filter::median })
+    for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12 })
+      for (auto [width, height] : { std::pair(1zu, 1zu), std::pair(93zu, 7zu), std::pair(640zu, 48zu) })
+        for (auto limit : { 0zu, 2500zu, 65535zu })
+          for (auto matte : { false, true })
+            if (! matte || format == realsense::video_format::rgba)
+              result |= test_depth_filter(filter, format, width, height, limit, matte);
+  result |= test_depth_filter_outlier();
+
+  for (auto filter : { realsense::depth_filter::average, realsense::depth_filter::ema, realsense::depth_filter::median })
+    for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12 })
+      for (auto [width, height] : { std::pair(1zu, 1zu), std::pair(93zu, 7zu), std::pair(640zu, 48zu) })
+        for (auto margin : { 0zu, 100zu })
+          for (auto matte : { false, true })
+            if (! matte || format == realsense::video_format::rgba)
+              result |= test_background(filter, format, width, height, margin, matte);
+  result |= test_background_file();
+
+  for (auto filter : { realsense::depth_filter::average, realsense::depth_filter::ema, realsense::depth_filter::median })
+    for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12, realsense::video_format::i420 })
+      for (auto [width, height, nworkers] : { std::tuple(93zu, 77zu, 1zu), std::tuple(640zu, 48zu, 3zu) })
+        for (auto op : { realsense::cleanup_op::none, realsense::cleanup_op::close })
+          for (auto matte : { false, true })
+            if (! matte || format == realsense::video_format::rgba)
+              result |= test_roi(filter, format, width, height, matte, op, nworkers);
+
+  for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12, realsense::video_format::i420 })
+    for (auto mode : { realsense::backdrop_mode::image, realsense::backdrop_mode::blur })
+      for (auto [width, height, nworkers] : { std::tuple(1zu, 1zu, 1zu), std::tuple(93zu, 7zu, 1zu), std::tuple(67zu, 45zu, 3zu) })
+        for (auto matte : { false, true })
+          if (! matte || format == realsense::video_format::rgba)
+            result |= test_backdrop(format, width, height, mode, matte, nworkers);
+  result |= test_backdrop_scale();
+
+  result |= test_history_allocation();
+
+  for (auto engine : { realsense::align_engine::rays, realsense::align_engine::lookup })
+    for (auto nworkers : { 1zu, 3zu })
+      result |= test_align_identity(engine, nworkers);
+  result |= test_align_plane();
+
+  for (auto filter : { realsense::depth_filter::average, realsense::depth_filter::ema, realsense::depth_filter::median })
+    for (auto format : { realsense::video_format::rgb, realsense::video_format::rgba, realsense::video_format::nv12, realsense::video_format::i420 })
+      for (auto [nworkers, engine] : { std::pair(1zu, realsense::align_engine::rays), std::pair(3zu, realsense::align_engine::lookup) })
+        for (auto extras : { false, true })
+          result |= test_steady_state_allocation(filter, format, nworkers, engine, extras);
+
+  if (result == 0)
+    std::cout << "all tests passed" << std::endl;
+
+  return result;
+}
@@ -1,4 +1,5 @@
 #include <array>
+#include <cstdio>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
@@ -109,8 +110,10 @@ namespace {
       std::string serial;
       long width = -1;
       long height = -1;
+      int fps = 0;
+      std::string depth_resolution;
       while (true) {
-        auto opt = getopt(argc, argv, "s:w:h:f:");
+        auto opt = getopt(argc, argv, "s:w:h:f:t:o:F:d:a:ib:");
         if (opt == -1)
           break;
         switch (opt) {
@@ -126,16 +129,46 @@ namespace {
         case 'f':
           cam.set_ndepth_history(std::atoi(optarg));
           break;
+        case 't':
+          cam.set_nworkers(std::atoi(optarg));
+          break;
+        case 'o':
+          cam.set_record(optarg);
+          break;
+        case 'a':
+          if (strcmp(optarg, "rays") == 0)
+            cam.set_align_engine(realsense::align_engine::rays);
+          else if (strcmp(optarg, "lookup") == 0)
+            cam.set_align_engine(realsense::align_engine::lookup);
+          else
+            cam.set_align_engine(realsense::align_engine::librealsense);
+          break;
+        case 'i':
+          cam.set_in_place(true);
+          break;
+        case 'b':
+          // Blurred camera frame as background with the given radius.
+          cam.set_backdrop(realsense::backdrop_mode::blur, size_t(std::atoi(optarg)));
+          break;
+        case 'F':
+          fps = std::atoi(optarg);
+          break;
+        case 'd':
+          // WIDTHxHEIGHT
+          if (long dw, dh; sscanf(optarg, "%ldx%ld", &dw, &dh) == 2)
+            depth_resolution = std::to_string(dw) + " × " + std::to_string(dh);
+          break;
         }
       }
 
-      if (! serial.empty() || width != -1 || height != -1) {
+      if (! serial.empty() || width != -1 || height != -1 || fps != 0 || ! depth_resolution.empty()) {
         bool found = false;
-        for (const auto& d : cam.available)
+        realsense::device_catalog::get().wait_ready();
+        for (const auto& d : cam.get_available())
           if ((serial.empty() || std::get<4>(d) == serial) &&
               (width == -1 || std::get<1>(d) == size_t(width)) &&
               (height == -1 || std::get<2>(d) == size_t(height))) {
-            cam.new_config(std::get<4>(d), std::get<3>(d));
+            cam.new_config(std::get<4>(d), std::get<3>(d), fps, depth_resolution);
             found = true;
             break;
           }
@@ -143,6 +176,11 @@ namespace {
           throw std::runtime_error("did not find matching device");
       }
 
+      // The window has the size of the camera's frames.
+      cam.open();
+      if (! cam.wait_started())
+        throw std::runtime_error("cannot start camera: " + cam.get_error());
+
       activate();
       return 0;
     }
@@ -164,12 +202,30 @@ namespace {
 int main(int argc, char* argv[])
 {
   bool transparent = false;
-  realsense::greenscreen cam(transparent ? realsense::video_format::rgba : realsense::video_format::rgb);
+
+  // Play back a recording instead of using a camera, with -R as fast as possible.
+  std::string replay;
+  bool realtime = true;
+  if (argc > 2 && (strcmp(argv[1], "-r") == 0 || strcmp(argv[1], "-R") == 0)) {
+    replay = argv[2];
+    realtime = argv[1][1] == 'r';
+    argv[2] = argv[0];
+    argc -= 2;
+    argv += 2;
+  }
+
+  realsense::greenscreen cam(transparent ? realsense::video_format::rgba : realsense::video_format::rgb, replay, realtime);
 
   if (argc > 1 && strcmp(argv[1], "-l") == 0) {
-    for (const auto& d : cam.available) {
-      std::cout << "serial=" << std::get<4>(d) << "  width=" << std::setw(4) << std::get<1>(d) << "  height=" << std::setw(4) << std::get<2>(d) << std::endl;
+    realsense::device_catalog::get().wait_ready();
+    for (const auto& d : cam.get_available()) {
+      std::cout << "serial=" << std::get<4>(d) << "  width=" << std::setw(4) << std::get<1>(d) << "  height=" << std::setw(4) << std::get<2>(d) << "  fps=";
+      for (auto fps : std::get<5>(d))
+        std::cout << ' ' << fps;
+      std::cout << std::endl;
     }
+    for (const auto& d : cam.get_available_depth())
+      std::cout << "serial=" << std::get<0>(d) << "  depth width=" << std::setw(4) << std::get<1>(d) << "  height=" << std::setw(4) << std::get<2>(d) << std::endl;
     return 0;
   }
 
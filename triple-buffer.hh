@@ -0,0 +1,125 @@
+#ifndef _TRIPLE_BUFFER_HH
+#define _TRIPLE_BUFFER_HH 1
+
+#include <atomic>
+#include <cstdint>
+
+
+// Hand-over of objects from one producer thread to one consumer thread
+// without locks.  The producer always has a slot to write into and never
+// waits.  The consumer always gets the most recent object.  If the producer
+// is faster than the consumer the unconsumed object is overwritten and
+// counted as dropped.
+template<typename T>
+struct triple_buffer {
+  struct stats_type {
+    uint64_t published;
+    uint64_t consumed;
+    uint64_t dropped;
+    // Number of published but not yet consumed objects, zero or one.
+    unsigned depth;
+  };
+
+  // Producer interface.  Fill in the object returned by back() and then call
+  // publish().
+  T& back() { return slots[back_idx]; }
+  void publish();
+
+  // Consumer interface.  After update() or wait() returned true front()
+  // contains the new object.  It stays unchanged until the next call.
+  T& front() { return slots[front_idx]; }
+  const T& front() const { return slots[front_idx]; }
+  bool update();
+  // Block until a new object is available.  Returns false if the buffer is
+  // closed.
+  bool wait();
+
+  // Wake up the consumer and make all future wait() calls return false.
+  void close();
+  bool closed() const { return state.load(std::memory_order_relaxed) & closed_bit; }
+
+  stats_type stats() const;
+
+private:
+  // The state contains the index of the middle slot, the bit which tells
+  // whether it contains a new object, and the closed bit.
+  static constexpr uint8_t index_mask = 3;
+  static constexpr uint8_t fresh_bit = 4;
+  static constexpr uint8_t closed_bit = 8;
+
+  T slots[3];
+  uint8_t back_idx = 0;
+  uint8_t front_idx = 1;
+  std::atomic<uint8_t> state = 2;
+
+  std::atomic<uint64_t> npublished = 0;
+  std::atomic<uint64_t> nconsumed = 0;
+  std::atomic<uint64_t> ndropped = 0;
+};
+
+
+template<typename T>
+void triple_buffer<T>::publish()
+{
+  auto old = state.load(std::memory_order_relaxed);
+  while (! state.compare_exchange_weak(old, uint8_t(back_idx | fresh_bit | (old & closed_bit)), std::memory_order_acq_rel))
+    ;
+  back_idx = old & index_mask;
+
+  npublished.fetch_add(1, std::memory_order_relaxed);
+  if (old & fresh_bit)
+    ndropped.fetch_add(1, std::memory_order_relaxed);
+
+  state.notify_one();
+}
+
+
+template<typename T>
+bool triple_buffer<T>::update()
+{
+  auto old = state.load(std::memory_order_acquire);
+  while (old & fresh_bit)
+    if (state.compare_exchange_weak(old, uint8_t(front_idx | (old & closed_bit)), std::memory_order_acq_rel)) {
+      front_idx = old & index_mask;
+      nconsumed.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  return false;
+}
+
+
+template<typename T>
+bool triple_buffer<T>::wait()
+{
+  while (true) {
+    if (update())
+      return true;
+    auto cur = state.load(std::memory_order_acquire);
+    if (cur & closed_bit)
+      return false;
+    if ((cur & fresh_bit) == 0)
+      state.wait(cur, std::memory_order_acquire);
+  }
+}
+
+
+template<typename T>
+void triple_buffer<T>::close()
+{
+  state.fetch_or(closed_bit, std::memory_order_acq_rel);
+  state.notify_all();
+}
+
+
+template<typename T>
+typename triple_buffer<T>::stats_type triple_buffer<T>::stats() const
+{
+  return {
+    npublished.load(std::memory_order_relaxed),
+    nconsumed.load(std::memory_order_relaxed),
+    ndropped.load(std::memory_order_relaxed),
+    (state.load(std::memory_order_relaxed) & fresh_bit) ? 1u : 0u
+  };
+}
+
+#endif // triple-buffer.hh
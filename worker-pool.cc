@@ -0,0 +1,76 @@
+#include <algorithm>
+
+#include "worker-pool.hh"
+
+
+worker_pool::worker_pool(size_t nworkers_)
+: nworkers(std::max(nworkers_, 1zu)), ranges(new range_type[nworkers])
+{
+  for (size_t i = 1; i < nworkers; ++i)
+    threads.emplace_back([this, i]{ thread_main(i); });
+}
+
+
+worker_pool::~worker_pool()
+{
+  terminate = true;
+  generation.fetch_add(1, std::memory_order_release);
+  generation.notify_all();
+
+  for (auto& t : threads)
+    t.join();
+}
+
+
+void worker_pool::run_bands(size_t nbands, void (*fn_)(void*, size_t, size_t), void* arg_)
+{
+  if (nworkers == 1 || nbands <= 1) {
+    for (size_t band = 0; band < nbands; ++band)
+      fn_(arg_, band, 0);
+    return;
+  }
+
+  for (size_t i = 0; i < nworkers; ++i) {
+    ranges[i].next.store(i * nbands / nworkers, std::memory_order_relaxed);
+    ranges[i].end = (i + 1) * nbands / nworkers;
+  }
+  fn = fn_;
+  arg = arg_;
+  active.store(nworkers - 1, std::memory_order_relaxed);
+
+  generation.fetch_add(1, std::memory_order_release);
+  generation.notify_all();
+
+  work(0);
+
+  for (auto a = active.load(std::memory_order_acquire); a != 0; a = active.load(std::memory_order_acquire))
+    active.wait(a, std::memory_order_acquire);
+}
+
+
+void worker_pool::work(size_t worker)
+{
+  // Start with the own range, then help the others.
+  for (size_t k = 0; k < nworkers; ++k) {
+    auto& r = ranges[(worker + k) % nworkers];
+    for (auto band = r.next.fetch_add(1, std::memory_order_relaxed); band < r.end; band = r.next.fetch_add(1, std::memory_order_relaxed))
+      fn(arg, band, worker);
+  }
+}
+
+
+void worker_pool::thread_main(size_t worker)
+{
+  uint64_t seen = 0;
+  while (true) {
+    generation.wait(seen, std::memory_order_acquire);
+    seen = generation.load(std::memory_order_acquire);
+    if (terminate)
+      break;
+
+    work(worker);
+
+    if (active.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      active.notify_one();
+  }
+}
@@ -0,0 +1,61 @@
+#ifndef _WORKER_POOL_HH
+#define _WORKER_POOL_HH 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+// Persistent set of threads to process the bands of a frame in parallel.
+// The calling thread takes part in the work, a pool of size one therefore
+// uses no additional thread.  Each worker first processes a contiguous
+// range of bands and then steals bands from the ranges of the other workers
+// which have not been started yet.
+struct worker_pool {
+  explicit worker_pool(size_t nworkers_);
+  ~worker_pool();
+
+  size_t size() const { return nworkers; }
+
+  // Call F(band, worker) for all bands in [0, NBANDS) and wait for all
+  // calls to finish.  WORKER is in [0, size()).
+  template<typename F>
+  void run(size_t nbands, F&& f)
+  {
+    using fn_type = std::remove_reference_t<F>;
+    run_bands(nbands, [](void* a, size_t band, size_t worker){ (*static_cast<fn_type*>(a))(band, worker); }, &f);
+  }
+
+private:
+  void run_bands(size_t nbands, void (*fn_)(void*, size_t, size_t), void* arg_);
+  void work(size_t worker);
+  void thread_main(size_t worker);
+
+  // Range of bands initially assigned to one worker.  Other workers take
+  // bands from the same range, therefore the next band is handed out using
+  // an atomic counter.
+  struct alignas(64) range_type {
+    std::atomic<size_t> next;
+    size_t end;
+  };
+
+  const size_t nworkers;
+  std::unique_ptr<range_type[]> ranges;
+
+  void (*fn)(void*, size_t, size_t) = nullptr;
+  void* arg = nullptr;
+
+  // Incremented to start a new round of work.
+  std::atomic<uint64_t> generation = 0;
+  // Number of additional threads still working in the current round.
+  std::atomic<size_t> active = 0;
+  bool terminate = false;
+
+  std::vector<std::thread> threads;
+};
+
+#endif // worker-pool.hh